@@ -9,8 +9,17 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | expr (EQ | NE | LT | LE | GT | GE) expr  # Comparison
     | CELL  # Cell
+    | SHEET_CELL  # Cell
     | NUMBER  # Literal
+    | NAME '(' arg (',' arg)* ')'  # Function
+    ;
+
+// function argument: an expression or a rectangular range like A1:B10
+arg
+    : expr
+    | RANGE
     ;
 
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
@@ -26,5 +35,20 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+EQ: '=' ;
+NE: '<>' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
 CELL: [A-Z]+[0-9]+ ;
+// reference to a cell of another workbook sheet: Sheet2!A1 or 'My sheet'!A1
+SHEET_CELL: SHEET_NAME '!' [A-Z]+[0-9]+ ;
+fragment SHEET_NAME
+    : [A-Za-z_] [A-Za-z0-9_]*
+    | '\'' ~['\r\n]+ '\''
+    ;
+RANGE: [A-Z]+[0-9]+ ':' [A-Z]+[0-9]+ ;
+// function name: MATCH, VLOOKUP, XLOOKUP, IF, IFERROR, CHOOSE
+NAME: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
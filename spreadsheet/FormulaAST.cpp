@@ -3,17 +3,27 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "number_format.h"
+#include "stats.h"
 
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <climits>
 #include <cmath>
+#include <cstdint>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
+#include <unordered_map>
 
 namespace ASTImpl {
 
 enum ExprPrecedence {
+    EP_CMP,
     EP_ADD,
     EP_SUB,
     EP_MUL,
@@ -59,13 +69,33 @@ enum PrecedenceRule {
 //     (currently in the table we're always putting in the parentheses)
 // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
 // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+// (A < B) < C - always okay (comparisons are left-associative)
+// A < (B < C) - never okay
+// (A < B) + C, -(A < B) - never okay (a comparison has the lowest grammatic precedence)
 constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_CMP */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+};
+
+// cell references of a tree, cells of the formula sheet have an empty
+// sheet name
+struct CellReferences {
+    // read on every evaluation
+    std::vector<SheetPosition> always;
+    // read only when some branch of IF, IFERROR or CHOOSE is taken
+    std::vector<SheetPosition> conditional;
+};
+
+// list nodes of a copied tree by the list nodes of the original tree
+struct ReferenceMap {
+    std::unordered_map<const Position*, const Position*> cells;
+    std::unordered_map<const SheetPosition*, const SheetPosition*> external_cells;
+    std::unordered_map<const Range*, const Range*> ranges;
 };
 
 class Expr {
@@ -75,9 +105,43 @@ public:
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
     virtual double Evaluate(const SheetInterface& sheet) const = 0;
 
+    // value of the node as a function argument: a referenced cell gives
+    // its value as is, text included, other nodes give a number
+    virtual CellInterface::Value EvaluateValue(const SheetInterface& sheet) const {
+        return Evaluate(sheet);
+    }
+
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
+    // heap bytes taken by the node and its subtree
+    virtual size_t GetMemoryUsage() const = 0;
+
+    // appends valid cell references of the subtree to refs, conditional is
+    // true when the subtree is evaluated only in some branches
+    virtual void CollectCells(bool conditional, CellReferences& refs) const = 0;
+
+    // returns a copy of the subtree sharing the reference list nodes
+    virtual std::unique_ptr<Expr> Clone() const = 0;
+
+    // returns a copy of the subtree pointing into the reference lists of
+    // another tree, refs maps the list nodes of this tree to that tree's
+    virtual std::unique_ptr<Expr> Copy(const ReferenceMap& refs) const = 0;
+
+    // appends the postfix form of the subtree, returns false if the
+    // subtree can not be compiled
+    virtual bool Compile(FormulaProgram& program) const = 0;
+
+    // returns a simplified copy of the subtree with constant subexpressions
+    // folded and identity operations removed, or nullptr if there is
+    // nothing to simplify
+    virtual std::unique_ptr<Expr> Simplify() const = 0;
+
+    // value of a constant node
+    virtual std::optional<double> GetConstant() const {
+        return std::nullopt;
+    }
+
     void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
@@ -96,6 +160,36 @@ public:
 };
 
 namespace {
+double GetCellNumber(const CellInterface* cell) {
+    if (cell == nullptr) {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+    const auto value = cell->GetValue();
+    if (std::holds_alternative<std::string>(value)) {
+        std::string result = std::get<std::string>(value);
+        throw (result.empty())? FormulaError(FormulaError::Category::Ref)
+            :FormulaError(FormulaError::Category::Value);
+    }
+    else if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    else {
+        throw std::get<FormulaError>(value);
+    }
+}
+
+// Like GetCellNumber, but text is returned instead of being an error
+CellInterface::Value GetCellValue(const CellInterface* cell) {
+    if (cell == nullptr) {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+    auto value = cell->GetValue();
+    if (std::holds_alternative<FormulaError>(value)) {
+        throw std::get<FormulaError>(value);
+    }
+    return value;
+}
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -145,38 +239,195 @@ public:
 
     double Evaluate(const SheetInterface& sheet) const override {
         double left = lhs_.get()->Evaluate(sheet), right = rhs_.get()->Evaluate(sheet);
-        double result = HUGE_VAL;
+        double result = Apply(left, right);
+        if (std::isfinite(result)) {
+            return result;
+        }
+        else {
+            throw FormulaError(FormulaError::Category::Arithmetic);
+        }
+    }
+
+    size_t GetMemoryUsage() const override {
+        return memory::HeapBlock(sizeof(*this)) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+    void CollectCells(bool conditional, CellReferences& refs) const override {
+        lhs_->CollectCells(conditional, refs);
+        rhs_->CollectCells(conditional, refs);
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(), rhs_->Clone());
+    }
+
+    std::unique_ptr<Expr> Copy(const ReferenceMap& refs) const override {
+        return std::make_unique<BinaryOpExpr>(type_, lhs_->Copy(refs), rhs_->Copy(refs));
+    }
+
+    bool Compile(FormulaProgram& program) const override {
+        if (!lhs_->Compile(program) || !rhs_->Compile(program)) {
+            return false;
+        }
+        using OpCode = FormulaProgram::OpCode;
+        switch (type_) {
+            case Add:
+                program.ops.push_back({OpCode::Add});
+                break;
+            case Subtract:
+                program.ops.push_back({OpCode::Subtract});
+                break;
+            case Multiply:
+                program.ops.push_back({OpCode::Multiply});
+                break;
+            case Divide:
+                program.ops.push_back({OpCode::Divide});
+                break;
+            default:
+                assert(false);
+                return false;
+        }
+        return true;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override;
+
+private:
+    Type type_;
+    std::unique_ptr<Expr> lhs_;
+    std::unique_ptr<Expr> rhs_;
+
+    double Apply(double left, double right) const {
         switch (type_)
         {
         case Add:
-            result = left + right;
-            break;
+            return left + right;
         case Subtract:
-            result = left - right;
-            break;
+            return left - right;
         case Multiply:
-            result = left * right;
-            break;
+            return left * right;
         case Divide:
-            result = left / right;
-            break;
+            return left / right;
         default:
             // have to do this because VC++ has a buggy warning
             assert(false);
             return HUGE_VAL;
         }
-        if (std::isfinite(result)) {
-            return result;
+    }
+
+    // x-0, x*1 and x/1 give exactly x for any x; x+0 is kept
+    // because it turns -0 into +0
+    bool IsRightIdentity(double value) const {
+        return (type_ == Subtract && value == 0.0 && !std::signbit(value))
+            || ((type_ == Multiply || type_ == Divide) && value == 1.0);
+    }
+
+    bool IsLeftIdentity(double value) const {
+        return type_ == Multiply && value == 1.0;
+    }
+};
+
+// Comparison of two numbers or two texts, 1 if it holds and 0 otherwise;
+// a number compared with a text gives #VALUE!
+class ComparisonExpr final : public Expr {
+public:
+    enum Type : char {
+        Equal,
+        NotEqual,
+        Less,
+        LessOrEqual,
+        Greater,
+        GreaterOrEqual,
+    };
+
+    static constexpr std::string_view SIGNS[] = {"=", "<>", "<", "<=", ">", ">="};
+
+public:
+    explicit ComparisonExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+        : type_(type)
+        , lhs_(std::move(lhs))
+        , rhs_(std::move(rhs)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << SIGNS[type_] << ' ';
+        lhs_->Print(out);
+        out << ' ';
+        rhs_->Print(out);
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        lhs_->PrintFormula(out, precedence);
+        out << SIGNS[type_];
+        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_CMP;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        auto left = lhs_->EvaluateValue(sheet);
+        auto right = rhs_->EvaluateValue(sheet);
+        if (left.index() != right.index()) {
+            throw FormulaError(FormulaError::Category::Value);
         }
-        else {
-            throw FormulaError(FormulaError::Category::Arithmetic);
+        if (std::holds_alternative<double>(left)) {
+            return Apply(std::get<double>(left), std::get<double>(right)) ? 1 : 0;
         }
+        return Apply(std::get<std::string>(left), std::get<std::string>(right)) ? 1 : 0;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return memory::HeapBlock(sizeof(*this)) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
     }
 
+    void CollectCells(bool conditional, CellReferences& refs) const override {
+        lhs_->CollectCells(conditional, refs);
+        rhs_->CollectCells(conditional, refs);
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<ComparisonExpr>(type_, lhs_->Clone(), rhs_->Clone());
+    }
+
+    std::unique_ptr<Expr> Copy(const ReferenceMap& refs) const override {
+        return std::make_unique<ComparisonExpr>(type_, lhs_->Copy(refs), rhs_->Copy(refs));
+    }
+
+    // the postfix form has no comparison operations
+    bool Compile(FormulaProgram& /* program */) const override {
+        return false;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override;
+
 private:
     Type type_;
     std::unique_ptr<Expr> lhs_;
     std::unique_ptr<Expr> rhs_;
+
+    template <typename T>
+    bool Apply(const T& left, const T& right) const {
+        switch (type_) {
+            case Equal:
+                return left == right;
+            case NotEqual:
+                return left != right;
+            case Less:
+                return left < right;
+            case LessOrEqual:
+                return left <= right;
+            case Greater:
+                return left > right;
+            case GreaterOrEqual:
+                return left >= right;
+            default:
+                assert(false);
+                return false;
+        }
+    }
 };
 
 class UnaryOpExpr final : public Expr {
@@ -212,6 +463,34 @@ public:
             : -operand_.get()->Evaluate(sheet);
     }
 
+    size_t GetMemoryUsage() const override {
+        return memory::HeapBlock(sizeof(*this)) + operand_->GetMemoryUsage();
+    }
+
+    void CollectCells(bool conditional, CellReferences& refs) const override {
+        operand_->CollectCells(conditional, refs);
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<UnaryOpExpr>(type_, operand_->Clone());
+    }
+
+    std::unique_ptr<Expr> Copy(const ReferenceMap& refs) const override {
+        return std::make_unique<UnaryOpExpr>(type_, operand_->Copy(refs));
+    }
+
+    bool Compile(FormulaProgram& program) const override {
+        if (!operand_->Compile(program)) {
+            return false;
+        }
+        if (type_ == UnaryMinus) {
+            program.ops.push_back({FormulaProgram::OpCode::Negate});
+        }
+        return true;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override;
+
 private:
     Type type_;
     std::unique_ptr<Expr> operand_;
@@ -240,28 +519,118 @@ public:
     }
 
     double Evaluate(const SheetInterface& sheet) const override {
-        auto cell = sheet.GetCell(*cell_);
-        if (cell == nullptr) {
-            throw FormulaError::Category::Ref;
-        }
-        const auto value = cell->GetValue();
-        if (std::holds_alternative<std::string>(value)) {
-            std::string result = std::get<std::string>(value);
-            throw (result.empty())? FormulaError(FormulaError::Category::Ref)
-                :FormulaError(FormulaError::Category::Value);
+        if (!cell_->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
         }
-        else if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
+        return GetCellNumber(sheet.GetCell(*cell_));
+    }
+
+    CellInterface::Value EvaluateValue(const SheetInterface& sheet) const override {
+        if (!cell_->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
         }
-        else {
-            throw std::get<FormulaError>(value);
+        return GetCellValue(sheet.GetCell(*cell_));
+    }
+
+    size_t GetMemoryUsage() const override {
+        return memory::HeapBlock(sizeof(*this));
+    }
+
+    void CollectCells(bool conditional, CellReferences& refs) const override {
+        if (cell_->IsValid()) {
+            (conditional ? refs.conditional : refs.always).push_back({{}, *cell_});
         }
     }
 
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<CellExpr>(cell_);
+    }
+
+    std::unique_ptr<Expr> Copy(const ReferenceMap& refs) const override {
+        return std::make_unique<CellExpr>(refs.cells.at(cell_));
+    }
+
+    bool Compile(FormulaProgram& program) const override {
+        program.ops.push_back({FormulaProgram::OpCode::Cell, 0, cell_});
+        return true;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        return nullptr;
+    }
+
 private:
     const Position* cell_;
 };
 
+class ExternalCellExpr final : public Expr {
+public:
+    explicit ExternalCellExpr(const SheetPosition* cell)
+        : cell_(cell) {
+    }
+
+    void Print(std::ostream& out) const override {
+        if (!cell_->pos.IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << cell_->ToString();
+        }
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        auto other_sheet = sheet.FindSheet(cell_->sheet);
+        if (other_sheet == nullptr || !cell_->pos.IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return GetCellNumber(other_sheet->GetCell(cell_->pos));
+    }
+
+    CellInterface::Value EvaluateValue(const SheetInterface& sheet) const override {
+        auto other_sheet = sheet.FindSheet(cell_->sheet);
+        if (other_sheet == nullptr || !cell_->pos.IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return GetCellValue(other_sheet->GetCell(cell_->pos));
+    }
+
+    size_t GetMemoryUsage() const override {
+        return memory::HeapBlock(sizeof(*this));
+    }
+
+    void CollectCells(bool conditional, CellReferences& refs) const override {
+        if (cell_->pos.IsValid()) {
+            (conditional ? refs.conditional : refs.always).push_back(*cell_);
+        }
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<ExternalCellExpr>(cell_);
+    }
+
+    std::unique_ptr<Expr> Copy(const ReferenceMap& refs) const override {
+        return std::make_unique<ExternalCellExpr>(refs.external_cells.at(cell_));
+    }
+
+    bool Compile(FormulaProgram& /* program */) const override {
+        return false;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        return nullptr;
+    }
+
+private:
+    const SheetPosition* cell_;
+};
+
 class NumberExpr final : public Expr {
 public:
     explicit NumberExpr(double value)
@@ -269,11 +638,13 @@ public:
     }
 
     void Print(std::ostream& out) const override {
-        out << value_;
+        DoPrintFormula(out, EP_ATOM);
     }
 
+    // The shortest round-trip text, so the expression reparses to the same value
     void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+        char buffer[MAX_NUMBER_TEXT_SIZE];
+        out.write(buffer, FormatNumber(value_, buffer) - buffer);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -284,10 +655,428 @@ public:
         return value_;
     }
 
+    size_t GetMemoryUsage() const override {
+        return memory::HeapBlock(sizeof(*this));
+    }
+
+    void CollectCells(bool /* conditional */, CellReferences& /* refs */) const override {
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    std::unique_ptr<Expr> Copy(const ReferenceMap& /* refs */) const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    bool Compile(FormulaProgram& program) const override {
+        program.ops.push_back({FormulaProgram::OpCode::Number, value_});
+        return true;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        return nullptr;
+    }
+
+    std::optional<double> GetConstant() const override {
+        return value_;
+    }
+
 private:
     double value_;
 };
 
+// A range argument of a function, can not be evaluated by itself
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const Range* range)
+        : range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        if (!range_->IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << range_->first.ToString() << ':' << range_->last.ToString();
+        }
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& /* sheet */) const override {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return memory::HeapBlock(sizeof(*this));
+    }
+
+    // ranges are kept apart from cell references
+    void CollectCells(bool /* conditional */, CellReferences& /* refs */) const override {
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<RangeExpr>(range_);
+    }
+
+    std::unique_ptr<Expr> Copy(const ReferenceMap& refs) const override {
+        return std::make_unique<RangeExpr>(refs.ranges.at(range_));
+    }
+
+    bool Compile(FormulaProgram& /* program */) const override {
+        return false;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        return nullptr;
+    }
+
+    const Range& GetRange() const {
+        return *range_;
+    }
+
+private:
+    const Range* range_;
+};
+
+// MATCH(key, column[, type]) - 1-based index of the key in the column,
+//     type 1 (default) - exact or next smaller, 0 - exact, -1 - exact or next larger
+// VLOOKUP(key, range, index[, approximate]) - value in the column number index
+//     of the row where the first column of the range holds the key,
+//     approximate 1 (default) - exact or next smaller, 0 - exact
+// XLOOKUP(key, column, result[, mode]) - value of the result column in the row
+//     of the key, mode 0 (default) - exact, -1 - exact or next smaller,
+//     1 - exact or next larger
+// The key is compared with values of the same type only, #N/A if not found
+// IF(condition, then[, else]) - then if the condition is not zero, else
+//     otherwise, 0 if there is no else
+// IFERROR(value, fallback) - the value, or the fallback if the value is an error
+// CHOOSE(index, value1, value2, ...) - the value number index, #VALUE! if
+//     there is no such value
+// Conditional functions evaluate only the selected branch
+class FunctionExpr final : public Expr {
+public:
+    enum Type : char {
+        Match,
+        VLookup,
+        XLookup,
+        If,
+        IfError,
+        Choose,
+    };
+
+    struct Signature {
+        std::string_view name;
+        Type type;
+        size_t min_args;
+        size_t max_args;
+        // bit i is set when the argument i is a range
+        unsigned ranges;
+        // arguments starting from this one are evaluated only when selected
+        size_t first_branch;
+
+        bool IsRange(size_t index) const {
+            return index < sizeof(ranges) * CHAR_BIT && ((ranges >> index) & 1);
+        }
+    };
+
+    static constexpr size_t NO_BRANCHES = SIZE_MAX;
+
+    static constexpr Signature SIGNATURES[] = {
+        {"MATCH", Match, 2, 3, 0b010, NO_BRANCHES},
+        {"VLOOKUP", VLookup, 3, 4, 0b010, NO_BRANCHES},
+        {"XLOOKUP", XLookup, 3, 4, 0b110, NO_BRANCHES},
+        {"IF", If, 2, 3, 0, 1},
+        {"IFERROR", IfError, 2, 2, 0, 1},
+        {"CHOOSE", Choose, 2, 255, 0, 1},
+    };
+
+    // throws FormulaException if there is no such function or the
+    // arguments do not fit it
+    static const Signature& FindSignature(std::string_view name,
+                                          const std::vector<std::unique_ptr<Expr>>& args) {
+        for (const auto& signature : SIGNATURES) {
+            if (signature.name != name) {
+                continue;
+            }
+            if (args.size() < signature.min_args || args.size() > signature.max_args) {
+                throw FormulaException("Wrong number of arguments: " + std::string(name));
+            }
+            for (size_t i = 0; i < args.size(); ++i) {
+                bool is_range = dynamic_cast<const RangeExpr*>(args[i].get()) != nullptr;
+                if (is_range != signature.IsRange(i)) {
+                    throw FormulaException("Wrong argument type: " + std::string(name));
+                }
+            }
+            return signature;
+        }
+        throw FormulaException("Unknown function: " + std::string(name));
+    }
+
+public:
+    FunctionExpr(const Signature& signature, std::vector<std::unique_ptr<Expr>> args)
+        : signature_(signature)
+        , args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << signature_.name;
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    // arguments are separated by commas, so they never need parentheses
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << signature_.name << '(';
+        bool first = true;
+        for (const auto& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            arg->DoPrintFormula(out, arg->GetPrecedence());
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        switch (signature_.type) {
+            case If:
+                if (args_[0]->Evaluate(sheet) != 0) {
+                    return args_[1]->Evaluate(sheet);
+                }
+                return args_.size() > 2 ? args_[2]->Evaluate(sheet) : 0;
+            case IfError:
+                try {
+                    return args_[0]->Evaluate(sheet);
+                }
+                catch (const FormulaError&) {
+                    return args_[1]->Evaluate(sheet);
+                }
+            case Choose: {
+                const double index = std::trunc(args_[0]->Evaluate(sheet));
+                if (index < 1 || index >= args_.size()) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                return args_[static_cast<size_t>(index)]->Evaluate(sheet);
+            }
+            default:
+                return EvaluateLookup(sheet);
+        }
+    }
+
+    size_t GetMemoryUsage() const override {
+        size_t result = memory::HeapBlock(sizeof(*this)) + memory::VectorHeap(args_);
+        for (const auto& arg : args_) {
+            result += arg->GetMemoryUsage();
+        }
+        return result;
+    }
+
+    void CollectCells(bool conditional, CellReferences& refs) const override {
+        for (size_t i = 0; i < args_.size(); ++i) {
+            args_[i]->CollectCells(conditional || i >= signature_.first_branch, refs);
+        }
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        std::vector<std::unique_ptr<Expr>> args;
+        args.reserve(args_.size());
+        for (const auto& arg : args_) {
+            args.push_back(arg->Clone());
+        }
+        return std::make_unique<FunctionExpr>(signature_, std::move(args));
+    }
+
+    std::unique_ptr<Expr> Copy(const ReferenceMap& refs) const override {
+        std::vector<std::unique_ptr<Expr>> args;
+        args.reserve(args_.size());
+        for (const auto& arg : args_) {
+            args.push_back(arg->Copy(refs));
+        }
+        return std::make_unique<FunctionExpr>(signature_, std::move(args));
+    }
+
+    bool Compile(FormulaProgram& /* program */) const override {
+        return false;
+    }
+
+    std::unique_ptr<Expr> Simplify() const override {
+        std::vector<std::unique_ptr<Expr>> args;
+        args.reserve(args_.size());
+        bool simplified = false;
+        for (const auto& arg : args_) {
+            args.push_back(arg->Simplify());
+            if (args.back()) {
+                simplified = true;
+            } else {
+                args.back() = arg->Clone();
+            }
+        }
+        if (!simplified) {
+            return nullptr;
+        }
+        return std::make_unique<FunctionExpr>(signature_, std::move(args));
+    }
+
+private:
+    const Signature& signature_;
+    std::vector<std::unique_ptr<Expr>> args_;
+
+    double EvaluateLookup(const SheetInterface& sheet) const {
+        auto key = args_[0]->EvaluateValue(sheet);
+        const Range& range = GetRangeArg(1);
+        Range column{range.first, {range.last.row, range.first.col}};
+        switch (signature_.type) {
+            case Match: {
+                CheckSingleColumn(range);
+                auto mode = GetMode(sheet, 2, 1, {LookupMode::ExactOrLarger,
+                    LookupMode::Exact, LookupMode::ExactOrSmaller});
+                return Lookup(sheet, column, key, mode) - column.first.row + 1;
+            }
+            case VLookup: {
+                const double index = args_[2]->Evaluate(sheet);
+                if (index < 1) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                if (index >= range.last.col - range.first.col + 2) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                auto mode = GetMode(sheet, 3, 1, {LookupMode::ExactOrSmaller,
+                    LookupMode::Exact, LookupMode::ExactOrSmaller});
+                int row = Lookup(sheet, column, key, mode);
+                return GetCellNumber(sheet.GetCell({row,
+                    range.first.col + static_cast<int>(index) - 1}));
+            }
+            case XLookup: {
+                CheckSingleColumn(range);
+                const Range& result = GetRangeArg(2);
+                CheckSingleColumn(result);
+                if (result.GetSize().rows != range.GetSize().rows) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                auto mode = GetMode(sheet, 3, 0, {LookupMode::ExactOrSmaller,
+                    LookupMode::Exact, LookupMode::ExactOrLarger});
+                int row = Lookup(sheet, column, key, mode);
+                return GetCellNumber(sheet.GetCell({result.first.row + row - column.first.row,
+                    result.first.col}));
+            }
+            default:
+                assert(false);
+                return 0;
+        }
+    }
+
+    const Range& GetRangeArg(size_t index) const {
+        const Range& range = static_cast<const RangeExpr&>(*args_[index]).GetRange();
+        if (!range.IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return range;
+    }
+
+    static void CheckSingleColumn(const Range& range) {
+        if (range.first.col != range.last.col) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+    }
+
+    // the mode argument index selects modes[0] if negative, modes[1] if
+    // zero and modes[2] if positive
+    LookupMode GetMode(const SheetInterface& sheet, size_t index, int default_value,
+                       const std::array<LookupMode, 3>& modes) const {
+        double value = index < args_.size() ? args_[index]->Evaluate(sheet) : default_value;
+        return value < 0 ? modes[0] : value == 0 ? modes[1] : modes[2];
+    }
+
+    static int Lookup(const SheetInterface& sheet, Range column, const CellInterface::Value& key,
+                      LookupMode mode) {
+        auto row = sheet.LookupRow(column, key, mode);
+        if (!row) {
+            throw FormulaError(FormulaError::Category::NotAvailable);
+        }
+        return *row;
+    }
+};
+
+std::unique_ptr<Expr> BinaryOpExpr::Simplify() const {
+    auto lhs = lhs_->Simplify();
+    auto rhs = rhs_->Simplify();
+    auto take_lhs = [&] { return lhs ? std::move(lhs) : lhs_->Clone(); };
+    auto take_rhs = [&] { return rhs ? std::move(rhs) : rhs_->Clone(); };
+
+    auto left = (lhs ? *lhs : *lhs_).GetConstant();
+    auto right = (rhs ? *rhs : *rhs_).GetConstant();
+    if (left && right) {
+        double result = Apply(*left, *right);
+        // an arithmetic error is left to be reported on evaluation
+        if (std::isfinite(result)) {
+            return std::make_unique<NumberExpr>(result);
+        }
+    }
+    if (right && IsRightIdentity(*right)) {
+        return take_lhs();
+    }
+    if (left && IsLeftIdentity(*left)) {
+        return take_rhs();
+    }
+    if (!lhs && !rhs) {
+        return nullptr;
+    }
+    return std::make_unique<BinaryOpExpr>(type_, take_lhs(), take_rhs());
+}
+
+std::unique_ptr<Expr> UnaryOpExpr::Simplify() const {
+    auto operand = operand_->Simplify();
+    const Expr& simplified = operand ? *operand : *operand_;
+    auto take_operand = [&] { return operand ? std::move(operand) : operand_->Clone(); };
+
+    if (type_ == UnaryPlus) {
+        return take_operand();
+    }
+    if (auto value = simplified.GetConstant()) {
+        return std::make_unique<NumberExpr>(-*value);
+    }
+    // -(-x) == x
+    if (auto inner = dynamic_cast<const UnaryOpExpr*>(&simplified);
+        inner != nullptr && inner->type_ == UnaryMinus) {
+        return inner->operand_->Clone();
+    }
+    if (!operand) {
+        return nullptr;
+    }
+    return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+}
+
+std::unique_ptr<Expr> ComparisonExpr::Simplify() const {
+    auto lhs = lhs_->Simplify();
+    auto rhs = rhs_->Simplify();
+    auto left = (lhs ? *lhs : *lhs_).GetConstant();
+    auto right = (rhs ? *rhs : *rhs_).GetConstant();
+    if (left && right) {
+        return std::make_unique<NumberExpr>(Apply(*left, *right) ? 1 : 0);
+    }
+    if (!lhs && !rhs) {
+        return nullptr;
+    }
+    return std::make_unique<ComparisonExpr>(type_, lhs ? std::move(lhs) : lhs_->Clone(),
+                                            rhs ? std::move(rhs) : rhs_->Clone());
+}
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
     std::unique_ptr<Expr> MoveRoot() {
@@ -302,6 +1091,14 @@ public:
         return std::move(cells_);
     }
 
+    std::forward_list<SheetPosition> MoveExternalCells() {
+        return std::move(external_cells_);
+    }
+
+    std::forward_list<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -334,6 +1131,10 @@ public:
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
+        if (ctx->SHEET_CELL() != nullptr) {
+            exitSheetCell(ctx->SHEET_CELL()->getSymbol()->getText());
+            return;
+        }
         auto value_str = ctx->CELL()->getSymbol()->getText();
         auto value = Position::FromString(value_str);
         if (!value.IsValid()) {
@@ -369,13 +1170,92 @@ public:
         args_.back() = std::move(node);
     }
 
+    void exitComparison(FormulaParser::ComparisonContext* ctx) override {
+        assert(args_.size() >= 2);
+
+        auto rhs = std::move(args_.back());
+        args_.pop_back();
+
+        auto lhs = std::move(args_.back());
+
+        ComparisonExpr::Type type;
+        if (ctx->EQ()) {
+            type = ComparisonExpr::Equal;
+        } else if (ctx->NE()) {
+            type = ComparisonExpr::NotEqual;
+        } else if (ctx->LT()) {
+            type = ComparisonExpr::Less;
+        } else if (ctx->LE()) {
+            type = ComparisonExpr::LessOrEqual;
+        } else if (ctx->GT()) {
+            type = ComparisonExpr::Greater;
+        } else {
+            assert(ctx->GE() != nullptr);
+            type = ComparisonExpr::GreaterOrEqual;
+        }
+
+        auto node = std::make_unique<ComparisonExpr>(type, std::move(lhs), std::move(rhs));
+        args_.back() = std::move(node);
+    }
+
+    void exitArg(FormulaParser::ArgContext* ctx) override {
+        // an expression argument is already on the stack
+        if (ctx->RANGE() == nullptr) {
+            return;
+        }
+        auto value_str = ctx->RANGE()->getSymbol()->getText();
+        auto separator = value_str.find(':');
+        auto first = Position::FromString(std::string_view(value_str).substr(0, separator));
+        auto last = Position::FromString(std::string_view(value_str).substr(separator + 1));
+        if (!first.IsValid() || !last.IsValid()) {
+            throw FormulaException("Invalid range: " + value_str);
+        }
+        // B10:A1 is the same range as A1:B10
+        ranges_.push_front({{std::min(first.row, last.row), std::min(first.col, last.col)},
+                            {std::max(first.row, last.row), std::max(first.col, last.col)}});
+        auto node = std::make_unique<RangeExpr>(&ranges_.front());
+        args_.push_back(std::move(node));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const size_t count = ctx->arg().size();
+        assert(args_.size() >= count);
+
+        std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - count),
+                                                std::make_move_iterator(args_.end()));
+        args_.resize(args_.size() - count);
+
+        const auto& signature =
+            FunctionExpr::FindSignature(ctx->NAME()->getSymbol()->getText(), args);
+        auto node = std::make_unique<FunctionExpr>(signature, std::move(args));
+        args_.push_back(std::move(node));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
 private:
+    void exitSheetCell(const std::string& value_str) {
+        auto separator = value_str.rfind('!');
+        std::string sheet = value_str.substr(0, separator);
+        if (sheet.front() == '\'') {
+            sheet = sheet.substr(1, sheet.size() - 2);
+        }
+        auto value = Position::FromString(std::string_view(value_str).substr(separator + 1));
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + value_str);
+        }
+
+        external_cells_.push_front({std::move(sheet), value});
+        auto node = std::make_unique<ExternalCellExpr>(&external_cells_.front());
+        args_.push_back(std::move(node));
+    }
+
     std::vector<std::unique_ptr<Expr>> args_;
     std::forward_list<Position> cells_;
+    std::forward_list<SheetPosition> external_cells_;
+    std::forward_list<Range> ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -388,36 +1268,75 @@ public:
     }
 };
 
-}  // namespace
-}  // namespace ASTImpl
-
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
-
-    ANTLRInputStream input(in);
+// Lexer, token stream and parser that are set up once per thread and
+// reset for every formula instead of being constructed from scratch
+class ParserSession {
+public:
+    ParserSession()
+        : lexer_(&input_)
+        , tokens_(&lexer_)
+        , parser_(&tokens_) {
+        lexer_.removeErrorListeners();
+        lexer_.addErrorListener(&error_listener_);
+        parser_.setErrorHandler(std::make_shared<antlr4::BailErrorStrategy>());
+        parser_.removeErrorListeners();
+    }
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+    ParserSession(const ParserSession&) = delete;
+    ParserSession& operator=(const ParserSession&) = delete;
+
+    FormulaAST Parse(std::string_view text) {
+        using namespace antlr4;
+
+        input_.load(text.data(), text.size());
+        lexer_.setInputStream(&input_);
+        tokens_.setTokenSource(&lexer_);
+        parser_.setTokenStream(&tokens_);
+
+        // SLL prediction is enough for almost every input and is much
+        // cheaper. With the bail strategy it throws on both real syntax
+        // errors and SLL conflicts, so the input is parsed again in full LL
+        // mode, which either succeeds or reports the actual error.
+        auto interpreter = parser_.getInterpreter<atn::ParserATNSimulator>();
+        interpreter->setPredictionMode(atn::PredictionMode::SLL);
+        tree::ParseTree* tree = nullptr;
+        try {
+            tree = parser_.main();
+        }
+        catch (const ParseCancellationException&) {
+            tokens_.seek(0);
+            parser_.reset();
+            interpreter->setPredictionMode(atn::PredictionMode::LL);
+            tree = parser_.main();
+        }
 
-    CommonTokenStream tokens(&lexer);
+        // the tree is owned by the parser and freed on its next reset
+        ParseASTListener listener;
+        tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+        return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveExternalCells(),
+                          listener.MoveRanges());
+    }
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+private:
+    // declared first: the lexer keeps a pointer to it
+    BailErrorListener error_listener_;
+    antlr4::ANTLRInputStream input_;
+    FormulaLexer lexer_;
+    antlr4::CommonTokenStream tokens_;
+    FormulaParser parser_;
+};
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+}  // namespace
+}  // namespace ASTImpl
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+FormulaAST ParseFormulaAST(std::istream& in) {
+    std::string text{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(text);
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+FormulaAST ParseFormulaAST(std::string_view text) {
+    thread_local ASTImpl::ParserSession session;
+    return session.Parse(text);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -435,13 +1354,97 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
 }
 
 double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+    if (constant_) {
+        return *constant_;
+    }
+    return (eval_expr_ ? eval_expr_ : root_expr_)->Evaluate(sheet);
+}
+
+std::vector<SheetPosition> FormulaAST::GetConditionalCells() const {
+    if (!has_conditional_cells_) {
+        return {};
+    }
+    ASTImpl::CellReferences refs;
+    root_expr_->CollectCells(false, refs);
+    std::sort(refs.always.begin(), refs.always.end());
+    std::sort(refs.conditional.begin(), refs.conditional.end());
+    refs.conditional.erase(std::unique(refs.conditional.begin(), refs.conditional.end()),
+                           refs.conditional.end());
+    std::vector<SheetPosition> result;
+    std::set_difference(refs.conditional.begin(), refs.conditional.end(), refs.always.begin(),
+                        refs.always.end(), std::back_inserter(result));
+    return result;
+}
+
+bool FormulaAST::Compile(FormulaProgram& program) const {
+    program.ops.clear();
+    if (constant_) {
+        program.ops.push_back({FormulaProgram::OpCode::Number, *constant_});
+        return true;
+    }
+    return (eval_expr_ ? eval_expr_ : root_expr_)->Compile(program);
+}
+
+size_t FormulaAST::GetMemoryUsage() const {
+    size_t result = root_expr_->GetMemoryUsage();
+    if (eval_expr_) {
+        result += eval_expr_->GetMemoryUsage();
+    }
+    for ([[maybe_unused]] const auto& cell : cells_) {
+        result += memory::HeapBlock(sizeof(void*) + sizeof(Position));
+    }
+    for (const auto& cell : external_cells_) {
+        result += memory::HeapBlock(sizeof(void*) + sizeof(SheetPosition))
+            + memory::StringHeap(cell.sheet);
+    }
+    for ([[maybe_unused]] const auto& range : ranges_) {
+        result += memory::HeapBlock(sizeof(void*) + sizeof(Range));
+    }
+    return result;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::forward_list<SheetPosition> external_cells,
+                       std::forward_list<Range> ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , external_cells_(std::move(external_cells))
+    , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    external_cells_.sort();
+
+    // the folded tree shares cell positions with root_expr_, so references
+    // updated on row and column changes stay in sync in both trees
+    ASTImpl::CellReferences refs;
+    root_expr_->CollectCells(false, refs);
+    has_conditional_cells_ = !refs.conditional.empty();
+
+    eval_expr_ = root_expr_->Simplify();
+    constant_ = (eval_expr_ ? *eval_expr_ : *root_expr_).GetConstant();
+    if (constant_) {
+        eval_expr_.reset();
+    }
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) noexcept = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) noexcept = default;
 FormulaAST::~FormulaAST() = default;
+
+FormulaAST FormulaAST::Copy() const {
+    // forward_list keeps its nodes on move and sort, so the addresses
+    // recorded here stay valid inside the new FormulaAST
+    ASTImpl::ReferenceMap refs;
+    auto copy_list = [](const auto& list, auto& map) {
+        auto copy = list;
+        auto node = copy.begin();
+        for (const auto& item : list) {
+            map.emplace(&item, &*node++);
+        }
+        return copy;
+    };
+    auto cells = copy_list(cells_, refs.cells);
+    auto external_cells = copy_list(external_cells_, refs.external_cells);
+    auto ranges = copy_list(ranges_, refs.ranges);
+    return FormulaAST(root_expr_->Copy(refs), std::move(cells), std::move(external_cells),
+                      std::move(ranges));
+}
@@ -2,9 +2,11 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "formula.h"
 
 #include <forward_list>
 #include <functional>
+#include <optional>
 #include <stdexcept>
 #include "sheet.h"
 
@@ -19,16 +21,25 @@ class ParsingError : public std::runtime_error {
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        std::forward_list<Position> cells,
+                        std::forward_list<SheetPosition> external_cells = {},
+                        std::forward_list<Range> ranges = {});
+    FormulaAST(FormulaAST&&) noexcept;
+    FormulaAST& operator=(FormulaAST&&) noexcept;
     ~FormulaAST();
 
+    // a deep copy that owns its trees and reference lists, made without
+    // parsing the formula again
+    FormulaAST Copy() const;
+
     double Execute(const SheetInterface& sheet) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
+    // heap bytes taken by the AST nodes and the cell lists
+    size_t GetMemoryUsage() const;
+
     std::forward_list<Position>& GetCells() {
         return cells_;
     }
@@ -37,14 +48,64 @@ public:
         return cells_;
     }
 
+    std::forward_list<SheetPosition>& GetExternalCells() {
+        return external_cells_;
+    }
+
+    const std::forward_list<SheetPosition>& GetExternalCells() const {
+        return external_cells_;
+    }
+
+    // ranges passed to lookup functions, like A1:B10
+    std::forward_list<Range>& GetRanges() {
+        return ranges_;
+    }
+
+    const std::forward_list<Range>& GetRanges() const {
+        return ranges_;
+    }
+
+    // cells read only when some branch of IF, IFERROR or CHOOSE is taken,
+    // sorted and unique; cells of the formula sheet have an empty sheet name
+    std::vector<SheetPosition> GetConditionalCells() const;
+
+    // builds the postfix form of the evaluation tree, returns false if
+    // the formula can not be compiled
+    bool Compile(FormulaProgram& program) const;
+
+    // true if the formula is evaluated without walking the tree
+    bool IsConstant() const {
+        return constant_.has_value();
+    }
+
 private:
+    // the tree as the user typed it, used for printing
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
+    // the tree used for evaluation: constant subtrees folded and identity
+    // operations removed, nullptr if root_expr_ has nothing to simplify
+    std::unique_ptr<ASTImpl::Expr> eval_expr_;
+
+    // the value of a formula without cell references
+    std::optional<double> constant_;
+
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+
+    // cells of other workbook sheets, kept apart from cells_
+    // so that sheet-local references stay plain positions
+    std::forward_list<SheetPosition> external_cells_;
+
+    // range arguments of functions, RangeExpr nodes point into the list
+    std::forward_list<Range> ranges_;
+
+    // true if some cell is referenced only inside a conditional branch
+    bool has_conditional_cells_ = false;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+
+// parses with a reusable per-thread lexer and parser, SLL prediction first
+FormulaAST ParseFormulaAST(std::string_view text);
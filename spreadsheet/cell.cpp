@@ -1,16 +1,80 @@
 #include "cell.h"
+#include "number_format.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <utility>
 
-Cell::Cell(Sheet& sheet)
+namespace {
+// Ячейки, прочитанные формулой с условными функциями, которую вычисляет
+// поток, nullptr - вычисляется формула без них
+thread_local std::vector<CellId>* current_reads = nullptr;
+
+// Поток вычисляет формулу, и формулы без значения в кэше, которые она
+// читает, вычисляются не рекурсивно, а в стеке Cell::Evaluate
+thread_local bool defer_evaluation = false;
+
+// Формула без значения в кэше, которую прочитала вычисляемая формула
+struct DeferredEvaluation {
+    const Cell* cell;
+};
+
+// Устанавливает current_reads и defer_evaluation на время вычисления формулы
+class EvaluationScope {
+public:
+    explicit EvaluationScope(std::vector<CellId>* reads)
+        :outer_reads_(std::exchange(current_reads, reads))
+        ,outer_defer_(std::exchange(defer_evaluation, true))
+    {
+    }
+
+    EvaluationScope(const EvaluationScope&) = delete;
+    EvaluationScope& operator=(const EvaluationScope&) = delete;
+
+    ~EvaluationScope() {
+        current_reads = outer_reads_;
+        defer_evaluation = outer_defer_;
+    }
+
+private:
+    std::vector<CellId>* outer_reads_;
+    bool outer_defer_;
+};
+}  // namespace
+
+Cell::Cell(Sheet& sheet, Position pos)
     :impl_(std::make_unique<EmptyImpl>())
     ,sheet_(sheet)
+    ,pos_(pos)
+    ,id_(sheet.GetCellTable().Add(this))
 {
 }
 
+Cell::~Cell() {
+    sheet_.RemoveDirtyFormula(this);
+    sheet_.GetCellTable().Remove(id_);
+}
+
+void* Cell::operator new(std::size_t size, CellAllocator& allocator) {
+    assert(size == sizeof(Cell));
+    return allocator.Allocate();
+}
+
+void Cell::operator delete(void* ptr, CellAllocator& /* allocator */) {
+    CellAllocator::Deallocate(ptr);
+}
+
+void Cell::operator delete(void* ptr) {
+    if (ptr != nullptr) {
+        CellAllocator::Deallocate(ptr);
+    }
+}
+
 void Cell::Set(std::string text) {
     auto size = text.size();
     if (size == 0) {
@@ -18,109 +82,551 @@ void Cell::Set(std::string text) {
     }
     auto iter = text.begin();
     if (*iter == FORMULA_SIGN && size > 1) {
-        ++iter;
-        impl_.reset(new FormulaImpl(std::string{ std::make_move_iterator(iter),
-            std::make_move_iterator(text.end()) }, sheet_));
+        auto& cache = sheet_.GetFormulaCache();
+        auto& stats = sheet_.GetStatsCounters();
+        std::string_view expression(text);
+        expression.remove_prefix(1);
+        auto formula = cache.Find(expression);
+        if (formula != nullptr) {
+            stats.AddFormulaCacheHit();
+        }
+        else {
+            stats.AddFormulaCacheMiss();
+            auto parse_start = std::chrono::steady_clock::now();
+            {
+                trace::Span span("ParseFormula", pos_);
+                formula = ParseFormula(std::string(expression));
+            }
+            stats.AddParse(std::chrono::steady_clock::now() - parse_start);
+            cache.Add(std::string(expression), *formula);
+        }
+        impl_.reset(new FormulaImpl(std::move(formula), sheet_));
+        kind_ = Kind::Formula;
         AddChildrens();
         return;
     }
+    bool apostrophe = false;
     if (*iter == ESCAPE_SIGN) {
         ++iter;
-        impl_.reset(new TextImpl(std::string{ std::make_move_iterator(iter),
-        std::make_move_iterator(text.end())}, true));
-        return;
+        apostrophe = true;
+    }
+    std::string body{ std::make_move_iterator(iter), std::make_move_iterator(text.end()) };
+    if (sheet_.IsStringInterningEnabled()) {
+        impl_.reset(new PooledTextImpl(sheet_.GetStringPool().Intern(std::move(body)), apostrophe));
     }
     else {
-        impl_.reset(new TextImpl(std::string{ std::make_move_iterator(iter),
-            std::make_move_iterator(text.end()) }));
-    } 
+        impl_.reset(new TextImpl(std::move(body), apostrophe));
+    }
+    kind_ = Kind::Text;
 }
 
 void Cell::Clear() {
     for (auto child : childrens_) {
-        child->EraseParent(this);
+        GetCellById(child)->EraseParent(id_);
     }
+    childrens_.clear();
+    EraseRanges();
     impl_.reset(new EmptyImpl());
+    kind_ = Kind::Empty;
+    number_text_.clear();
 }
 
 Cell::Value Cell::GetValue() const {
+    // В режиме Async значение могут одновременно вычислять поток пересчета
+    // и читающий поток
+    auto lock = LockIfAsync(sheet_.GetCellTable());
+    if (current_reads != nullptr) {
+        current_reads->push_back(id_);
+    }
+    auto& stats = sheet_.GetStatsCounters();
     if (!cache_value_.has_value()) {
-        cache_value_.emplace(impl_.get()->GetValue());
+        stats.AddCacheMiss();
+        if (kind_ != Kind::Formula) {
+            return impl_.get()->GetValue();
+        }
+        if (defer_evaluation) {
+            throw DeferredEvaluation{this};
+        }
+        Evaluate();
+    }
+    else {
+        stats.AddCacheHit();
     }
     return cache_value_.value();
 }
+
+const Cell* Cell::EvaluateStep(size_t& index) const {
+    if (cache_value_.has_value() || kind_ != Kind::Formula) {
+        return nullptr;
+    }
+    while (index < childrens_.size()) {
+        auto child_id = childrens_[index++];
+        auto child = GetCellById(child_id);
+        if (!child->cache_value_.has_value() && child->kind_ == Kind::Formula
+            && !IsConditionalChild(child_id)) {
+            // Вычисление заранее заменяет обращение к значению ячейки
+            child->sheet_.GetStatsCounters().AddCacheMiss();
+            return child;
+        }
+    }
+    // Затем формулы столбцов поиска, которые прочитает функция поиска.
+    // После ссылок index нумерует строки областей формулы подряд.
+    size_t first = childrens_.size();
+    for (const auto& range : GetRanges()) {
+        if (!range.IsValid()) {
+            continue;
+        }
+        const size_t end = first + range.GetSize().rows;
+        while (index < end) {
+            auto row = sheet_.FindUnreadLookupFormula(range.first.col,
+                range.first.row + static_cast<int>(index - first), range.last.row);
+            if (!row) {
+                index = end;
+                break;
+            }
+            index = first + (*row - range.first.row) + 1;
+            auto cell = sheet_.GetConcreteCell({ *row, range.first.col });
+            if (!cell->cache_value_.has_value()) {
+                sheet_.GetStatsCounters().AddCacheMiss();
+                return cell;
+            }
+        }
+        first = end;
+    }
+    return EvaluateFormula();
+}
+
+void Cell::Evaluate() const {
+    // Ячейка и индекс следующей проверяемой ссылки. Формула вычисляется,
+    // когда вычислены все формулы, на которые она ссылается, поэтому
+    // GetValue этих формул не уходит в рекурсию. Ссылки из ветвей условных
+    // функций заранее не вычисляются: если формула прочитает такую ячейку
+    // без значения в кэше, ячейка добавляется в стек, а формула вычисляется
+    // заново после нее. Циклов в графе нет, так что стек конечен.
+    std::vector<std::pair<const Cell*, size_t>> stack{{this, 0}};
+    while (!stack.empty()) {
+        auto& [cell, index] = stack.back();
+        if (auto next = cell->EvaluateStep(index)) {
+            stack.push_back({next, 0});
+        }
+        else {
+            stack.pop_back();
+        }
+    }
+}
+
+const Cell* Cell::EvaluateFormula() const {
+    // Формула могла быть вычислена раньше по другому пути
+    if (cache_value_.has_value()) {
+        return nullptr;
+    }
+    trace::Span span("Cell::GetValue", pos_);
+    auto conditional = impl_.get()->GetConditionalChildren();
+    std::vector<CellId> reads;
+    {
+        EvaluationScope scope(conditional != nullptr ? &reads : nullptr);
+        try {
+            cache_value_.emplace(impl_.get()->GetValue());
+        }
+        catch (const DeferredEvaluation& deferred) {
+            return deferred.cell;
+        }
+    }
+    sheet_.GetStatsCounters().AddEvaluation();
+    if (conditional != nullptr) {
+        conditional->SetReads(std::move(reads));
+    }
+    return nullptr;
+}
+
 std::string Cell::GetText() const {
     return impl_.get()->GetText();
 }
 
 void Cell::AddChildrens() {
-    const auto& ref_cells = GetReferencedCells();
-    std::vector<Position> new_cells(ref_cells.size());
+    const auto conditional = impl_.get()->GetFormula()->GetConditionalCells();
+    // Ссылки из ветвей условных функций и остальные ссылки
+    std::vector<CellId> branch_ids, other_ids;
+    auto classify = [&](const SheetPosition& ref) {
+        if (!conditional.empty()) {
+            bool in_branch = std::binary_search(conditional.begin(), conditional.end(), ref);
+            (in_branch ? branch_ids : other_ids).push_back(childrens_.back());
+        }
+    };
+    std::vector<std::pair<Sheet*, Position>> new_cells;
     try {
-        for (auto pos : ref_cells) {
-            auto cell = sheet_.GetConcreteCell(pos);
-            if (cell == nullptr) {
-                cell = sheet_.NewCell(pos);
-                new_cells.push_back(pos);
+        for (auto pos : GetReferencedCells()) {
+            AddChild(sheet_, pos, new_cells);
+            classify({{}, pos});
+        }
+        for (const auto& ref : GetExternalReferencedCells()) {
+            auto sheet = sheet_.FindConcreteSheet(ref.sheet);
+            if (sheet == nullptr) {
+                throw FormulaException("unknown sheet: " + ref.sheet);
             }
-            childrens_.push_back(cell);
+            AddChild(*sheet, ref.pos, new_cells);
+            classify(ref);
         }
     }
-    catch (InvalidPositionException& exc) {
-        for (auto new_cell : new_cells) {
-            sheet_.ClearCell(new_cell);
+    catch (...) {
+        childrens_.clear();
+        // Ячейки еще не видны подписчикам, поэтому удаляются без уведомлений
+        for (auto [sheet, pos] : new_cells) {
+            sheet->RemoveNewCell(pos);
         }
-        throw exc;
+        throw;
     }
+    if (branch_ids.empty()) {
+        return;
+    }
+    // Ячейка листа формулы может быть указана и с именем листа
+    std::sort(branch_ids.begin(), branch_ids.end());
+    std::sort(other_ids.begin(), other_ids.end());
+    auto children = std::make_unique<ConditionalChildren>();
+    std::set_difference(branch_ids.begin(), branch_ids.end(), other_ids.begin(), other_ids.end(),
+        std::back_inserter(children->cells));
+    // Ячейки ветвей еще не читались
+    children->unread = children->cells;
+    // AddChildrens вызывается только для формульных ячеек
+    static_cast<FormulaImpl&>(*impl_).conditional_ = std::move(children);
+}
+
+void Cell::AddChild(Sheet& sheet, Position pos,
+    std::vector<std::pair<Sheet*, Position>>& new_cells) {
+    // Число, которое хранилось только в столбцах листа, получает ячейку
+    auto cell = sheet.MaterializeCell(pos);
+    if (cell == nullptr) {
+        cell = sheet.NewCell(pos);
+        new_cells.push_back({ &sheet, pos });
+        sheet_.GetStatsCounters().AddPlaceholderCell();
+    }
+    childrens_.push_back(cell->id_);
 }
 
 bool Cell::FindCircularDependency(Cell* cell) {
-    for (auto child : childrens_) {
-        if (child == cell) {
+    if (sheet_.GetCellTable().HasRangeDependents() || !GetRanges().empty()) {
+        return FindDependentCycle(cell);
+    }
+    auto& stats = sheet_.GetStatsCounters();
+    stats.AddCycleCheckVisit();
+    // Путь к cell заканчивается ячейкой, которая на нее ссылается, поэтому
+    // без таких ячеек цикл возможен только при прямой ссылке на cell
+    if (cell->parents_.empty()) {
+        return std::find(childrens_.begin(), childrens_.end(), cell->id_) != childrens_.end();
+    }
+    std::vector<std::uint64_t> visited((sheet_.GetCellTable().GetCapacity() + 63) / 64);
+    std::vector<CellId> stack(childrens_.begin(), childrens_.end());
+    while (!stack.empty()) {
+        CellId id = stack.back();
+        stack.pop_back();
+        if (id == cell->id_) {
+            return true;
+        }
+        auto& word = visited[id / 64];
+        const std::uint64_t bit = std::uint64_t{1} << (id % 64);
+        if (word & bit) {
+            continue;
+        }
+        word |= bit;
+        stats.AddCycleCheckVisit();
+        const auto& childrens = GetCellById(id)->childrens_;
+        stack.insert(stack.end(), childrens.begin(), childrens.end());
+    }
+    return false;
+}
+
+bool Cell::FindDependentCycle(Cell* cell) {
+    auto& stats = sheet_.GetStatsCounters();
+    const auto ranges = GetRanges();
+    auto is_read = [&](const Cell* other) {
+        if (std::find(childrens_.begin(), childrens_.end(), other->id_) != childrens_.end()) {
             return true;
         }
-        if (child->FindCircularDependency(cell)) {
+        if (&other->sheet_ != &sheet_) {
+            return false;
+        }
+        return std::any_of(ranges.begin(), ranges.end(), [other](Range range) {
+            return range.Contains(other->pos_);
+        });
+    };
+    std::vector<std::uint64_t> visited((sheet_.GetCellTable().GetCapacity() + 63) / 64);
+    std::vector<Cell*> stack;
+    auto push = [&](CellId id) {
+        auto& word = visited[id / 64];
+        const std::uint64_t bit = std::uint64_t{1} << (id % 64);
+        if (!(word & bit)) {
+            word |= bit;
+            stack.push_back(GetCellById(id));
+        }
+    };
+    push(cell->id_);
+    while (!stack.empty()) {
+        const Cell* other = stack.back();
+        stack.pop_back();
+        stats.AddCycleCheckVisit();
+        if (is_read(other)) {
             return true;
         }
+        for (auto parent : other->parents_) {
+            push(parent);
+        }
+        other->sheet_.GetRangeDependencies().ForEachDependent(other->pos_, push);
     }
     return false;
 }
 
-void Cell::AddParent(Cell* parent) {
+void Cell::AddParent(CellId parent) {
     parents_.insert(parent);
 }
 
-void Cell::EraseParent(Cell* parent) {
+void Cell::EraseParent(CellId parent) {
     auto ptr = parents_.find(parent);
     if (ptr != parents_.end()) {
         parents_.erase(ptr);
     }
 }
 
-void Cell::CacheInvalidation() {
-    cache_value_.reset();
-    for (auto& parent : parents_) {
-        
-        parent->CacheInvalidation();
+void Cell::EraseChild(CellId child) {
+    childrens_.erase(std::remove(childrens_.begin(), childrens_.end(), child),
+        childrens_.end());
+    if (auto conditional = impl_.get()->GetConditionalChildren()) {
+        for (auto ids : {&conditional->cells, &conditional->unread}) {
+            ids->erase(std::remove(ids->begin(), ids->end(), child), ids->end());
+        }
+    }
+}
+
+bool Cell::IsConditionalChild(CellId child) const {
+    auto conditional = impl_.get()->GetConditionalChildren();
+    return conditional != nullptr
+        && std::binary_search(conditional->cells.begin(), conditional->cells.end(), child);
+}
+
+bool Cell::IsUnreadChild(CellId child) const {
+    auto conditional = impl_.get()->GetConditionalChildren();
+    return conditional != nullptr
+        && std::binary_search(conditional->unread.begin(), conditional->unread.end(), child);
+}
+
+void Cell::EraseRanges() {
+    if (sheet_.GetRangeDependencies().Remove(id_)) {
+        sheet_.GetCellTable().AddRangeDependents(-1);
+    }
+}
+
+void Cell::ResetRanges() {
+    EraseRanges();
+    auto ranges = GetRanges();
+    if (!ranges.empty()) {
+        sheet_.GetRangeDependencies().Add(id_, ranges);
+        sheet_.GetCellTable().AddRangeDependents(1);
+    }
+}
+
+bool Cell::HasCachedValue() const {
+    return cache_value_.has_value();
+}
+
+const std::optional<Cell::Value>& Cell::GetCachedValue() const {
+    return cache_value_;
+}
+
+void Cell::SetCachedValue(Value value) const {
+    cache_value_ = std::move(value);
+    number_text_.clear();
+}
+
+Cell::Value Cell::GetComputedValue() const {
+    if (cache_value_.has_value()) {
+        return *cache_value_;
     }
+    assert(kind_ != Kind::Formula);
+    return impl_.get()->GetValue();
 }
 
-void Cell::ResetContent(Cell* other) {
+const std::string& Cell::GetNumberText(std::uint64_t& formats) const {
+    auto lock = LockIfAsync(sheet_.GetCellTable());
+    if (number_text_.empty()) {
+        auto value = GetComputedValue();
+        assert(std::holds_alternative<double>(value));
+        char buffer[MAX_NUMBER_TEXT_SIZE];
+        number_text_.assign(buffer,
+            FormatNumber(std::get<double>(value), buffer, PRINT_COLUMN_WIDTH));
+        ++formats;
+    }
+    return number_text_;
+}
+
+void Cell::AddMemoryUsage(MemoryUsage& usage) const {
+    ++usage.cells;
+    // Объект ячейки занимает место в пуле таблицы слотов без заголовка
+    // блока кучи. Кэш хранится внутри объекта, но учитывается отдельно.
+    usage.cell_storage += sizeof(Cell) - sizeof(cache_value_)
+        - sizeof(number_text_);
+    // Слот ячейки в таблице идентификаторов
+    usage.cell_storage += sizeof(Cell*);
+    impl_.get()->AddMemoryUsage(usage);
+    usage.cached_values += sizeof(cache_value_) + sizeof(number_text_)
+        + memory::StringHeap(number_text_);
+    if (cache_value_.has_value() && std::holds_alternative<std::string>(*cache_value_)) {
+        usage.cached_values += memory::StringHeap(std::get<std::string>(*cache_value_));
+    }
+    usage.dependency_edges += memory::HashTableHeap(parents_) + memory::VectorHeap(childrens_);
+}
+
+size_t Cell::CacheInvalidation(std::vector<InvalidatedCell>* invalidated) {
+    size_t count = 0;
+    std::vector<Cell*> stack;
+    auto invalidate = [&](Cell* cell) {
+        if (invalidated != nullptr) {
+            invalidated->push_back({cell, std::move(cell->cache_value_)});
+        }
+        cell->cache_value_.reset();
+        cell->number_text_.clear();
+        if (cell->kind_ == Kind::Formula) {
+            cell->sheet_.AddDirtyFormula(cell);
+        }
+        ++count;
+        auto push = [&](CellId parent_id) {
+            auto parent = GetCellById(parent_id);
+            // Ячейка без кэша уже инвалидирована вместе со всеми ячейками,
+            // которые читали ее значение
+            if (parent->cache_value_.has_value()) {
+                stack.push_back(parent);
+            }
+        };
+        for (auto parent_id : cell->parents_) {
+            // Значение формулы в кэше вычислено без этой ячейки
+            if (!GetCellById(parent_id)->IsUnreadChild(cell->id_)) {
+                push(parent_id);
+            }
+        }
+        cell->sheet_.GetRangeDependencies().ForEachDependent(cell->pos_, push);
+    };
+    invalidate(this);
+    while (!stack.empty()) {
+        auto cell = stack.back();
+        stack.pop_back();
+        // Ячейка могла попасть в стек несколько раз по разным путям
+        if (cell->cache_value_.has_value()) {
+            invalidate(cell);
+        }
+    }
+    return count;
+}
+
+void Cell::ResetContent(Cell* other, std::vector<InvalidatedCell>* invalidated) {
     for (auto child : childrens_) {
-        child->EraseParent(this);
+        GetCellById(child)->EraseParent(id_);
     }
     std::swap(childrens_, other->childrens_);
     std::swap(impl_, other->impl_);
+    std::swap(kind_, other->kind_);
     for (auto child : childrens_) {
-        child->AddParent(this);
+        GetCellById(child)->AddParent(id_);
     }
-    CacheInvalidation();
+    ResetRanges();
+    trace::Span span("CacheInvalidation", pos_);
+    sheet_.GetStatsCounters().AddInvalidation(CacheInvalidation(invalidated));
 }
 
 bool Cell::IsReferenced() const {
     return !parents_.empty();
 }
 
+bool Cell::HasText(std::string_view text) const {
+    if (text.empty() || kind_ == Kind::Empty) {
+        return text.empty() && kind_ == Kind::Empty;
+    }
+    // Вид ячейки, которую создал бы text, определяется как в методе Set
+    const bool is_formula = text.front() == FORMULA_SIGN && text.size() > 1;
+    if (is_formula != (kind_ == Kind::Formula)) {
+        return false;
+    }
+    return impl_.get()->HasText(text);
+}
+
+bool Cell::IsEmpty() const {
+    return kind_ == Kind::Empty;
+}
+
+std::optional<double> Cell::GetNumber() const {
+    return impl_.get()->GetNumber();
+}
+
+FormulaInterface* Cell::GetFormula() {
+    return kind_ == Kind::Formula ? impl_.get()->GetFormula() : nullptr;
+}
+
+const std::unordered_set<CellId>& Cell::GetParents() const {
+    return parents_;
+}
+
+const std::vector<CellId>& Cell::GetChildrens() const {
+    return childrens_;
+}
+
+void Cell::Detach() {
+    for (auto child : childrens_) {
+        GetCellById(child)->EraseParent(id_);
+    }
+    childrens_.clear();
+    for (auto parent : parents_) {
+        GetCellById(parent)->EraseChild(id_);
+    }
+    parents_.clear();
+    EraseRanges();
+}
+
 std::vector<Position> Cell::GetReferencedCells() const {
     return impl_.get()->GetReferencedCells();
+}
+
+std::vector<SheetPosition> Cell::GetExternalReferencedCells() const {
+    return impl_.get()->GetExternalReferencedCells();
+}
+
+std::vector<Range> Cell::GetRanges() const {
+    return impl_.get()->GetRanges();
+}
+
+Sheet& Cell::GetSheet() const {
+    return sheet_;
+}
+
+Position Cell::GetPosition() const {
+    return pos_;
+}
+
+void Cell::SetPosition(Position pos) {
+    pos_ = pos;
+}
+
+CellId Cell::GetId() const {
+    return id_;
+}
+
+void Cell::RemapIds(const std::vector<CellId>& new_ids) {
+    id_ = new_ids[id_];
+    std::unordered_set<CellId> parents;
+    parents.reserve(parents_.size());
+    for (auto parent : parents_) {
+        parents.insert(new_ids[parent]);
+    }
+    parents_ = std::move(parents);
+    for (auto& child : childrens_) {
+        child = new_ids[child];
+    }
+    if (auto conditional = impl_.get()->GetConditionalChildren()) {
+        for (auto ids : {&conditional->cells, &conditional->unread}) {
+            for (auto& child : *ids) {
+                child = new_ids[child];
+            }
+            std::sort(ids->begin(), ids->end());
+        }
+    }
+}
+
+Cell* Cell::GetCellById(CellId id) const {
+    return sheet_.GetCellTable().Get(id);
 }
\ No newline at end of file
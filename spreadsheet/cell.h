@@ -1,17 +1,37 @@
 #pragma once
 
+#include "cell_table.h"
 #include "common.h"
 #include "formula.h"
 #include "sheet.h"
+#include "stats.h"
+#include "string_pool.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
 #include <optional>
 #include <unordered_set>
+#include <vector>
 
 class Sheet;
 
 class Cell : public CellInterface {
 public:
-    Cell(Sheet& sheet);
+    Cell(Sheet& sheet, Position pos);
+
+    Cell(const Cell&) = delete;
+    Cell& operator=(const Cell&) = delete;
+
+    ~Cell();
+
+    // Ячейки размещаются в пуле таблицы слотов, общем для всех листов книги
+    static void* operator new(std::size_t size, CellAllocator& allocator);
+    static void operator delete(void* ptr, CellAllocator& allocator);
+    static void operator delete(void* ptr);
 
     // Устанавливает значение в ячейке
     void Set(std::string text);
@@ -21,30 +41,155 @@ public:
 
     // Возвращает значение содержащаеся в ячейке
     Value GetValue() const override;
+    // Делает один шаг вычисления значения ячейки. Просматривает ссылки
+    // формулы и формулы столбцов, в которых она ищет, начиная с index, и
+    // возвращает первую формулу без значения в кэше - ее нужно вычислить
+    // раньше. Если таких нет, вычисляет формулу ячейки и возвращает nullptr
+    // или невычисленную ячейку, которую формула прочитала непредсказуемо:
+    // из ветви условной функции или из столбца результата поиска.
+    // Вычисляет не больше одной формулы.
+    const Cell* EvaluateStep(size_t& index) const;
     // Возвращает тескт содержащийся в ячейке
     std::string GetText() const override;
 
     // Возвращает позиции ячеек на которые ссылается данная ячейка
     std::vector<Position> GetReferencedCells() const override;
+
+    // Возвращает позиции ячеек других листов книги на которые ссылается
+    // данная ячейка
+    std::vector<SheetPosition> GetExternalReferencedCells() const;
+
+    // Возвращает области листа, от которых зависит формула ячейки
+    std::vector<Range> GetRanges() const;
+
+    // Заново запоминает в таблице области формулы ячейки, вызывается
+    // после сдвига областей при вставке и удалении строк и столбцов
+    void ResetRanges();
+
+    // Возвращает таблицу в которой хранится ячейка
+    Sheet& GetSheet() const;
+
+    // Возвращает позицию ячейки в таблице
+    Position GetPosition() const;
+
+    // Обновляет позицию ячейки, вызывается таблицей при сдвиге ячеек
+    void SetPosition(Position pos);
+
+    // Возвращает идентификатор ячейки в таблице слотов книги
+    CellId GetId() const;
+
+    // Переписывает идентификатор ячейки и ее связей после перенумерации
+    // ячеек, new_ids отображает старые идентификаторы в новые
+    void RemapIds(const std::vector<CellId>& new_ids);
     
     // Находит циклические зависимости, используется только при изменении
-    // ячейки таблицы методом SetCell
+    // ячейки таблицы методом SetCell. Граф обходится с явным стеком, каждая
+    // ячейка посещается один раз. Если в книге есть формулы с областями,
+    // обход идет от cell к зависящим от нее ячейкам, так как обход областей
+    // вниз просматривал бы все их ячейки.
     bool FindCircularDependency(Cell* cell);
 
     // Меняет содержимое одной ячейки на содержимое другой
     // при этом связь с ячейками которые ссылались на текущую ячейку остается,
     // а связи с ячейками на которые ссылались обе ячейки - обновляются,
-    // после чего происходит инвалидация кэша
-    void ResetContent(Cell* other);
+    // после чего происходит инвалидация кэша, инвалидированные ячейки
+    // добавляются в invalidated, если он передан
+    void ResetContent(Cell* other, std::vector<InvalidatedCell>* invalidated = nullptr);
 
     bool IsReferenced() const;
 
+    // Проверяет, что текст ячейки совпадает с text, не копируя текст ячейки.
+    // Пустой текст и текст другого вида (формула или нет) отличаются за O(1)
+    // по виду ячейки, содержимое сравнивается только у ячеек того же вида.
+    bool HasText(std::string_view text) const;
+
+    // Проверяет за O(1), что текст ячейки пуст
+    bool IsEmpty() const;
+
+    // Возвращает число, если ячейка содержит текст, представляющий число
+    std::optional<double> GetNumber() const;
+
+    // Возвращает формулу ячейки или nullptr, если ячейка не формульная
+    FormulaInterface* GetFormula();
+
+    // Возвращает идентификаторы ячеек которые ссылаются на текущую ячейку
+    const std::unordered_set<CellId>& GetParents() const;
+
+    // Возвращает идентификаторы ячеек на которые ссылается текущая ячейка
+    const std::vector<CellId>& GetChildrens() const;
+
+    // Разрывает все связи ячейки с другими ячейками,
+    // используется перед удалением ячейки из таблицы
+    void Detach();
+
+    // Проверяет, что значение ячейки вычислено и хранится в кэше
+    bool HasCachedValue() const;
+
+    // Возвращает значение из кэша, не вычисляя его и не учитывая обращение
+    // в счетчиках
+    const std::optional<Value>& GetCachedValue() const;
+
+    // Сохраняет в кэш значение, вычисленное вне ячейки, используется
+    // при пакетном вычислении серий формул
+    void SetCachedValue(Value value) const;
+
+    // Возвращает значение ячейки, не обновляя счетчики таблицы. Значение
+    // формулы должно быть в кэше. Так значения читают потоки вывода таблицы,
+    // чтобы не делить между собой строки кэша со счетчиками.
+    Value GetComputedValue() const;
+
+    // Возвращает числовое значение ячейки, записанное FormatNumber не шире
+    // столбца таблицы. Запись хранится рядом с кэшем значения и сбрасывается
+    // вместе с ним, поэтому повторный вывод неизменной ячейки не форматирует
+    // число заново. Если число пришлось записать, увеличивает formats -
+    // счетчик вызывающего, который тот добавляет к счетчикам таблицы.
+    // Вызывается только для ячеек, значение которых - число, формула должна
+    // быть вычислена.
+    const std::string& GetNumberText(std::uint64_t& formats) const;
+
+    // Добавляет к usage память, занимаемую ячейкой
+    void AddMemoryUsage(MemoryUsage& usage) const;
+
+    // Инвалидация значения хранящегося в кэше и в кэше зависимых ячеек,
+    // возвращает число инвалидированных ячеек. Если передан invalidated,
+    // в него добавляются инвалидированные ячейки. Зависимые ячейки
+    // обходятся с явным стеком. Формула, которая не прочитала ячейку
+    // при вычислении значения в кэше, так как ячейка в невыбранной ветви
+    // условной функции, не инвалидируется: условие, выбирающее ветвь,
+    // читается всегда, поэтому смена ветви тоже инвалидирует формулу.
+
+    size_t CacheInvalidation(std::vector<InvalidatedCell>* invalidated = nullptr);
+
 private:
+    // Ссылки формулы, которые она читает только в части ветвей условных
+    // функций IF, IFERROR и CHOOSE
+    struct ConditionalChildren {
+        // Идентификаторы ячеек, отсортированы
+        std::vector<CellId> cells;
+        // Ячейки из cells, не прочитанные при вычислении значения в кэше
+        std::vector<CellId> unread;
+
+        // Запоминает ячейки, прочитанные при вычислении формулы
+        void SetReads(std::vector<CellId> reads) {
+            std::sort(reads.begin(), reads.end());
+            unread.clear();
+            std::set_difference(cells.begin(), cells.end(), reads.begin(), reads.end(),
+                std::back_inserter(unread));
+        }
+    };
+
     class Impl {
     public:
         virtual Value GetValue() const = 0;
         virtual std::string GetText() const = 0;
         virtual std::vector<Position> GetReferencedCells() const = 0;
+        virtual std::vector<SheetPosition> GetExternalReferencedCells() const { return {}; }
+        virtual std::vector<Range> GetRanges() const { return {}; }
+        virtual FormulaInterface* GetFormula() { return nullptr; }
+        virtual ConditionalChildren* GetConditionalChildren() { return nullptr; }
+        virtual std::optional<double> GetNumber() const { return std::nullopt; }
+        virtual bool HasText(std::string_view text) const { return GetText() == text; }
+        virtual void AddMemoryUsage(MemoryUsage& usage) const = 0;
         virtual ~Impl() = default;
     };
     // Пустая ячейка
@@ -53,37 +198,96 @@ private:
         Value GetValue() const override { return std::string{}; };
         std::string GetText() const override { return {}; };
         std::vector<Position> GetReferencedCells() const override { return {}; }
+        void AddMemoryUsage(MemoryUsage& usage) const override {
+            usage.cell_storage += memory::HeapBlock(sizeof(*this));
+        }
     };
-    // Текстовое представление ячейки
-    class TextImpl : public Impl {
+    // Текстовое представление ячейки, хранение строки определяют наследники
+    class TextImplBase : public Impl {
     public:
-        explicit TextImpl(std::string text, bool apostrophe = false)
-            :text_value_(std::move(text))
-            ,apostrophe_(apostrophe)
+        TextImplBase(const std::string& text, bool apostrophe)
+            :apostrophe_(apostrophe)
         {
+            // Число разбирается один раз при установке текста, а не при каждом чтении.
+            // strtod разбирает так же, как std::stod, но без исключения для
+            // нечислового текста, которое стоит дороже самой установки ячейки.
+            // Числом считается только конечная десятичная запись: "nan", "inf"
+            // и шестнадцатеричный текст остаются текстом и для формул, и для
+            // столбцов чисел листа.
+            const char* begin = text.c_str();
+            char* end = nullptr;
+            errno = 0;
+            double number = std::strtod(begin, &end);
+            if (end != begin && errno != ERANGE && std::isfinite(number)
+                && std::find_if(begin, static_cast<const char*>(end),
+                    [](char c) { return c == 'x' || c == 'X'; }) == end) {
+                number_ = number;
+            }
         }
         Value GetValue() const override {
-            try {
-                double value = std::stod(text_value_);
-                return value;
-                
-            }
-            catch (...) {
-                return text_value_;
+            if (number_.has_value()) {
+                return *number_;
             }
+            return GetString();
         };
+        std::optional<double> GetNumber() const override {
+            return number_;
+        }
         std::string GetText() const override {
-            return (apostrophe_) ? ESCAPE_SIGN + text_value_ : text_value_;
+            return (apostrophe_) ? ESCAPE_SIGN + GetString() : GetString();
         };
+        bool HasText(std::string_view text) const override {
+            if (apostrophe_) {
+                if (text.empty() || text.front() != ESCAPE_SIGN) {
+                    return false;
+                }
+                text.remove_prefix(1);
+            }
+            return GetString() == text;
+        }
         std::vector<Position> GetReferencedCells() const override { return {}; }
-        std::string text_value_;
+        virtual const std::string& GetString() const = 0;
         bool apostrophe_;
+        std::optional<double> number_;
+    };
+    // Текст, которым владеет ячейка
+    class TextImpl : public TextImplBase {
+    public:
+        explicit TextImpl(std::string text, bool apostrophe = false)
+            :TextImplBase(text, apostrophe)
+            ,text_value_(std::move(text))
+        {
+        }
+        const std::string& GetString() const override {
+            return text_value_;
+        }
+        void AddMemoryUsage(MemoryUsage& usage) const override {
+            usage.cell_storage += memory::HeapBlock(sizeof(*this));
+            usage.text += memory::StringHeap(text_value_);
+        }
+        std::string text_value_;
+    };
+    // Текст из пула строк таблицы, память пула учитывает таблица
+    class PooledTextImpl : public TextImplBase {
+    public:
+        PooledTextImpl(InternedString text, bool apostrophe)
+            :TextImplBase(text.Get(), apostrophe)
+            ,text_value_(std::move(text))
+        {
+        }
+        const std::string& GetString() const override {
+            return text_value_.Get();
+        }
+        void AddMemoryUsage(MemoryUsage& usage) const override {
+            usage.cell_storage += memory::HeapBlock(sizeof(*this));
+        }
+        InternedString text_value_;
     };
     // Формульное представление ячейки
     class FormulaImpl : public Impl {
     public:
-        explicit FormulaImpl(std::string expr, const SheetInterface& sheet)
-            :formula_(ParseFormula(std::move(expr)))
+        FormulaImpl(std::unique_ptr<FormulaInterface> formula, const SheetInterface& sheet)
+            :formula_(std::move(formula))
             ,sheet_(sheet)
         {
         }
@@ -102,8 +306,39 @@ private:
         std::vector<Position> GetReferencedCells() const override {
             return formula_.get()->GetReferencedCells();
         }
+        std::vector<SheetPosition> GetExternalReferencedCells() const override {
+            return formula_.get()->GetExternalReferencedCells();
+        }
+        std::vector<Range> GetRanges() const override {
+            return formula_.get()->GetRanges();
+        }
+        FormulaInterface* GetFormula() override {
+            return formula_.get();
+        }
+        ConditionalChildren* GetConditionalChildren() override {
+            return conditional_.get();
+        }
+        void AddMemoryUsage(MemoryUsage& usage) const override {
+            usage.cell_storage += memory::HeapBlock(sizeof(*this));
+            usage.formula_ast += formula_.get()->GetMemoryUsage();
+            if (conditional_) {
+                usage.dependency_edges += memory::HeapBlock(sizeof(ConditionalChildren))
+                    + memory::VectorHeap(conditional_->cells)
+                    + memory::VectorHeap(conditional_->unread);
+            }
+        }
         std::unique_ptr<FormulaInterface> formula_;
         const SheetInterface& sheet_;
+        // nullptr, если все ссылки формулы читаются при любом вычислении
+        std::unique_ptr<ConditionalChildren> conditional_;
+    };
+
+    // Вид содержимого ячейки, хранится рядом с impl_, чтобы проверять его
+    // без обращения к объекту содержимого
+    enum class Kind : std::uint8_t {
+        Empty,
+        Text,
+        Formula,
     };
 
     std::unique_ptr<Impl> impl_;
@@ -111,25 +346,73 @@ private:
     // Ссылка на таблицу где хранится ячейка
     Sheet& sheet_;
 
-    // Кэш значения, инвалидируется при изменении ячеки или изменении ячеек
-    // на кторорые ссылается текущая ячейка
+    // Позиция ячейки в таблице, используется при трассировке
+    Position pos_;
+
+    // Кэш значения формулы, инвалидируется при изменении ячеки или изменении ячеек
+    // на кторорые ссылается текущая ячейка. Значения текстовых ячеек не кэшируются:
+    // они не вычисляются, а копия строки в кэше свела бы на нет общий пул строк
     mutable std::optional<Cell::Value> cache_value_;
 
+    // Числовое значение, переведенное в текст для вывода таблицы,
+    // пустая строка - значение еще не выводилось
+    mutable std::string number_text_;
+
+    // Идентификатор ячейки в таблице слотов книги, по нему на ячейку
+    // ссылаются связи других ячеек
+    CellId id_;
+
+    // Вид текущего impl_, обновляется при каждой его замене
+    Kind kind_ = Kind::Empty;
+
     // Хранит связь с ячейками которые ссылаются на текущую ячейку
-    std::unordered_set<Cell*> parents_;
+    std::unordered_set<CellId> parents_;
 
     // Хранит связь с ячейками на которые ссылается данная ячейка
-    std::vector<Cell*> childrens_;
+    std::vector<CellId> childrens_;
 
-    // Добавляет связь с ячейками задействованными в текущей ячейке
+    // Добавляет связь с ячейками задействованными в текущей ячейке,
+    // в том числе с ячейками других листов книги
     void AddChildrens();
 
+    // Добавляет связь с ячейкой pos таблицы sheet, при необходимости создавая
+    // пустую ячейку, созданные ячейки запоминаются в new_cells
+    void AddChild(Sheet& sheet, Position pos,
+        std::vector<std::pair<Sheet*, Position>>& new_cells);
+
     // Добавляет связь с ячейкой которая ссылается на текущую
-    void AddParent(Cell* parent);
+    void AddParent(CellId parent);
 
     // Удаляет связь с ячейкой которая ссылалась на текущую
-    void EraseParent(Cell* parent);
+    void EraseParent(CellId parent);
+
+    // Удаляет связь с ячейкой на которую ссылалась текущая
+    void EraseChild(CellId child);
+
+    // Проверяет, что child - ссылка из ветви условной функции
+    bool IsConditionalChild(CellId child) const;
+
+    // Проверяет, что формула не читала ячейку child при вычислении
+    // значения в кэше
+    bool IsUnreadChild(CellId child) const;
+
+    // Забывает области формулы ячейки в таблице
+    void EraseRanges();
+
+    // Ищет среди ячеек, зависящих от cell, и самой cell ячейку, от которой
+    // зависит формула текущей ячейки
+    bool FindDependentCycle(Cell* cell);
+
+    // Возвращает ячейку по идентификатору
+    Cell* GetCellById(CellId id) const;
+
+    // Вычисляет формулу ячейки и формулы без значения в кэше, от которых
+    // она зависит, обходя граф с явным стеком, поэтому длина цепочки
+    // зависимостей не ограничена размером стека вызовов. Ячейки ветвей
+    // условных функций вычисляются, только если формула выбрала ветвь.
+    void Evaluate() const;
 
-    // Инвалидация значения хранящегося в кэше
-    void CacheInvalidation();
+    // Вычисляет формулу ячейки, если ее значения нет в кэше. Возвращает
+    // формулу без значения в кэше, которую нужно вычислить раньше, или nullptr.
+    const Cell* EvaluateFormula() const;
 };
\ No newline at end of file
@@ -0,0 +1,71 @@
+#include "cell_allocator.h"
+
+#include "stats.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <new>
+
+namespace {
+
+std::size_t AlignUp(std::size_t value, std::size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+}  // namespace
+
+CellAllocator::CellAllocator(std::size_t object_size, std::size_t object_alignment)
+    : object_size_(AlignUp(std::max(object_size, sizeof(void*)), object_alignment))
+    , first_offset_(AlignUp(sizeof(SlabHeader), object_alignment)) {
+    assert(first_offset_ + object_size_ <= SLAB_SIZE);
+}
+
+CellAllocator::~CellAllocator() {
+    for (void* slab : slabs_) {
+        ::operator delete(slab, std::align_val_t{SLAB_SIZE});
+    }
+}
+
+void* CellAllocator::Allocate() {
+    ++size_;
+    if (free_ != nullptr) {
+        void* ptr = free_;
+        free_ = *static_cast<void**>(ptr);
+        return ptr;
+    }
+    if (next_ == end_) {
+        AddSlab();
+    }
+    void* ptr = next_;
+    next_ += object_size_;
+    return ptr;
+}
+
+void CellAllocator::Deallocate(void* ptr) {
+    const auto slab = reinterpret_cast<std::uintptr_t>(ptr) & ~(SLAB_SIZE - 1);
+    CellAllocator* owner = reinterpret_cast<SlabHeader*>(slab)->owner;
+    *static_cast<void**>(ptr) = owner->free_;
+    owner->free_ = ptr;
+    --owner->size_;
+}
+
+std::size_t CellAllocator::GetSize() const {
+    return size_;
+}
+
+std::size_t CellAllocator::GetMemoryUsage() const {
+    return slabs_.size() * SLAB_SIZE + memory::VectorHeap(slabs_);
+}
+
+void CellAllocator::AddSlab() {
+    // Место в списке резервируется заранее, чтобы не потерять выделенный блок
+    if (slabs_.size() == slabs_.capacity()) {
+        slabs_.reserve(std::max<std::size_t>(slabs_.size() * 2, 16));
+    }
+    char* slab = static_cast<char*>(::operator new(SLAB_SIZE, std::align_val_t{SLAB_SIZE}));
+    slabs_.push_back(slab);
+    new (slab) SlabHeader{this};
+    next_ = slab + first_offset_;
+    end_ = next_ + (SLAB_SIZE - first_offset_) / object_size_ * object_size_;
+}
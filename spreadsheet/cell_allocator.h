@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Пул памяти объектов одного размера. Объекты размещаются подряд в блоках
+// по SLAB_SIZE байт, выровненных по своему размеру, поэтому освобождаемый
+// объект находит свой пул по адресу блока, без указателя в каждом объекте,
+// а соседние ячейки таблицы лежат рядом в памяти. Освобожденные места
+// используются повторно, блоки возвращаются системе при разрушении пула,
+// поэтому пул должен пережить все свои объекты.
+class CellAllocator {
+public:
+    static constexpr std::size_t SLAB_SIZE = 64 << 10;
+
+    CellAllocator(std::size_t object_size, std::size_t object_alignment);
+
+    CellAllocator(const CellAllocator&) = delete;
+    CellAllocator& operator=(const CellAllocator&) = delete;
+
+    ~CellAllocator();
+
+    // Возвращает память для одного объекта
+    void* Allocate();
+
+    // Возвращает память объекта, выделенную Allocate, в ее пул
+    static void Deallocate(void* ptr);
+
+    // Число занятых мест
+    std::size_t GetSize() const;
+
+    // Память блоков пула и списка блоков
+    std::size_t GetMemoryUsage() const;
+
+private:
+    // Начало каждого блока, объекты размещаются после него
+    struct SlabHeader {
+        CellAllocator* owner;
+    };
+
+    std::size_t object_size_;
+    std::size_t first_offset_;
+
+    std::vector<void*> slabs_;
+    // Свободное место последнего блока
+    char* next_ = nullptr;
+    char* end_ = nullptr;
+    // Список освобожденных мест, следующее хранится в самом месте
+    void* free_ = nullptr;
+    std::size_t size_ = 0;
+
+    void AddSlab();
+};
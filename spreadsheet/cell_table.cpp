@@ -0,0 +1,64 @@
+#include "cell_table.h"
+
+#include "cell.h"
+#include "stats.h"
+
+#include <cassert>
+#include <stdexcept>
+
+CellTable::CellTable()
+    : allocator_(sizeof(Cell), alignof(Cell)) {
+}
+
+CellId CellTable::Add(Cell* cell) {
+    if (!free_.empty()) {
+        CellId id = free_.back();
+        free_.pop_back();
+        slots_[id] = cell;
+        return id;
+    }
+    if (slots_.size() >= NONE) {
+        throw std::length_error("too many cells");
+    }
+    slots_.push_back(cell);
+    return static_cast<CellId>(slots_.size() - 1);
+}
+
+void CellTable::Remove(CellId id) {
+    slots_[id] = nullptr;
+    free_.push_back(id);
+}
+
+std::size_t CellTable::GetSize() const {
+    return slots_.size() - free_.size();
+}
+
+std::size_t CellTable::GetCapacity() const {
+    return slots_.size();
+}
+
+std::vector<CellId> CellTable::Compact(const std::vector<Cell*>& order) {
+    assert(order.size() == GetSize());
+    std::vector<CellId> new_ids(slots_.size(), NONE);
+    for (size_t i = 0; i < order.size(); ++i) {
+        new_ids[order[i]->GetId()] = static_cast<CellId>(i);
+    }
+    slots_ = order;
+    // Заодно освобождается память, оставшаяся от удаленных ячеек
+    slots_.shrink_to_fit();
+    free_.clear();
+    free_.shrink_to_fit();
+    return new_ids;
+}
+
+void CellTable::SetAsyncSheet(bool active) {
+    async_sheets_.fetch_add(active ? 1 : -1, std::memory_order_relaxed);
+}
+
+void CellTable::AddRangeDependents(int delta) {
+    range_dependents_ += delta;
+}
+
+std::size_t CellTable::GetMemoryUsage() const {
+    return memory::VectorHeap(slots_) + memory::VectorHeap(free_);
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "cell_allocator.h"
+#include "common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+class Cell;
+
+// Идентификатор ячейки: индекс слота в CellTable. Не меняется, пока
+// ячейка существует, кроме перенумерации методом CellTable::Compact.
+using CellId = std::uint32_t;
+
+// Ячейка, кэш которой сброшен изменением таблицы, и значение, которое было
+// в кэше до сброса
+struct InvalidatedCell {
+    Cell* cell;
+    std::optional<CellInterface::Value> old_value;
+};
+
+// Плотная таблица слотов ячеек. Связи графа зависимостей хранятся как
+// идентификаторы, а не указатели, поэтому граф можно перенумеровать,
+// сериализовать или передать в другой поток без привязки к адресам ячеек.
+// Идентификаторы удаленных ячеек используются повторно. Таблица общая
+// для всех листов книги, так как формулы ссылаются на ячейки других листов.
+// Память самих ячеек всех листов выделяет пул таблицы.
+class CellTable {
+public:
+    static constexpr CellId NONE = UINT32_MAX;
+
+    CellTable();
+
+    // Выделяет слот ячейке, в первую очередь - освобожденный ранее
+    CellId Add(Cell* cell);
+
+    // Освобождает слот удаляемой ячейки
+    void Remove(CellId id);
+
+    Cell* Get(CellId id) const {
+        return slots_[id];
+    }
+
+    // Число занятых слотов
+    std::size_t GetSize() const;
+
+    // Число слотов, включая свободные
+    std::size_t GetCapacity() const;
+
+    // Перенумеровывает ячейки: ячейка order[i] получает идентификатор i,
+    // order должен содержать все ячейки таблицы. Возвращает отображение
+    // старых идентификаторов в новые, по которому ячейки переписывают связи.
+    std::vector<CellId> Compact(const std::vector<Cell*>& order);
+
+    // Динамическая память таблицы слотов
+    std::size_t GetMemoryUsage() const;
+
+    // Учитывает лист, перешедший в режим Async (active == true) или
+    // вышедший из него. Пока такие листы есть, ячейки всех листов таблицы
+    // вычисляются и изменяются только под мьютексом GetMutex().
+    void SetAsyncSheet(bool active);
+
+    bool HasAsyncSheets() const {
+        return async_sheets_.load(std::memory_order_relaxed) > 0;
+    }
+
+    // Учитывает ячейку, формула которой стала (delta == 1) или перестала
+    // (delta == -1) зависеть от областей листа. Пока такие ячейки есть,
+    // поиск циклических зависимостей учитывает зависимости от областей.
+    void AddRangeDependents(int delta);
+
+    bool HasRangeDependents() const {
+        return range_dependents_ > 0;
+    }
+
+    std::recursive_mutex& GetMutex() const {
+        return mutex_;
+    }
+
+    // Возвращает пул памяти ячеек, ячейки создаются и удаляются под теми же
+    // условиями, что и изменяются
+    CellAllocator& GetAllocator() {
+        return allocator_;
+    }
+
+private:
+    CellAllocator allocator_;
+    std::vector<Cell*> slots_;
+    std::vector<CellId> free_;
+    std::atomic<int> async_sheets_{0};
+    int range_dependents_ = 0;
+    mutable std::recursive_mutex mutex_;
+};
+
+// Блокирует мьютекс таблицы ячеек, если в ней есть листы в режиме Async,
+// иначе ничего не делает
+inline std::unique_lock<std::recursive_mutex> LockIfAsync(const CellTable& cells) {
+    if (cells.HasAsyncSheets()) {
+        return std::unique_lock(cells.GetMutex());
+    }
+    return {};
+}
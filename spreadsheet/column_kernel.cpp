@@ -0,0 +1,337 @@
+#include "column_kernel.h"
+
+#include <algorithm>
+#include <cassert>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+namespace {
+
+using OpCode = FormulaProgram::OpCode;
+
+std::uint8_t ToErrorCode(FormulaError::Category category) {
+    return static_cast<std::uint8_t>(category) + 1;
+}
+
+// Повторяет правила GetCellNumber из FormulaAST.cpp без исключений
+void LoadCellNumber(const CellInterface* cell, double& value, std::uint8_t& error) {
+    value = 0;
+    error = 0;
+    if (cell == nullptr) {
+        error = ToErrorCode(FormulaError::Category::Ref);
+        return;
+    }
+    const auto cell_value = cell->GetValue();
+    if (std::holds_alternative<double>(cell_value)) {
+        value = std::get<double>(cell_value);
+    }
+    else if (std::holds_alternative<std::string>(cell_value)) {
+        error = ToErrorCode(std::get<std::string>(cell_value).empty()
+            ? FormulaError::Category::Ref : FormulaError::Category::Value);
+    }
+    else {
+        error = ToErrorCode(std::get<FormulaError>(cell_value).GetCategory());
+    }
+}
+
+// Записывает в result значения операции code над lhs и rhs и возвращает
+// true, если все результаты конечны. Бесконечность и NaN дают ошибку
+// вычисления: x - x == 0 только для конечных x.
+bool ApplyScalar(OpCode code, const double* __restrict lhs, const double* __restrict rhs,
+                 double* __restrict result, int count) {
+    auto apply = [&](auto operation) {
+        bool finite = true;
+        for (int i = 0; i < count; ++i) {
+            result[i] = operation(lhs[i], rhs[i]);
+            finite &= result[i] - result[i] == 0.0;
+        }
+        return finite;
+    };
+    switch (code) {
+        case OpCode::Add:
+            return apply([](double l, double r) { return l + r; });
+        case OpCode::Subtract:
+            return apply([](double l, double r) { return l - r; });
+        case OpCode::Multiply:
+            return apply([](double l, double r) { return l * r; });
+        default:
+            return apply([](double l, double r) { return l / r; });
+    }
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define COLUMN_KERNEL_AVX2
+
+// То же, что ApplyScalar, командами AVX2 по четыре строки
+template <OpCode code>
+__attribute__((target("avx2")))
+bool ApplyAvx2(const double* lhs, const double* rhs, double* result, int count) {
+    const __m256d zero = _mm256_setzero_pd();
+    __m256d not_finite = zero;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256d l = _mm256_loadu_pd(lhs + i);
+        const __m256d r = _mm256_loadu_pd(rhs + i);
+        __m256d value;
+        if constexpr (code == OpCode::Add) {
+            value = _mm256_add_pd(l, r);
+        }
+        else if constexpr (code == OpCode::Subtract) {
+            value = _mm256_sub_pd(l, r);
+        }
+        else if constexpr (code == OpCode::Multiply) {
+            value = _mm256_mul_pd(l, r);
+        }
+        else {
+            value = _mm256_div_pd(l, r);
+        }
+        _mm256_storeu_pd(result + i, value);
+        not_finite = _mm256_or_pd(not_finite,
+            _mm256_cmp_pd(_mm256_sub_pd(value, value), zero, _CMP_NEQ_UQ));
+    }
+    const bool finite = _mm256_movemask_pd(not_finite) == 0;
+    return ApplyScalar(code, lhs + i, rhs + i, result + i, count - i) && finite;
+}
+
+bool HasAvx2() {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+#endif
+
+bool ApplyBinary(OpCode code, const double* lhs, const double* rhs, double* result, int count) {
+#ifdef COLUMN_KERNEL_AVX2
+    if (HasAvx2()) {
+        switch (code) {
+            case OpCode::Add:
+                return ApplyAvx2<OpCode::Add>(lhs, rhs, result, count);
+            case OpCode::Subtract:
+                return ApplyAvx2<OpCode::Subtract>(lhs, rhs, result, count);
+            case OpCode::Multiply:
+                return ApplyAvx2<OpCode::Multiply>(lhs, rhs, result, count);
+            default:
+                return ApplyAvx2<OpCode::Divide>(lhs, rhs, result, count);
+        }
+    }
+#endif
+    return ApplyScalar(code, lhs, rhs, result, count);
+}
+
+// Ошибка левого операнда важнее ошибки правого, как и при обычном
+// вычислении, где левый операнд вычисляется первым
+void MergeErrors(const std::uint8_t* lhs_error, const std::uint8_t* rhs_error,
+                 const double* result, std::uint8_t* error, int count) {
+    const std::uint8_t arithmetic = ToErrorCode(FormulaError::Category::Arithmetic);
+    for (int i = 0; i < count; ++i) {
+        std::uint8_t finite_error = (result[i] - result[i] == 0.0) ? 0 : arithmetic;
+        std::uint8_t rhs = rhs_error[i] != 0 ? rhs_error[i] : finite_error;
+        error[i] = lhs_error[i] != 0 ? lhs_error[i] : rhs;
+    }
+}
+
+}  // namespace
+
+ColumnKernel::ColumnKernel(const FormulaProgram& program, Position origin)
+    : origin_(origin) {
+    size_t depth = 0, max_depth = 0;
+    ops_.reserve(program.ops.size());
+    for (const auto& op : program.ops) {
+        Op kernel_op{op.code, op.number, Position{}, false, 0};
+        if (op.code == OpCode::Cell) {
+            kernel_op.is_ref_error = !op.cell->IsValid();
+            if (!kernel_op.is_ref_error) {
+                kernel_op.offset = {op.cell->row - origin.row, op.cell->col - origin.col};
+            }
+            auto same_input = std::find_if(input_ops_.begin(), input_ops_.end(), [&](const Op& input) {
+                return input.is_ref_error == kernel_op.is_ref_error && input.offset == kernel_op.offset;
+            });
+            kernel_op.input = same_input - input_ops_.begin();
+            if (same_input == input_ops_.end()) {
+                input_ops_.push_back(kernel_op);
+            }
+        }
+        ops_.push_back(kernel_op);
+        if (op.code == OpCode::Number || op.code == OpCode::Cell) {
+            max_depth = std::max(max_depth, ++depth);
+        }
+        else if (op.code != OpCode::Negate) {
+            --depth;
+        }
+    }
+    stack_.resize(max_depth, MakeColumn());
+    operands_.reserve(max_depth);
+    inputs_.resize(input_ops_.size(), MakeColumn());
+    no_errors_.resize(BLOCK_SIZE);
+}
+
+ColumnKernel::Column ColumnKernel::MakeColumn() {
+    return {std::vector<double>(BLOCK_SIZE), std::vector<std::uint8_t>(BLOCK_SIZE)};
+}
+
+bool ColumnKernel::IsSameShape(const FormulaProgram& program, Position pos) const {
+    if (program.ops.size() != ops_.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < ops_.size(); ++i) {
+        const auto& op = program.ops[i];
+        const auto& kernel_op = ops_[i];
+        if (op.code != kernel_op.code) {
+            return false;
+        }
+        if (op.code == OpCode::Number && op.number != kernel_op.number) {
+            return false;
+        }
+        if (op.code == OpCode::Cell) {
+            if (!op.cell->IsValid() || kernel_op.is_ref_error) {
+                if (op.cell->IsValid() || !kernel_op.is_ref_error) {
+                    return false;
+                }
+                continue;
+            }
+            if (op.cell->row - pos.row != kernel_op.offset.row
+                || op.cell->col - pos.col != kernel_op.offset.col) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool ColumnKernel::ReferencesOwnColumn() const {
+    return std::any_of(ops_.begin(), ops_.end(), [](const Op& op) {
+        return op.code == OpCode::Cell && !op.is_ref_error && op.offset.col == 0;
+    });
+}
+
+void ColumnKernel::Gather(const SheetInterface& sheet, const NumericColumns* numbers,
+                          const Op& op, int first, int count, Column& column) const {
+    double* value = column.value.data();
+    std::uint8_t* error = column.error.data();
+    bool has_errors = false;
+    auto load = [&](Position pos, int i) {
+        LoadCellNumber(sheet.GetCell(pos), value[i], error[i]);
+        has_errors |= error[i] != 0;
+    };
+    Position pos{origin_.row + first + op.offset.row, origin_.col + op.offset.col};
+    if (op.is_ref_error || !pos.IsValid() || !Position{pos.row + count - 1, pos.col}.IsValid()) {
+        for (int i = 0; i < count; ++i, ++pos.row) {
+            if (op.is_ref_error || !pos.IsValid()) {
+                value[i] = 0;
+                error[i] = ToErrorCode(FormulaError::Category::Ref);
+                has_errors = true;
+            }
+            else {
+                load(pos, i);
+            }
+        }
+        column.has_errors = has_errors;
+        return;
+    }
+    // Числа копируются из плотных столбцов целыми отрезками блоков, по
+    // одной остальные ячейки: формулы, текст и пустые. Строки, которые
+    // целым словом битовой карты заняты числами, не проверяются по одной.
+    constexpr int BLOCK_ROWS = NumericColumns::BLOCK_ROWS;
+    for (int i = 0; i < count;) {
+        const int row = pos.row + i;
+        const int block_row = row % BLOCK_ROWS;
+        const int size = std::min(count - i, BLOCK_ROWS - block_row);
+        const NumericColumns::Block* block = numbers != nullptr
+            ? numbers->GetBlock(pos.col, row / BLOCK_ROWS) : nullptr;
+        if (block == nullptr) {
+            for (int j = 0; j < size; ++j) {
+                load({row + j, pos.col}, i + j);
+            }
+            i += size;
+            continue;
+        }
+        std::copy_n(block->values + block_row, size, value + i);
+        for (int j = 0; j < size;) {
+            const int bit = block_row + j;
+            if (bit % 64 == 0 && j + 64 <= size && block->valid[bit / 64] == ~std::uint64_t{0}) {
+                std::fill_n(error + i + j, 64, 0);
+                j += 64;
+                continue;
+            }
+            if (block->IsValid(bit)) {
+                error[i + j] = 0;
+            }
+            else {
+                load({row + j, pos.col}, i + j);
+            }
+            ++j;
+        }
+        i += size;
+    }
+    column.has_errors = has_errors;
+}
+
+void ColumnKernel::Evaluate(const SheetInterface& sheet, int first, int count,
+                            const NumericColumns* numbers) {
+    assert(count <= BLOCK_SIZE);
+    for (size_t i = 0; i < input_ops_.size(); ++i) {
+        Gather(sheet, numbers, input_ops_[i], first, count, inputs_[i]);
+    }
+    auto errors = [this](const Column& column) {
+        return column.has_errors ? column.error.data() : no_errors_.data();
+    };
+    operands_.clear();
+    for (const auto& op : ops_) {
+        switch (op.code) {
+            case OpCode::Number: {
+                Column& column = stack_[operands_.size()];
+                std::fill_n(column.value.data(), count, op.number);
+                column.has_errors = false;
+                operands_.push_back(&column);
+                break;
+            }
+            case OpCode::Cell:
+                operands_.push_back(&inputs_[op.input]);
+                break;
+            case OpCode::Negate: {
+                const Column& operand = *operands_.back();
+                Column& column = stack_[operands_.size() - 1];
+                for (int i = 0; i < count; ++i) {
+                    column.value[i] = -operand.value[i];
+                }
+                if (operand.has_errors && &operand != &column) {
+                    std::copy_n(operand.error.data(), count, column.error.data());
+                }
+                column.has_errors = operand.has_errors;
+                operands_.back() = &column;
+                break;
+            }
+            default: {
+                const Column& rhs = *operands_.back();
+                operands_.pop_back();
+                const Column& lhs = *operands_.back();
+                // Буфер глубины левого операнда: он либо и есть левый
+                // операнд, либо свободен, строки обрабатываются по порядку
+                Column& column = stack_[operands_.size() - 1];
+                const bool finite = ApplyBinary(op.code, lhs.value.data(), rhs.value.data(),
+                    column.value.data(), count);
+                if (lhs.has_errors || rhs.has_errors || !finite) {
+                    MergeErrors(errors(lhs), errors(rhs), column.value.data(),
+                        column.error.data(), count);
+                    column.has_errors = true;
+                }
+                else {
+                    column.has_errors = false;
+                }
+                operands_.back() = &column;
+                break;
+            }
+        }
+    }
+    assert(operands_.size() == 1);
+    result_ = operands_.back();
+}
+
+CellInterface::Value ColumnKernel::GetValue(int i) const {
+    assert(result_ != nullptr);
+    if (!result_->has_errors || result_->error[i] == 0) {
+        return result_->value[i];
+    }
+    return FormulaError(static_cast<FormulaError::Category>(result_->error[i] - 1));
+}
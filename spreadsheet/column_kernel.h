@@ -0,0 +1,84 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "numeric_columns.h"
+
+#include <cstdint>
+#include <vector>
+
+// Пакетное вычисление серии формул одинаковой формы, расположенных
+// в соседних строках одного столбца, например =B1*C1-D1, =B2*C2-D2, ...
+// Значения ссылок серии собираются в непрерывные буферы, числа
+// копируются из плотных столбцов отрезками, после чего каждая операция
+// формулы выполняется одним циклом по блоку строк. На процессорах с AVX2
+// (GCC и Clang, x86) арифметика выполняется командами AVX2 по четыре
+// строки, выбор делается при запуске; иначе - обычными циклами. Ошибки
+// вычисляются построчно по тем же правилам, что и при обычном вычислении
+// формулы, но только для блоков, где они есть: в блоке без ошибок в
+// ссылках и без бесконечностей в результатах операций байты ошибок не
+// обрабатываются.
+class ColumnKernel {
+public:
+    // Число строк, вычисляемых за один проход, буферы блока
+    // помещаются в кэш процессора
+    static constexpr int BLOCK_SIZE = 1024;
+
+    // program - формула первой ячейки серии, origin - ее позиция
+    ColumnKernel(const FormulaProgram& program, Position origin);
+
+    // Проверяет, что формула program ячейки pos имеет ту же форму, что
+    // и формула серии: те же операции и числа, ссылки с тем же смещением
+    bool IsSameShape(const FormulaProgram& program, Position pos) const;
+
+    // Проверяет, что формула ссылается на ячейки своего столбца. Такие
+    // серии могут зависеть от собственных значений и вычисляются по одной
+    bool ReferencesOwnColumn() const;
+
+    // Вычисляет count <= BLOCK_SIZE строк серии начиная со строки
+    // origin.row + first. Числа из numbers читаются напрямую, остальные
+    // ячейки - через sheet. Результаты читаются методом GetValue.
+    void Evaluate(const SheetInterface& sheet, int first, int count,
+                  const NumericColumns* numbers = nullptr);
+
+    // Значение строки origin.row + first + i последнего вызова Evaluate
+    CellInterface::Value GetValue(int i) const;
+
+private:
+    struct Op {
+        FormulaProgram::OpCode code;
+        double number = 0;
+        Position offset;    // смещение ссылки относительно ячейки формулы
+        bool is_ref_error = false;  // ссылка #REF!
+        size_t input = 0;   // номер буфера в inputs_ для ссылки
+    };
+
+    // Буфер значений блока, error[i] == 0 - нет ошибки, иначе категория
+    // ошибки FormulaError, увеличенная на единицу. При has_errors == false
+    // ошибок в блоке нет и error не заполняется.
+    struct Column {
+        std::vector<double> value;
+        std::vector<std::uint8_t> error;
+        bool has_errors = false;
+    };
+
+    std::vector<Op> ops_;
+    Position origin_;
+    // Буферы результатов операций, по одному на глубину стека
+    std::vector<Column> stack_;
+    // Стек операндов: буферы stack_ или inputs_, ссылки не копируются
+    std::vector<const Column*> operands_;
+    // Результат последнего вызова Evaluate
+    const Column* result_ = nullptr;
+    // Нулевые байты ошибок для операнда без ошибок
+    std::vector<std::uint8_t> no_errors_;
+
+    // Значения ссылок блока, каждая ячейка читается один раз, даже если
+    // формула ссылается на нее несколько раз
+    std::vector<Op> input_ops_;
+    std::vector<Column> inputs_;
+
+    static Column MakeColumn();
+    void Gather(const SheetInterface& sheet, const NumericColumns* numbers, const Op& op,
+                int first, int count, Column& column) const;
+};
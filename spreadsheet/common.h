@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -32,6 +35,17 @@ struct PositionHash {
     }
 };
 
+// Позиция ячейки другого листа книги, в формуле записывается как Лист2!A1
+struct SheetPosition {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const SheetPosition& rhs) const;
+    bool operator<(const SheetPosition& rhs) const;
+
+    std::string ToString() const;
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -39,6 +53,29 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область таблицы от левой верхней ячейки first до правой
+// нижней ячейки last включительно
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+
+    // Проверяет, что обе позиции валидны, а first не ниже и не правее last
+    bool IsValid() const;
+
+    bool Contains(Position pos) const;
+
+    Size GetSize() const;
+};
+
+struct RangeHash {
+    std::size_t operator()(Range range) const {
+        PositionHash hash;
+        return hash(range.first) * 37 + hash(range.last);
+    }
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -46,6 +83,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Arithmetic,  // в результате вычисления возникло деление на ноль
+        NotAvailable,  // функция поиска не нашла искомое значение
     };
 
     FormulaError(Category category)
@@ -72,6 +110,8 @@ public:
             return "#VALUE!"sv;
         case FormulaError::Category::Arithmetic:
             return "#ARITHM!"sv;
+        case FormulaError::Category::NotAvailable:
+            return "#N/A"sv;
         }
     }
 
@@ -101,6 +141,13 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Исключение, выбрасываемое при попытке создать лист книги с некорректным
+// или уже занятым именем
+class InvalidSheetNameException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
@@ -127,6 +174,140 @@ public:
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+// Счетчики работы таблицы, накопленные с момента её создания
+struct SheetStats {
+    // Число корзин гистограммы инвалидаций
+    static const int FANOUT_BUCKETS = 24;
+
+    std::uint64_t formula_parses = 0;     // разобранные формулы
+    std::uint64_t parse_time_ns = 0;      // суммарное время разбора формул
+    std::uint64_t formula_cache_hits = 0;   // формулы, взятые из кэша формул без разбора
+    std::uint64_t formula_cache_misses = 0; // формулы, которых не было в кэше формул
+    std::uint64_t evaluations = 0;        // вычисления формул
+    std::uint64_t cache_hits = 0;         // обращения к значению ячейки из кэша
+    std::uint64_t cache_misses = 0;       // обращения к значению ячейки мимо кэша
+    std::uint64_t cycle_check_visits = 0; // ячейки, пройденные при поиске циклов
+    std::uint64_t placeholder_cells = 0;  // пустые ячейки, созданные для ссылок
+    std::uint64_t invalidations = 0;      // изменения ячеек, сбросившие кэш
+    std::uint64_t invalidated_cells = 0;  // ячейки, кэш которых был сброшен
+    std::uint64_t kernel_rows = 0;        // формулы, вычисленные пакетно по столбцу
+    std::uint64_t number_formats = 0;     // числа, переведенные в текст при выводе таблицы
+    std::uint64_t lookup_index_builds = 0; // индексы столбцов, построенные для функций поиска
+
+    // Гистограмма числа ячеек, инвалидированных одним изменением:
+    // корзина 0 - ни одной ячейки, корзина i - от 2^(i-1) до 2^i - 1 ячеек
+    std::uint64_t invalidation_fanout[FANOUT_BUCKETS] = {};
+
+    // Доля формул, взятых из кэша формул
+    double FormulaCacheHitRatio() const {
+        const auto total = formula_cache_hits + formula_cache_misses;
+        return total == 0 ? 0.0 : static_cast<double>(formula_cache_hits) / total;
+    }
+};
+
+std::ostream& operator<<(std::ostream& output, const SheetStats& stats);
+
+// Память таблицы в байтах по подсистемам. Учитываются блоки динамической
+// памяти с поправкой на служебные данные распределителя, поэтому итог
+// близок к реальному потреблению процесса.
+struct MemoryUsage {
+    std::size_t cells = 0;            // ячейки, включая пустые ячейки для ссылок и числа без объектов ячеек
+    std::size_t cell_storage = 0;     // объекты ячеек и их содержимого
+    std::size_t text = 0;             // строки текстовых ячеек
+    std::size_t formula_ast = 0;      // узлы AST формул и списки ссылок
+    std::size_t dependency_edges = 0; // связи между ячейками
+    std::size_t cached_values = 0;    // кэш значений ячеек
+    std::size_t hash_table = 0;       // корзины и узлы хеш-таблицы ячеек
+    std::size_t numeric_columns = 0;  // плотные столбцы числовых значений
+    std::size_t formula_cache = 0;    // кэш разобранных формул, у листа книги - общий кэш книги
+    std::size_t lookup_indexes = 0;   // индексы столбцов для функций поиска и ссылки на диапазоны
+
+    std::size_t Total() const {
+        return cell_storage + text + formula_ast + dependency_edges + cached_values + hash_table
+            + numeric_columns + formula_cache + lookup_indexes;
+    }
+
+    double BytesPerCell() const {
+        return cells == 0 ? 0.0 : static_cast<double>(Total()) / cells;
+    }
+
+    MemoryUsage& operator+=(const MemoryUsage& other);
+};
+
+std::ostream& operator<<(std::ostream& output, const MemoryUsage& usage);
+
+// Режим пересчета формул таблицы
+enum class RecalculationMode {
+    Lazy,   // формула вычисляется при первом чтении после изменения
+    Eager,  // изменение таблицы сразу пересчитывает зависимые формулы
+    Async,  // зависимые формулы пересчитывает фоновый поток
+};
+
+// Значение ячейки, прочитанное без ожидания фонового пересчета
+struct CellSnapshot {
+    CellInterface::Value value;
+    // Формула еще не пересчитана, value - ее значение до изменения таблицы
+    bool stale = false;
+};
+
+// Ячейки, значения которых затронуло изменение таблицы. Позиции
+// упорядочены по строкам и не повторяются.
+struct ValueChanges {
+    // Ячейки, значение которых могло измениться: измененная ячейка и формулы,
+    // кэш которых был сброшен
+    std::vector<Position> invalidated;
+    // Только в режиме Eager: ячейки из invalidated, значение которых после
+    // пересчета отличается от прежнего
+    std::vector<Position> changed;
+};
+
+using ChangeHandler = std::function<void(const ValueChanges&)>;
+
+// Способ сравнения искомого значения в функциях поиска
+enum class LookupMode {
+    Exact,           // только совпадающее значение
+    ExactOrSmaller,  // совпадающее, иначе наибольшее из меньших
+    ExactOrLarger,   // совпадающее, иначе наименьшее из больших
+};
+
+// Ключ сортировки строк: столбец таблицы и направление
+struct SortKey {
+    int col = 0;
+    bool ascending = true;
+};
+
+// Операция сравнения в условии запроса
+enum class CompareOp {
+    Equal,
+    NotEqual,
+    Less,
+    LessOrEqual,
+    Greater,
+    GreaterOrEqual,
+};
+
+// Условие запроса: значение ячейки столбца col сравнивается с value.
+// Значения разных типов не сравниваются, такие и пустые ячейки условию
+// не удовлетворяют.
+struct QueryCondition {
+    int col = 0;
+    CompareOp op = CompareOp::Equal;
+    CellInterface::Value value;
+};
+
+// Множество строк таблицы, строка row - бит row % 64 слова words[row / 64]
+struct RowBitmap {
+    std::vector<std::uint64_t> words;
+
+    bool Contains(int row) const;
+
+    // Число строк в множестве
+    int Count() const;
+
+    // Номера строк по возрастанию
+    std::vector<int> GetRows() const;
+};
+
 // Интерфейс таблицы
 class SheetInterface {
 public:
@@ -157,6 +338,30 @@ public:
     // объект с пустым текстом.
     virtual void ClearCell(Position pos) = 0;
 
+    // Вставляет count пустых строк (столбцов) перед строкой (столбцом) before.
+    // Ячейки ниже (правее) сдвигаются, ссылки на них в формулах обновляются
+    // без повторного разбора формул. Если сдвинутые ячейки выходят за пределы
+    // таблицы, то бросается исключение InvalidPositionException и таблица
+    // не изменяется.
+    virtual void InsertRows(int before, int count = 1) = 0;
+    virtual void InsertColumns(int before, int count = 1) = 0;
+
+    // Удаляет count строк (столбцов) начиная со строки (столбца) first.
+    // Ссылки на удалённые ячейки в формулах становятся #REF!, в том числе
+    // ссылки из формул других листов книги.
+    virtual void DeleteRows(int first, int count = 1) = 0;
+    virtual void DeleteColumns(int first, int count = 1) = 0;
+
+    // Устойчиво сортирует строки области range по значениям ключей keys:
+    // при равенстве по первому ключу сравниваются следующие. Числа идут
+    // раньше текста, текст - раньше ошибок, пустые ячейки - всегда в конце.
+    // Без ключей строки сортируются по первому столбцу области по
+    // возрастанию. Переставляются только ячейки внутри области, ссылки
+    // формул на них следуют за ячейками без повторного разбора формул.
+    // Если область некорректна или столбец ключа лежит вне ее, то бросается
+    // исключение InvalidPositionException и таблица не изменяется.
+    virtual void SortRange(Range range, const std::vector<SortKey>& keys) = 0;
+
     // Вычисляет размер области, которая участвует в печати.
     // Определяется как ограничивающий прямоугольник всех ячеек с непустым
     // текстом.
@@ -168,7 +373,153 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Выводит область range в том же виде, что PrintValues и PrintTexts.
+    // Заголовки содержат номера строк и буквы столбцов таблицы. Если
+    // область невалидна, бросается исключение InvalidPositionException.
+    virtual void PrintValues(std::ostream& output, Range range) const = 0;
+    virtual void PrintTexts(std::ostream& output, Range range) const = 0;
+
+    // Задает число потоков вывода таблицы. Строки большой области делятся
+    // на полосы, каждый поток записывает свои полосы в отдельные буферы,
+    // которые затем выводятся по порядку, поэтому вывод не зависит от
+    // числа потоков. 0 - по числу ядер процессора, по умолчанию.
+    // В режиме Async таблица выводится одним потоком.
+    virtual void SetPrintThreads(std::size_t threads) = 0;
+
+    // Возвращает ячейки, значения которых зависят от ячейки pos: формулы,
+    // ссылающиеся на нее, а если transitive == true - и все формулы, которые
+    // ссылаются на них, в том числе на других листах книги. Ячейки таблицы
+    // вне книги возвращаются с пустым именем листа. Порядок не определен.
+    virtual std::vector<SheetPosition> GetDependents(Position pos, bool transitive) const = 0;
+
+    // Возвращает ячейки, от которых зависит значение ячейки pos: ячейки,
+    // на которые ссылается ее формула, а если transitive == true - и все
+    // ячейки, от которых зависят они. Порядок не определен.
+    virtual std::vector<SheetPosition> GetPrecedents(Position pos, bool transitive) const = 0;
+
+    // Ищет значение key в столбце column - области шириной в один столбец -
+    // и возвращает номер строки таблицы с найденным значением или nullopt.
+    // Числа сравниваются только с числами, текст - только с текстом, среди
+    // равных значений выбирается верхняя строка. Для поиска у столбца
+    // строится индекс, который затем обновляется изменениями ячеек, поэтому
+    // поиск не просматривает столбец. Формулы столбца вычисляются при поиске.
+    virtual std::optional<int> LookupRow(Range column, const CellInterface::Value& key,
+                                         LookupMode mode) const = 0;
+
+    // Возвращает строки области range, значения которых удовлетворяют всем
+    // условиям conditions. Условия проверяются по столбцам: числа ячеек
+    // сравниваются пословно по плотным столбцам чисел, формулы - по
+    // значениям в кэше, остальные ячейки читаются только в строках,
+    // прошедших предыдущие условия. Без условий возвращаются все строки
+    // области. Если область некорректна или столбец условия лежит вне ее,
+    // то бросается исключение InvalidPositionException.
+    virtual RowBitmap QueryRows(Range range,
+        const std::vector<QueryCondition>& conditions) const = 0;
+
+    // Возвращает лист с именем name из книги, в которую входит таблица.
+    // Возвращает nullptr, если такого листа нет или таблица создана вне книги.
+    virtual const SheetInterface* FindSheet(std::string_view name) const = 0;
+
+    // Возвращает счетчики работы таблицы: разбор и вычисление формул,
+    // попадания в кэш значений, инвалидации и поиск циклических зависимостей.
+    virtual SheetStats GetStats() const = 0;
+
+    // Вычисляет значения всех формул таблицы, которых нет в кэше. Серии
+    // формул одинаковой формы в соседних строках столбца вычисляются
+    // пакетно, остальные формулы - по одной.
+    virtual void RecalculateAll() const = 0;
+
+    // Задает режим пересчета. В режиме Eager методы, изменяющие таблицу,
+    // перед возвратом пересчитывают все формулы, значения которых изменились,
+    // в том числе формулы этого листа, зависящие от ячеек других листов книги,
+    // поэтому чтение значения ячейки не требует вычислений. При включении
+    // режима пересчитываются все формулы таблицы.
+    // В режиме Async изменение таблицы только ставит сброшенные формулы в
+    // очередь фонового потока и не ждет их вычисления. Значения подписчикам
+    // в этом режиме не сравниваются, ValueChanges::changed пуст. Методы
+    // листов книги с таким листом можно вызывать из одного потока, кроме
+    // GetValue, GetSnapshot и WaitForRecalculation.
+    virtual void SetRecalculationMode(RecalculationMode mode) = 0;
+    virtual RecalculationMode GetRecalculationMode() const = 0;
+
+    // Возвращает значение ячейки pos без ожидания фонового пересчета. Если
+    // формула ячейки еще не пересчитана и ее прежнее значение известно,
+    // возвращается оно с признаком stale, иначе значение вычисляется.
+    // Для пустой позиции возвращается пустая строка. Если позиция
+    // невалидна, выбрасывается исключение InvalidPositionException.
+    virtual CellSnapshot GetSnapshot(Position pos) const = 0;
+
+    // Ждет, пока фоновый поток пересчитает все формулы, сброшенные
+    // изменениями таблицы. Вне режима Async возвращается сразу.
+    virtual void WaitForRecalculation() const = 0;
+
+    // Подписывает handler на изменения значений ячеек таблицы. После каждого
+    // вызова SetCell и ClearCell, изменившего таблицу, а также после удаления
+    // строк или столбцов, сбросившего кэш формул, handler получает ячейки
+    // этого листа, которые затронуло изменение, в том числе изменением
+    // ячейки другого листа книги. При вставке и удалении строк и столбцов
+    // позиции ячеек сдвигаются, поэтому их нужно перечитать. Handler не
+    // должен изменять таблицы книги. Возвращает номер подписки.
+    virtual std::size_t Subscribe(ChangeHandler handler) = 0;
+
+    // Отменяет подписку с номером id
+    virtual void Unsubscribe(std::size_t id) = 0;
+
+    // Резервирует место под count ячеек, чтобы при загрузке большого числа
+    // ячеек хеш-таблица не перестраивалась по мере роста. Числа, текст
+    // которых совпадает с их записью, хранятся в столбцах чисел без места
+    // в хеш-таблице, поэтому в count их можно не учитывать.
+    virtual void ReserveCells(std::size_t count) = 0;
+
+    // Перенумеровывает ячейки построчно, чтобы ячейки соседних строк имели
+    // соседние идентификаторы, и освобождает слоты удаленных ячеек. У листа
+    // книги перенумеровываются ячейки всех листов.
+    virtual void CompactCellIds() = 0;
+
+    // Включает хранение текстов ячеек в общем пуле строк таблицы: одинаковые
+    // тексты хранятся в одном буфере. Действует на ячейки, текст которых
+    // задается после вызова. По умолчанию выключено.
+    virtual void SetStringInterning(bool enable) = 0;
+
+    // Задает наибольшее число выражений в кэше разобранных формул таблицы.
+    // Формула, текст которой есть в кэше, не разбирается заново, а разделяет
+    // дерево разбора с формулой кэша. 0 выключает кэш. По умолчанию
+    // кэш включен. Листы книги разделяют один кэш, поэтому емкость
+    // задается сразу для всех листов книги.
+    virtual void SetFormulaCacheCapacity(std::size_t capacity) = 0;
+
+    // Возвращает объем памяти, занимаемой ячейками таблицы
+    virtual MemoryUsage GetMemoryUsage() const = 0;
 };
 
 // Создаёт готовую к работе пустую таблицу.
 std::unique_ptr<SheetInterface> CreateSheet();
+
+// Интерфейс книги: набор именованных листов с общим графом зависимостей.
+// Формулы листа могут ссылаться на ячейки других листов книги: Лист2!A1,
+// если имя листа не является идентификатором, оно берётся в апострофы:
+// 'Мой лист'!A1.
+class WorkbookInterface {
+public:
+    virtual ~WorkbookInterface() = default;
+
+    // Создаёт пустой лист с именем name. Если имя пустое, содержит символы
+    // "!", "'" или перевод строки, либо уже занято, то бросается исключение
+    // InvalidSheetNameException.
+    virtual SheetInterface* CreateSheet(std::string name) = 0;
+
+    // Возвращает лист с именем name или nullptr, если такого листа нет.
+    virtual SheetInterface* GetSheet(std::string_view name) = 0;
+    virtual const SheetInterface* GetSheet(std::string_view name) const = 0;
+
+    // Возвращает имена листов в порядке их создания.
+    virtual std::vector<std::string> GetSheetNames() const = 0;
+
+    // Перенумеровывает ячейки всех листов: по листам в порядке создания,
+    // внутри листа - построчно
+    virtual void CompactCellIds() = 0;
+};
+
+// Создаёт пустую книгу.
+std::unique_ptr<WorkbookInterface> CreateWorkbook();
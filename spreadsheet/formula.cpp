@@ -1,10 +1,12 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "stats.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <mutex>
 #include <sstream>
 
 using namespace std::literals;
@@ -20,6 +22,10 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
     {
         return output << "#VALUE!";
     }
+    case FormulaError::Category::NotAvailable:
+    {
+        return output << "#N/A";
+    }
     default:
     {
         return output << "#REF!";
@@ -28,19 +34,43 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
 }
 
 namespace {
+// Дерево разбора и постфиксная запись формулы, общие для формул,
+// созданных методом Share
+struct ParsedFormula {
+    explicit ParsedFormula(const std::string& expression)
+        : ast(ParseFormulaAST(expression)) {
+    }
+
+    explicit ParsedFormula(FormulaAST tree)
+        : ast(std::move(tree)) {
+    }
+
+    FormulaAST ast;
+
+    // Постфиксная запись для пакетного вычисления, строится по запросу.
+    // Формулы с общим деревом могут вычисляться из разных потоков.
+    std::once_flag compile_once;
+    std::unique_ptr<FormulaProgram> program;
+};
+
 class Formula : public FormulaInterface {
 public:
     explicit Formula(std::string expression) try
-        : ast_(ParseFormulaAST(expression))
+        : parsed_(std::make_shared<ParsedFormula>(expression))
     {
     }
     catch (const std::exception& exc)
     {
         std::throw_with_nested(FormulaException(exc.what()));
     }
+
+    explicit Formula(std::shared_ptr<ParsedFormula> parsed)
+        : parsed_(std::move(parsed)) {
+    }
+
     Value Evaluate(const SheetInterface& sheet) const override {
         try {
-            return ast_.Execute(sheet);
+            return parsed_->ast.Execute(sheet);
         }
         catch (FormulaError error) {
             return error;
@@ -49,19 +79,257 @@ public:
     }
     std::string GetExpression() const override {
         std::ostringstream out;
-        ast_.PrintFormula(out);
+        parsed_->ast.PrintFormula(out);
         return out.str();
     }
 
     std::vector<Position> GetReferencedCells()  const override {
-        const auto positions = ast_.GetCells();
-        std::vector<Position> result{ positions.begin(), positions.end() };
+        const auto& positions = parsed_->ast.GetCells();
+        std::vector<Position> result;
+        for (const auto& pos : positions) {
+            if (pos.IsValid()) {
+                result.push_back(pos);
+            }
+        }
         result.erase(std::unique(result.begin(), result.end()), result.end());
         return result;
     };
 
+    std::vector<SheetPosition> GetExternalReferencedCells() const override {
+        std::vector<SheetPosition> result;
+        for (const auto& cell : parsed_->ast.GetExternalCells()) {
+            if (cell.pos.IsValid()) {
+                result.push_back(cell);
+            }
+        }
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+
+    std::vector<SheetPosition> GetConditionalCells() const override {
+        return parsed_->ast.GetConditionalCells();
+    }
+
+    std::vector<Range> GetRanges() const override {
+        std::vector<Range> result;
+        for (const auto& range : parsed_->ast.GetRanges()) {
+            if (range.IsValid() && std::find(result.begin(), result.end(), range) == result.end()) {
+                result.push_back(range);
+            }
+        }
+        return result;
+    }
+
+    const FormulaProgram* GetProgram() const override {
+        auto& parsed = *parsed_;
+        std::call_once(parsed.compile_once, [&parsed] {
+            auto program = std::make_unique<FormulaProgram>();
+            if (parsed.ast.Compile(*program)) {
+                parsed.program = std::move(program);
+            }
+        });
+        return parsed.program.get();
+    }
+
+    size_t GetMemoryUsage() const override {
+        size_t shared = memory::HeapBlock(sizeof(ParsedFormula)) + parsed_->ast.GetMemoryUsage();
+        if (parsed_->program) {
+            shared += memory::HeapBlock(sizeof(FormulaProgram))
+                + memory::VectorHeap(parsed_->program->ops);
+        }
+        return memory::HeapBlock(sizeof(*this)) + shared / parsed_.use_count();
+    }
+
+    std::unique_ptr<FormulaInterface> Share() const override {
+        return std::make_unique<Formula>(parsed_);
+    }
+
+    HandlingResult HandleInsertedRows(int before, int count, std::string_view sheet) override {
+        return HandleCells(sheet, [before, count](Position& cell) {
+            return ShiftOnInsert(cell.row, before, count);
+        }, [before, count](Range& range) {
+            return ShiftRangeOnInsert(range, range.first.row, range.last.row, before, count,
+                Position::MAX_ROWS);
+        });
+    }
+
+    HandlingResult HandleInsertedCols(int before, int count, std::string_view sheet) override {
+        return HandleCells(sheet, [before, count](Position& cell) {
+            return ShiftOnInsert(cell.col, before, count);
+        }, [before, count](Range& range) {
+            return ShiftRangeOnInsert(range, range.first.col, range.last.col, before, count,
+                Position::MAX_COLS);
+        });
+    }
+
+    HandlingResult HandleDeletedRows(int first, int count, std::string_view sheet) override {
+        return HandleCells(sheet, [first, count](Position& cell) {
+            return ShiftOnDelete(cell, cell.row, first, count);
+        }, [first, count](Range& range) {
+            return ShiftRangeOnDelete(range, range.first.row, range.last.row, first, count);
+        });
+    }
+
+    HandlingResult HandleDeletedCols(int first, int count, std::string_view sheet) override {
+        return HandleCells(sheet, [first, count](Position& cell) {
+            return ShiftOnDelete(cell, cell.col, first, count);
+        }, [first, count](Range& range) {
+            return ShiftRangeOnDelete(range, range.first.col, range.last.col, first, count);
+        });
+    }
+
+    HandlingResult HandleSortedRows(Range range, const std::vector<int>& new_rows,
+                                    std::string_view sheet) override {
+        auto result = HandleCells(sheet, [&range, &new_rows](Position& cell) {
+            if (!range.Contains(cell)) {
+                return HandlingResult::NothingChanged;
+            }
+            int row = new_rows[cell.row - range.first.row];
+            if (row == cell.row) {
+                return HandlingResult::NothingChanged;
+            }
+            cell.row = row;
+            return HandlingResult::ReferencesRenamedOnly;
+        }, [](Range& /* range */) {
+            return HandlingResult::NothingChanged;
+        });
+        if (result != HandlingResult::NothingChanged) {
+            // строки переставлены, порядок ссылок нужно восстановить
+            parsed_->ast.GetCells().sort();
+            parsed_->ast.GetExternalCells().sort();
+        }
+        return result;
+    }
+
 private:
-    FormulaAST ast_;
+    std::shared_ptr<ParsedFormula> parsed_;
+
+    static HandlingResult ShiftOnInsert(int& line, int before, int count) {
+        if (line < before) {
+            return HandlingResult::NothingChanged;
+        }
+        line += count;
+        return HandlingResult::ReferencesRenamedOnly;
+    }
+
+    static HandlingResult ShiftOnDelete(Position& cell, int& line, int first, int count) {
+        if (line < first) {
+            return HandlingResult::NothingChanged;
+        }
+        if (line < first + count) {
+            cell = Position::NONE;
+            return HandlingResult::ReferencesChanged;
+        }
+        line -= count;
+        return HandlingResult::ReferencesRenamedOnly;
+    }
+
+    // Строки, вставленные внутрь области, расширяют ее, и значение формулы
+    // нужно пересчитать: например, MATCH вернет другой номер строки. Часть
+    // области, сдвинутая за пределы таблицы, отбрасывается.
+    static HandlingResult ShiftRangeOnInsert(Range& range, int& first_line, int& last_line,
+                                             int before, int count, int limit) {
+        if (last_line < before) {
+            return HandlingResult::NothingChanged;
+        }
+        auto result = HandlingResult::ReferencesChanged;
+        if (first_line >= before) {
+            first_line += count;
+            result = HandlingResult::ReferencesRenamedOnly;
+        }
+        if (first_line >= limit) {
+            range = {Position::NONE, Position::NONE};
+            return HandlingResult::ReferencesChanged;
+        }
+        if (last_line + count >= limit) {
+            last_line = limit - 1;
+            return HandlingResult::ReferencesChanged;
+        }
+        last_line += count;
+        return result;
+    }
+
+    // Область, из которой удалена часть строк, сужается, а удаленная
+    // целиком становится #REF!
+    static HandlingResult ShiftRangeOnDelete(Range& range, int& first_line, int& last_line,
+                                             int first, int count) {
+        const int last = first + count;
+        if (last_line < first) {
+            return HandlingResult::NothingChanged;
+        }
+        if (first_line >= last) {
+            first_line -= count;
+            last_line -= count;
+            return HandlingResult::ReferencesRenamedOnly;
+        }
+        if (first_line >= first && last_line < last) {
+            range = {Position::NONE, Position::NONE};
+            return HandlingResult::ReferencesChanged;
+        }
+        first_line = std::min(first_line, first);
+        last_line = last_line >= last ? last_line - count : first - 1;
+        return HandlingResult::ReferencesChanged;
+    }
+
+    // Применяет handler к ссылкам формулы на лист sheet (пустое имя -
+    // лист формулы), а range_handler - к ее областям, возвращает
+    // наибольший результат
+    template <typename Handler, typename RangeHandler>
+    HandlingResult ApplyToCells(FormulaAST& ast, std::string_view sheet, Handler handler,
+                                RangeHandler range_handler) {
+        auto result = HandlingResult::NothingChanged;
+        if (sheet.empty()) {
+            for (auto& cell : ast.GetCells()) {
+                result = std::max(result, handler(cell));
+            }
+            // области бывают только у ссылок на лист формулы
+            for (auto& range : ast.GetRanges()) {
+                result = std::max(result, range_handler(range));
+            }
+        }
+        else {
+            for (auto& cell : ast.GetExternalCells()) {
+                if (cell.sheet == sheet) {
+                    result = std::max(result, handler(cell.pos));
+                }
+            }
+        }
+        return result;
+    }
+
+    // CellExpr и RangeExpr хранят указатели на узлы списков ячеек и
+    // областей, поэтому ссылки переписываются на месте, без повторного
+    // разбора формулы
+    template <typename Handler, typename RangeHandler>
+    HandlingResult HandleCells(std::string_view sheet, Handler handler,
+                               RangeHandler range_handler) {
+        if (parsed_.use_count() > 1) {
+            // Общее дерево не изменяется. Сначала ссылки проверяются на
+            // копиях позиций, и только если они сдвигаются, формула получает
+            // собственную копию дерева.
+            auto check = [&handler](Position& cell) {
+                Position copy = cell;
+                return handler(copy);
+            };
+            auto check_range = [&range_handler](Range& range) {
+                Range copy = range;
+                return range_handler(copy);
+            };
+            if (ApplyToCells(parsed_->ast, sheet, check, check_range)
+                == HandlingResult::NothingChanged) {
+                return HandlingResult::NothingChanged;
+            }
+            parsed_ = std::make_shared<ParsedFormula>(parsed_->ast.Copy());
+        }
+        auto& ast = parsed_->ast;
+        auto result = ApplyToCells(ast, sheet, handler, range_handler);
+        if (result == HandlingResult::ReferencesChanged) {
+            // ссылки #REF! нарушают порядок, его ожидает GetReferencedCells
+            ast.GetCells().sort();
+            ast.GetExternalCells().sort();
+        }
+        return result;
+    }
 };
 }  // namespace
 
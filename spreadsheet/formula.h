@@ -5,10 +5,40 @@
 #include <memory>
 #include <vector>
 
+// Формула в постфиксной записи, используется для пакетного вычисления
+// серий одинаковых формул столбца
+struct FormulaProgram {
+    enum class OpCode : char {
+        Number,    // помещает в стек число number
+        Cell,      // помещает в стек значение ячейки *cell
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+    };
+
+    struct Op {
+        OpCode code;
+        double number = 0;
+        // Указывает на позицию внутри формулы, поэтому остается актуальной
+        // при сдвиге ссылок после вставки и удаления строк и столбцов
+        const Position* cell = nullptr;
+    };
+
+    std::vector<Op> ops;
+};
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Значения ячеек других листов книги: Лист2!A1+'Мой лист'!B2
+// * Функции поиска по столбцу: MATCH(A1,B1:B100,0), VLOOKUP(A1,B1:D100,3),
+//   XLOOKUP(A1,B1:B100,C1:C100)
+// * Сравнения, равные 1 или 0: A1<B1, A1=B1, A1<>B1, A1>=2
+// * Условные функции IF(A1>0,B1,C1), IFERROR(A1/B1,0), CHOOSE(A1,B1,C1,D1),
+//   у которых вычисляется только выбранная ветвь
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,6 +64,70 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает список ячеек других листов, которые непосредственно
+    // задействованы в вычислении формулы. Список отсортирован по возрастанию
+    // и не содержит повторяющихся ячеек.
+    virtual std::vector<SheetPosition> GetExternalReferencedCells() const = 0;
+
+    // Возвращает ячейки, которые формула читает только в части ветвей
+    // условных функций. Ячейки листа формулы имеют пустое имя листа,
+    // список отсортирован и не содержит повторов. Ячейки, которые
+    // читаются при любом вычислении, в него не входят.
+    virtual std::vector<SheetPosition> GetConditionalCells() const = 0;
+
+    // Возвращает области листа формулы, переданные функциям поиска, без
+    // повторов и областей, ставших #REF!. Значение формулы зависит от всех
+    // ячеек этих областей, в том числе от еще не созданных.
+    virtual std::vector<Range> GetRanges() const = 0;
+
+    // Возвращает формулу в постфиксной записи или nullptr, если формулу
+    // нельзя вычислить пакетно, например, если она ссылается на другие листы.
+    // Запись строится при первом обращении.
+    virtual const FormulaProgram* GetProgram() const = 0;
+
+    // Возвращает объем динамической памяти, занимаемой формулой,
+    // включая узлы дерева разбора и списки ссылок. Память дерева, общего
+    // для нескольких формул, делится между ними поровну.
+    virtual size_t GetMemoryUsage() const = 0;
+
+    // Создает формулу с тем же выражением без повторного разбора: новая
+    // формула разделяет с этой неизменяемое дерево разбора. Формула получает
+    // собственную копию дерева при первом изменении своих ссылок.
+    virtual std::unique_ptr<FormulaInterface> Share() const = 0;
+
+    // Результат обновления ссылок формулы при изменении структуры таблицы
+    enum class HandlingResult {
+        NothingChanged,         // формула не ссылается на сдвинутые ячейки
+        ReferencesRenamedOnly,  // ссылки сдвинуты, значение формулы не изменилось
+        ReferencesChanged       // часть ссылок стала #REF!, значение нужно пересчитать
+    };
+
+    // Обновляет ссылки формулы при вставке count строк (столбцов) перед
+    // строкой (столбцом) before: ссылки на ячейки ниже (правее) сдвигаются,
+    // области, внутрь которых вставлены строки, расширяются.
+    // Если передано имя листа sheet, обновляются только ссылки на ячейки
+    // этого листа вида sheet!A1, иначе - ссылки на ячейки листа формулы.
+    virtual HandlingResult HandleInsertedRows(int before, int count = 1,
+                                              std::string_view sheet = {}) = 0;
+    virtual HandlingResult HandleInsertedCols(int before, int count = 1,
+                                              std::string_view sheet = {}) = 0;
+
+    // Обновляет ссылки формулы при удалении count строк (столбцов) начиная
+    // с first: ссылки на удалённые ячейки становятся #REF!, ссылки на ячейки
+    // ниже (правее) сдвигаются, области сужаются, а удаленные целиком
+    // становятся #REF!. Параметр sheet аналогичен методам выше.
+    virtual HandlingResult HandleDeletedRows(int first, int count = 1,
+                                             std::string_view sheet = {}) = 0;
+    virtual HandlingResult HandleDeletedCols(int first, int count = 1,
+                                             std::string_view sheet = {}) = 0;
+
+    // Обновляет ссылки формулы после сортировки строк области range:
+    // ссылка на ячейку области из строки row переходит в строку
+    // new_rows[row - range.first.row], ссылки на области не изменяются.
+    // Параметр sheet аналогичен методам выше.
+    virtual HandlingResult HandleSortedRows(Range range, const std::vector<int>& new_rows,
+                                            std::string_view sheet = {}) = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
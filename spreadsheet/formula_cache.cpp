@@ -0,0 +1,55 @@
+#include "formula_cache.h"
+
+#include "stats.h"
+
+FormulaCache::FormulaCache(std::size_t capacity)
+    : capacity_(capacity) {
+}
+
+std::unique_ptr<FormulaInterface> FormulaCache::Find(std::string_view expression) {
+    auto it = index_.find(expression);
+    if (it == index_.end()) {
+        return nullptr;
+    }
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->formula->Share();
+}
+
+void FormulaCache::Add(std::string expression, const FormulaInterface& formula) {
+    if (capacity_ == 0 || index_.count(expression) > 0) {
+        return;
+    }
+    entries_.push_front({std::move(expression), formula.Share()});
+    index_.emplace(entries_.front().expression, entries_.begin());
+    EvictExcess();
+}
+
+void FormulaCache::SetCapacity(std::size_t capacity) {
+    capacity_ = capacity;
+    EvictExcess();
+}
+
+std::size_t FormulaCache::GetCapacity() const {
+    return capacity_;
+}
+
+std::size_t FormulaCache::GetSize() const {
+    return entries_.size();
+}
+
+std::size_t FormulaCache::GetMemoryUsage() const {
+    // Узел списка хранит два указателя и запись
+    const std::size_t node = memory::HeapBlock(2 * sizeof(void*) + sizeof(Entry));
+    std::size_t result = memory::HashTableHeap(index_);
+    for (const auto& entry : entries_) {
+        result += node + memory::StringHeap(entry.expression) + entry.formula->GetMemoryUsage();
+    }
+    return result;
+}
+
+void FormulaCache::EvictExcess() {
+    while (entries_.size() > capacity_) {
+        index_.erase(entries_.back().expression);
+        entries_.pop_back();
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "formula.h"
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Ограниченный кэш разобранных формул таблицы по тексту выражения. При
+// переполнении вытесняется формула, которую дольше всех не запрашивали (LRU).
+// Ячейки получают формулы, разделяющие неизменяемое дерево разбора с
+// формулой кэша, поэтому повторная вставка того же текста формулы не
+// запускает лексер и парсер.
+class FormulaCache {
+public:
+    static constexpr std::size_t DEFAULT_CAPACITY = 4096;
+
+    explicit FormulaCache(std::size_t capacity = DEFAULT_CAPACITY);
+
+    FormulaCache(const FormulaCache&) = delete;
+    FormulaCache& operator=(const FormulaCache&) = delete;
+
+    // Возвращает формулу с выражением expression, разделяющую дерево
+    // разбора с формулой кэша, или nullptr, если выражения нет в кэше
+    std::unique_ptr<FormulaInterface> Find(std::string_view expression);
+
+    // Запоминает разобранную формулу с выражением expression
+    void Add(std::string expression, const FormulaInterface& formula);
+
+    // Задает наибольшее число формул в кэше, 0 выключает кэш
+    void SetCapacity(std::size_t capacity);
+    std::size_t GetCapacity() const;
+
+    std::size_t GetSize() const;
+
+    // Память кэша: выражения, списки и доля общих деревьев разбора
+    std::size_t GetMemoryUsage() const;
+
+private:
+    struct Entry {
+        std::string expression;
+        std::unique_ptr<FormulaInterface> formula;
+    };
+
+    std::size_t capacity_;
+
+    // От недавно запрошенных формул к давним
+    std::list<Entry> entries_;
+
+    // Ключ указывает на выражение, хранящееся в самой записи
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+
+    void EvictExcess();
+};
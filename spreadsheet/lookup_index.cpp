@@ -0,0 +1,225 @@
+#include "lookup_index.h"
+
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+
+namespace {
+using Key = LookupIndex::Key;
+
+// NaN не равен ничему и нарушил бы порядок упорядоченного множества
+bool IsSearchable(const Key& key) {
+    return !std::holds_alternative<double>(key) || !std::isnan(std::get<double>(key));
+}
+
+// -0 и +0 равны, но могут иметь разный хеш
+Key Normalize(Key key) {
+    if (std::holds_alternative<double>(key) && std::get<double>(key) == 0) {
+        key = 0.0;
+    }
+    return key;
+}
+
+// Пара значение - строка для поиска в упорядоченном множестве без
+// копирования значения
+using KeyProbe = std::pair<const Key&, int>;
+
+constexpr int FIRST_ROW = std::numeric_limits<int>::min();
+constexpr int LAST_ROW = std::numeric_limits<int>::max();
+}  // namespace
+
+void LookupIndex::Set(int row, Key key) {
+    Erase(row);
+    key = Normalize(std::move(key));
+    if (IsSearchable(key)) {
+        InsertKey(row, std::move(key));
+    }
+}
+
+void LookupIndex::SetFormula(int row) {
+    Erase(row);
+    formulas_.insert(row);
+    stale_formulas_.insert(row);
+}
+
+void LookupIndex::InvalidateFormula(int row) {
+    if (formulas_.count(row) != 0) {
+        EraseKey(row);
+        stale_formulas_.insert(row);
+    }
+}
+
+void LookupIndex::Reset(int row) {
+    Erase(row);
+}
+
+void LookupIndex::Erase(int row) {
+    formulas_.erase(row);
+    stale_formulas_.erase(row);
+    EraseKey(row);
+}
+
+void LookupIndex::InsertKey(int row, Key key) {
+    if (row >= static_cast<int>(keys_.size())) {
+        keys_.resize(row + 1);
+    }
+    rows_by_key_[key].insert(row);
+    if (is_sorted_built_) {
+        sorted_.emplace(key, row);
+    }
+    keys_[row] = std::move(key);
+}
+
+void LookupIndex::EraseKey(int row) {
+    if (row >= static_cast<int>(keys_.size()) || !keys_[row]) {
+        return;
+    }
+    const auto& key = *keys_[row];
+    auto ptr = rows_by_key_.find(key);
+    ptr->second.erase(row);
+    if (ptr->second.empty()) {
+        rows_by_key_.erase(ptr);
+    }
+    if (is_sorted_built_) {
+        sorted_.erase(sorted_.find(KeyProbe{key, row}));
+    }
+    keys_[row].reset();
+}
+
+void LookupIndex::BuildSorted() {
+    std::vector<Entry> entries;
+    for (int row = 0; row < static_cast<int>(keys_.size()); ++row) {
+        if (keys_[row]) {
+            entries.push_back({*keys_[row], row});
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    // Вставка упорядоченных пар в конец множества занимает линейное время
+    sorted_.clear();
+    for (auto& entry : entries) {
+        sorted_.emplace_hint(sorted_.end(), std::move(entry));
+    }
+    is_sorted_built_ = true;
+}
+
+std::optional<LookupIndex::Entry> LookupIndex::FindStored(const Key& key, LookupMode mode,
+    int first_row, int last_row) {
+    if (mode == LookupMode::Exact) {
+        auto ptr = rows_by_key_.find(key);
+        if (ptr == rows_by_key_.end()) {
+            return std::nullopt;
+        }
+        const auto& rows = ptr->second;
+        auto row = rows.lower_bound(first_row);
+        if (row == rows.end() || *row > last_row) {
+            return std::nullopt;
+        }
+        return Entry{key, *row};
+    }
+    if (!is_sorted_built_) {
+        BuildSorted();
+    }
+    // Равные значения лежат подряд по возрастанию строк. Группы значений
+    // перебираются от ближайшей к искомому, пока в группе не найдется
+    // строка из области поиска.
+    auto in_range = [this, first_row, last_row](const Key& value) -> std::optional<Entry> {
+        auto entry = sorted_.lower_bound(KeyProbe{value, first_row});
+        if (entry == sorted_.end() || !(entry->first == value) || entry->second > last_row) {
+            return std::nullopt;
+        }
+        return *entry;
+    };
+    if (mode == LookupMode::ExactOrSmaller) {
+        auto end = sorted_.upper_bound(KeyProbe{key, LAST_ROW});
+        while (end != sorted_.begin() && std::prev(end)->first.index() == key.index()) {
+            const Key& value = std::prev(end)->first;
+            if (auto entry = in_range(value)) {
+                return entry;
+            }
+            end = sorted_.lower_bound(KeyProbe{value, FIRST_ROW});
+        }
+        return std::nullopt;
+    }
+    auto begin = sorted_.lower_bound(KeyProbe{key, FIRST_ROW});
+    while (begin != sorted_.end() && begin->first.index() == key.index()) {
+        const Key& value = begin->first;
+        if (auto entry = in_range(value)) {
+            return entry;
+        }
+        begin = sorted_.upper_bound(KeyProbe{value, LAST_ROW});
+    }
+    return std::nullopt;
+}
+
+std::optional<int> LookupIndex::Find(const Key& raw_key, LookupMode mode, int first_row,
+    int last_row, const FormulaValue& formula_value) {
+    const Key key = Normalize(raw_key);
+    if (!IsSearchable(key)) {
+        return std::nullopt;
+    }
+    // Значения формул области, которых нет в индексе, читаются и
+    // запоминаются. Чтение может вычислить формулу, которая сама ищет в
+    // этом столбце, поэтому строка удаляется из stale_formulas_ только
+    // после чтения, а следующая ищется заново.
+    int row = first_row;
+    while (auto stale = FindStaleFormula(row, last_row)) {
+        row = *stale;
+        auto value = formula_value(row);
+        if (stale_formulas_.erase(row) != 0 && value && IsSearchable(*value)) {
+            InsertKey(row, Normalize(std::move(*value)));
+        }
+        ++row;
+    }
+    auto best = FindStored(key, mode, first_row, last_row);
+    if (!best) {
+        return std::nullopt;
+    }
+    return best->second;
+}
+
+const std::set<int>& LookupIndex::GetRows(const Key& key) const {
+    static const std::set<int> no_rows;
+    auto ptr = rows_by_key_.find(Normalize(key));
+    return ptr == rows_by_key_.end() ? no_rows : ptr->second;
+}
+
+const std::set<int>& LookupIndex::GetFormulaRows() const {
+    return formulas_;
+}
+
+std::optional<int> LookupIndex::FindStaleFormula(int first_row, int last_row) const {
+    auto row = stale_formulas_.lower_bound(first_row);
+    if (row == stale_formulas_.end() || *row > last_row) {
+        return std::nullopt;
+    }
+    return *row;
+}
+
+std::size_t LookupIndex::GetMemoryUsage() const {
+    auto key_heap = [](const Key& key) {
+        return std::holds_alternative<std::string>(key)
+            ? memory::StringHeap(std::get<std::string>(key)) : 0;
+    };
+    // Узел множества хранит три указателя, цвет и значение
+    auto set_node = [](std::size_t value_size) {
+        return memory::HeapBlock(4 * sizeof(void*) + value_size);
+    };
+    std::size_t result = memory::VectorHeap(keys_) + memory::HashTableHeap(rows_by_key_)
+        + sorted_.size() * set_node(sizeof(Entry))
+        + (formulas_.size() + stale_formulas_.size()) * set_node(sizeof(int));
+    for (const auto& key : keys_) {
+        if (key) {
+            result += key_heap(*key);
+        }
+    }
+    for (const auto& [key, rows] : rows_by_key_) {
+        result += key_heap(key) + rows.size() * set_node(sizeof(int));
+    }
+    for (const auto& [key, row] : sorted_) {
+        result += key_heap(key);
+    }
+    return result;
+}
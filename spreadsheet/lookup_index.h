@@ -0,0 +1,104 @@
+#pragma once
+
+#include "common.h"
+
+#include <functional>
+#include <optional>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Индекс значений одного столбца таблицы для функций поиска. Точный поиск
+// идет по хеш-таблице значений, поиск ближайшего - по упорядоченному
+// множеству, которое строится при первом таком поиске. Таблица и множество
+// обновляются при каждом изменении ячейки столбца за O(log n), поэтому
+// поиск стоит O(1) и O(log n) вместо просмотра столбца. Значения формул
+// меняются без изменения ячейки: индекс хранит числовые значения формул,
+// прочитанные при поиске, пока таблица не сообщит об их инвалидации, а
+// значения остальных формул вычисляются при поиске.
+class LookupIndex {
+public:
+    // Число или непустой текст, числа меньше любого текста
+    using Key = std::variant<double, std::string>;
+
+    // Возвращает значение формулы строки row, если его можно искать
+    using FormulaValue = std::function<std::optional<Key>(int row)>;
+
+    // Задает значение ячейки строки row
+    void Set(int row, Key key);
+
+    // Отмечает, что в строке row формула
+    void SetFormula(int row);
+
+    // Забывает значение формулы строки row, сброшенное из кэша ячейки
+    void InvalidateFormula(int row);
+
+    // Отмечает, что строка row пуста
+    void Reset(int row);
+
+    // Возвращает строку из [first_row, last_row] со значением, подходящим
+    // под key в режиме mode, или nullopt. Среди равных значений выбирается
+    // верхняя строка. Значения формул, которых нет в индексе, вычисляются
+    // formula_value и запоминаются.
+    std::optional<int> Find(const Key& key, LookupMode mode, int first_row, int last_row,
+                            const FormulaValue& formula_value);
+
+    // Возвращает строки со значением key по возрастанию. Из формул в
+    // результат попадают только строки с прочитанным числовым значением.
+    const std::set<int>& GetRows(const Key& key) const;
+
+    // Возвращает строки с формулами
+    const std::set<int>& GetFormulaRows() const;
+
+    // Возвращает первую строку из [first_row, last_row] с формулой, значение
+    // которой поиск еще не прочитал, или nullopt
+    std::optional<int> FindStaleFormula(int first_row, int last_row) const;
+
+    std::size_t GetMemoryUsage() const;
+
+private:
+    using Entry = std::pair<Key, int>;
+
+    // Сравнивает пары значение - строка, в том числе с парами из ссылки на
+    // значение, чтобы искать в множестве без копирования строк
+    struct EntryLess {
+        using is_transparent = void;
+
+        template <typename Lhs, typename Rhs>
+        bool operator()(const Lhs& lhs, const Rhs& rhs) const {
+            return std::tie(lhs.first, lhs.second) < std::tie(rhs.first, rhs.second);
+        }
+    };
+
+    // Значения по строкам, nullopt - пустая строка или формула без
+    // значения в индексе
+    std::vector<std::optional<Key>> keys_;
+
+    // Строки с каждым значением по возрастанию
+    std::unordered_map<Key, std::set<int>> rows_by_key_;
+
+    // Пары значение - строка по возрастанию, строятся при первом поиске
+    // ближайшего значения
+    std::set<Entry, EntryLess> sorted_;
+    bool is_sorted_built_ = false;
+
+    // Строки с формулами и строки формул, значения которых не прочитаны
+    // после последней инвалидации
+    std::set<int> formulas_;
+    std::set<int> stale_formulas_;
+
+    void Erase(int row);
+    // Добавляет значение строки в keys_, rows_by_key_ и sorted_
+    void InsertKey(int row, Key key);
+    // Удаляет значение строки из keys_, rows_by_key_ и sorted_
+    void EraseKey(int row);
+    void BuildSorted();
+
+    // Ищет среди значений столбца и прочитанных значений формул
+    std::optional<Entry> FindStored(const Key& key, LookupMode mode, int first_row,
+                                    int last_row);
+};
@@ -1,13 +1,18 @@
-﻿#include <limits>
+﻿#include <fstream>
+#include <limits>
 #include <iostream>
 
 #include "common.h"
 #include "formula.h"
+#include "number_format.h"
+#include "script.h"
+#include "server.h"
 #include "tests.h"
+#include "trace.h"
 
 using namespace std;
 
-enum Command { CLEAR, SET, PRINT };
+enum Command { CLEAR, SET, PRINT, SHEET, TRACE, RECALC };
 
 string ParseCommand() {
 	char ch;
@@ -49,6 +54,15 @@ Command GetCommonCommand(string& command) {
 	else if (command == "print"s) {
 		return PRINT;
 	}
+	else if (command == "sheet"s) {
+		return SHEET;
+	}
+	else if (command == "trace"s) {
+		return TRACE;
+	}
+	else if (command == "recalc"s) {
+		return RECALC;
+	}
 	else {
 		throw invalid_argument(command);
 	}
@@ -70,14 +84,67 @@ void PrintInstructions() {
 	cout << "  clear"s << "     Clears the cell value.\n"s
 		 << "            Input format : clear 'cell position'\n"s;
 	cout << "--------------------------------------------------------------------------\n"s;
+	cout << "  sheet"s << "     Switches to the workbook sheet with the specified name,\n"s
+		 << "            creates the sheet if it does not exist.\n"s
+		 << "            Input format : sheet 'sheet name'\n"s
+		 << "            Cells of other sheets are referenced as Sheet2!A1\n"s;
+	cout << "--------------------------------------------------------------------------\n"s;
+	cout << "  stats"s << "     Prints the engine counters of the current sheet: formula parses,\n"s
+		 << "            evaluations, cache hits and misses, invalidation fan-out.\n"s;
+	cout << "--------------------------------------------------------------------------\n"s;
+	cout << "  memory"s << "    Prints the memory used by the current sheet: cell storage, text,\n"s
+		 << "            formula ASTs, dependency edges, cached values, hash table.\n"s;
+	cout << "--------------------------------------------------------------------------\n"s;
+	cout << "  trace"s << "     Records parse, update and recalculation activity.\n"s
+		 << "            Input format : trace on | trace off | trace save 'file name'\n"s
+		 << "            The file is written in the Chrome trace-event format and\n"s
+		 << "            can be opened in chrome://tracing or Perfetto.\n"s;
+	cout << "--------------------------------------------------------------------------\n"s;
+	cout << "  recalc"s << "    Sets the recalculation mode of the current sheet.\n"s
+		 << "            Input format : recalc lazy | recalc eager | recalc async\n"s
+		 << "            In eager mode every change recalculates dependent formulas,\n"s
+		 << "            in async mode a background thread recalculates them.\n"s;
+	cout << "--------------------------------------------------------------------------\n"s;
 	cout << "  quite"s << "     Exit the program.\n"s;
 	cout << "--------------------------------------------------------------------------\n"s;
 }
 
 
-int main() {
+int main(int argc, char* argv[]) {
     //test::RunTests();
-	auto sheet = CreateSheet();
+	auto workbook = CreateWorkbook();
+	auto sheet = workbook->CreateSheet("Sheet1"s);
+	ios::sync_with_stdio(false);
+	if (argc == 3 && argv[1] == "--script"s) {
+		ScriptRunner runner(*workbook, sheet, cout, cerr);
+		if (argv[2] == "-"s) {
+			runner.Run(cin);
+		}
+		else {
+			ifstream input(argv[2], ios::binary);
+			if (!input) {
+				cerr << "error: cannot open file "s << argv[2] << endl;
+				return 1;
+			}
+			input.seekg(0, ios::end);
+			auto size = static_cast<size_t>(input.tellg());
+			input.seekg(0);
+			runner.Run(input, size);
+		}
+		cerr << runner.GetStats();
+		return runner.GetStats().errors == 0 ? 0 : 1;
+	}
+	if (argc == 3 && argv[1] == "--server"s) {
+		try {
+			Server server(*sheet, argv[2]);
+			server.Run();
+		}
+		catch (const exception& exc) {
+			cerr << "error: "s << exc.what() << endl;
+			return 1;
+		}
+		return 0;
+	}
 	while (true) {
 		string command = ParseCommand();
 		if (command == "quite"s) {
@@ -87,9 +154,61 @@ int main() {
 			PrintInstructions();
 			continue;
 		}
+		if (command == "stats"s) {
+			cout << sheet->GetStats();
+			continue;
+		}
+		if (command == "memory"s) {
+			cout << sheet->GetMemoryUsage();
+			continue;
+		}
 		try{
 			auto main_command = GetCommonCommand(command);
 			command = ParseCommand();
+			if (main_command == SHEET) {
+				sheet = workbook->GetSheet(command);
+				if (sheet == nullptr) {
+					sheet = workbook->CreateSheet(command);
+				}
+				continue;
+			}
+			if (main_command == TRACE) {
+				if (command == "on"s) {
+					trace::Clear();
+					trace::Enable(true);
+				}
+				else if (command == "off"s) {
+					trace::Enable(false);
+				}
+				else if (command == "save"s) {
+					string file_name = ParseCommand();
+					ofstream output(file_name);
+					if (!output) {
+						cerr << "error: cannot open file "s << file_name << endl;
+						continue;
+					}
+					trace::WriteChromeTrace(output);
+				}
+				else {
+					throw invalid_argument(command);
+				}
+				continue;
+			}
+			if (main_command == RECALC) {
+				if (command == "lazy"s) {
+					sheet->SetRecalculationMode(RecalculationMode::Lazy);
+				}
+				else if (command == "eager"s) {
+					sheet->SetRecalculationMode(RecalculationMode::Eager);
+				}
+				else if (command == "async"s) {
+					sheet->SetRecalculationMode(RecalculationMode::Async);
+				}
+				else {
+					throw invalid_argument(command);
+				}
+				continue;
+			}
 			if (command.size() < 2) {
 				throw invalid_argument(command);
 			}
@@ -135,8 +254,9 @@ int main() {
 						std::cout << "empty cell\n"s;
 					}
 					else {
-						std::cout << "value: "s << cell->GetValue() << "; "s
-							<< "text: "s << cell->GetText() << std::endl;
+						std::cout << "value: "s;
+						PrintValue(std::cout, cell->GetValue());
+						std::cout << "; "s << "text: "s << cell->GetText() << std::endl;
 					}
 				}
 				break;
@@ -166,6 +286,10 @@ int main() {
 			cerr << "error: circular dependency"s << endl;
 			cin.ignore(numeric_limits<streamsize>::max(), '\n');
 		}
+		catch (const InvalidSheetNameException&) {
+			cerr << "error: invalid sheet name"s << endl;
+			cin.ignore(numeric_limits<streamsize>::max(), '\n');
+		}
 		catch (...) {
 			cerr << "unknown exception"s << endl;
 			cin.ignore(numeric_limits<streamsize>::max(), '\n');
@@ -0,0 +1,61 @@
+#include "number_format.h"
+
+#include <charconv>
+#include <cmath>
+#include <type_traits>
+#include <variant>
+
+char* FormatNumber(double value, char* first) {
+    char* last = first + MAX_NUMBER_TEXT_SIZE;
+    const double magnitude = std::fabs(value);
+    // Без экспоненты привычнее читаются и целые числа, и дроби вроде 0.001,
+    // хотя запись 1e+05 короче, чем 100000
+    if (value == 0 || (magnitude >= 1e-4 && magnitude < 1e15)) {
+        return std::to_chars(first, last, value, std::chars_format::fixed).ptr;
+    }
+    return std::to_chars(first, last, value).ptr;
+}
+
+char* FormatNumber(double value, char* first, std::size_t width) {
+    char* last = FormatNumber(value, first);
+    for (int precision = 16; static_cast<std::size_t>(last - first) > width; --precision) {
+        last = std::to_chars(first, first + MAX_NUMBER_TEXT_SIZE, value,
+            std::chars_format::general, precision).ptr;
+    }
+    return last;
+}
+
+std::string FormatNumber(double value) {
+    char buffer[MAX_NUMBER_TEXT_SIZE];
+    return std::string(buffer, FormatNumber(value, buffer));
+}
+
+std::optional<double> ParseCanonicalNumber(std::string_view text) {
+    if (text.empty() || text.size() > MAX_NUMBER_TEXT_SIZE) {
+        return std::nullopt;
+    }
+    double value = 0;
+    const char* last = text.data() + text.size();
+    auto [end, error] = std::from_chars(text.data(), last, value);
+    if (error != std::errc{} || end != last || !std::isfinite(value)) {
+        return std::nullopt;
+    }
+    char buffer[MAX_NUMBER_TEXT_SIZE];
+    if (std::string_view(buffer, FormatNumber(value, buffer) - buffer) != text) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+std::ostream& PrintValue(std::ostream& output, const CellInterface::Value& value) {
+    std::visit([&output](const auto& alternative) {
+        if constexpr (std::is_same_v<std::decay_t<decltype(alternative)>, double>) {
+            char buffer[MAX_NUMBER_TEXT_SIZE];
+            output.write(buffer, FormatNumber(alternative, buffer) - buffer);
+        }
+        else {
+            output << alternative;
+        }
+    }, value);
+    return output;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+// Наибольшая длина записи числа функцией FormatNumber
+inline constexpr std::size_t MAX_NUMBER_TEXT_SIZE = 24;
+
+// Записывает value кратчайшим текстом, который читается обратно в то же
+// число. Числа от 1e-4 до 1e15 по модулю записываются без экспоненты,
+// остальные - в более короткой из двух форм. В буфер first помещается не
+// больше MAX_NUMBER_TEXT_SIZE символов, возвращается конец записи.
+char* FormatNumber(double value, char* first);
+
+// Наименьшая ширина, в которую помещается любое число: -1e-308
+inline constexpr std::size_t MIN_NUMBER_WIDTH = 7;
+
+// Записывает value не длиннее width символов, width не меньше
+// MIN_NUMBER_WIDTH. Если кратчайшая точная запись длиннее, число
+// округляется до наибольшего числа значащих цифр, с которым запись
+// помещается, поэтому записи для вывода в столбцы таблицы не читаются
+// обратно в точности.
+char* FormatNumber(double value, char* first, std::size_t width);
+
+std::string FormatNumber(double value);
+
+// Возвращает число, если text в точности совпадает с его записью
+// FormatNumber, иначе nullopt. Такой текст восстанавливается по числу.
+std::optional<double> ParseCanonicalNumber(std::string_view text);
+
+// Выводит значение ячейки в поток, числа записываются функцией FormatNumber
+std::ostream& PrintValue(std::ostream& output, const CellInterface::Value& value);
@@ -0,0 +1,81 @@
+#include "numeric_columns.h"
+
+#include "stats.h"
+
+void NumericColumns::Set(Position pos, double value) {
+    if (pos.col >= static_cast<int>(columns_.size())) {
+        columns_.resize(pos.col + 1);
+    }
+    auto& column = columns_[pos.col];
+    const size_t block_index = pos.row / BLOCK_ROWS;
+    if (block_index >= column.size()) {
+        column.resize(block_index + 1);
+    }
+    if (!column[block_index]) {
+        column[block_index] = std::make_unique<Block>();
+    }
+    Block& block = *column[block_index];
+    const int row = pos.row % BLOCK_ROWS;
+    if (!block.IsValid(row)) {
+        block.valid[row / 64] |= std::uint64_t{1} << (row % 64);
+        ++block.count;
+        ++count_;
+    }
+    block.values[row] = value;
+}
+
+void NumericColumns::Reset(Position pos) {
+    if (pos.col >= static_cast<int>(columns_.size())) {
+        return;
+    }
+    auto& column = columns_[pos.col];
+    const size_t block_index = pos.row / BLOCK_ROWS;
+    if (block_index >= column.size() || !column[block_index]) {
+        return;
+    }
+    Block& block = *column[block_index];
+    const int row = pos.row % BLOCK_ROWS;
+    if (!block.IsValid(row)) {
+        return;
+    }
+    block.valid[row / 64] &= ~(std::uint64_t{1} << (row % 64));
+    --count_;
+    // Пустой блок освобождается, чтобы текстовые участки не занимали память
+    if (--block.count == 0) {
+        column[block_index].reset();
+    }
+}
+
+void NumericColumns::Clear() {
+    columns_.clear();
+    count_ = 0;
+}
+
+std::size_t NumericColumns::GetCount() const {
+    return count_;
+}
+
+const NumericColumns::Block* NumericColumns::GetBlock(int col, int block_index) const {
+    if (col >= static_cast<int>(columns_.size())
+        || block_index >= static_cast<int>(columns_[col].size())) {
+        return nullptr;
+    }
+    return columns_[col][block_index].get();
+}
+
+int NumericColumns::GetBlockCount(int col) const {
+    return col < static_cast<int>(columns_.size()) ? static_cast<int>(columns_[col].size()) : 0;
+}
+
+std::size_t NumericColumns::GetMemoryUsage() const {
+    std::size_t result = memory::VectorHeap(columns_);
+    for (const auto& column : columns_) {
+        result += memory::VectorHeap(column);
+        for (const auto& block : column) {
+            if (block) {
+                result += memory::HeapBlock(sizeof(Block));
+            }
+        }
+    }
+    return result;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Плотное хранилище числовых значений ячеек таблицы. Ячейки с числом
+// дублируются в столбцы из блоков double с битовой картой заполненности,
+// поэтому пакетное вычисление, сканирование и агрегаты читают числа из
+// непрерывной памяти, без обращения к хеш-таблице ячеек и без разбора
+// текста. Блоки выделяются только для участков столбцов, где есть числа.
+// Для текста, который совпадает с записью своего числа, столбцы -
+// единственное хранилище: объект Cell для него создается, только когда
+// нужна ячейка - на нее ссылается формула или ее запрашивает GetCell.
+// Такое число занимает около 8 байт вместо объекта Cell и узла
+// хеш-таблицы. Числа остальных ячеек копируются в столбцы.
+class NumericColumns {
+public:
+    static constexpr int BLOCK_ROWS = 1024;
+
+    // Блок из BLOCK_ROWS строк одного столбца
+    struct Block {
+        double values[BLOCK_ROWS] = {};
+        std::uint64_t valid[BLOCK_ROWS / 64] = {};
+        int count = 0;
+
+        bool IsValid(int row) const {
+            return (valid[row / 64] >> (row % 64)) & 1;
+        }
+    };
+
+    void Set(Position pos, double value);
+    void Reset(Position pos);
+    void Clear();
+
+    // Возвращает true и записывает число в value, если в ячейке pos число
+    bool Get(Position pos, double& value) const {
+        if (pos.col >= static_cast<int>(columns_.size())) {
+            return false;
+        }
+        const auto& column = columns_[pos.col];
+        const size_t block_index = pos.row / BLOCK_ROWS;
+        if (block_index >= column.size() || !column[block_index]) {
+            return false;
+        }
+        const Block& block = *column[block_index];
+        const int row = pos.row % BLOCK_ROWS;
+        if (!block.IsValid(row)) {
+            return false;
+        }
+        value = block.values[row];
+        return true;
+    }
+
+    // Вызывает action(pos, value) для каждого числа столбцов
+    template <typename Action>
+    void ForEach(Action action) const {
+        for (size_t col = 0; col < columns_.size(); ++col) {
+            for (size_t block_index = 0; block_index < columns_[col].size(); ++block_index) {
+                const Block* block = columns_[col][block_index].get();
+                if (block == nullptr) {
+                    continue;
+                }
+                const int first_row = static_cast<int>(block_index) * BLOCK_ROWS;
+                for (int row = 0; row < BLOCK_ROWS; ++row) {
+                    if (block->IsValid(row)) {
+                        action(Position{first_row + row, static_cast<int>(col)}, block->values[row]);
+                    }
+                }
+            }
+        }
+    }
+
+    // Число чисел во всех столбцах
+    std::size_t GetCount() const;
+
+    // Возвращает блок столбца col со строками с block_index * BLOCK_ROWS
+    // или nullptr, если в этих строках нет чисел
+    const Block* GetBlock(int col, int block_index) const;
+
+    // Число блоков столбца col, включая пустые
+    int GetBlockCount(int col) const;
+
+    std::size_t GetMemoryUsage() const;
+
+private:
+    using Column = std::vector<std::unique_ptr<Block>>;
+    std::vector<Column> columns_;
+    std::size_t count_ = 0;
+};
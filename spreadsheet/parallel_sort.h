@@ -0,0 +1,61 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+// Устойчиво сортирует [first, last) в threads потоках. Диапазон делится на
+// части, которые сортируются параллельно, затем соседние части попарно
+// сливаются, независимые пары - тоже параллельно. При threads <= 1
+// выполняется обычная std::stable_sort. Сравнение comp вызывается из разных
+// потоков одновременно и не должно бросать исключений.
+template <typename Iterator, typename Compare>
+void ParallelStableSort(Iterator first, Iterator last, Compare comp, std::size_t threads) {
+    const auto size = static_cast<std::size_t>(std::distance(first, last));
+    threads = std::min(threads, size);
+    if (threads <= 1) {
+        std::stable_sort(first, last, comp);
+        return;
+    }
+
+    // Часть i - это [bounds[i], bounds[i + 1])
+    std::vector<Iterator> bounds;
+    bounds.reserve(threads + 1);
+    for (std::size_t i = 0; i <= threads; ++i) {
+        bounds.push_back(first + size * i / threads);
+    }
+
+    // Выполняет task(0) ... task(count - 1), задача 0 - в текущем потоке
+    auto run = [](std::size_t count, const auto& task) {
+        std::vector<std::thread> workers;
+        workers.reserve(count - 1);
+        for (std::size_t i = 1; i < count; ++i) {
+            workers.emplace_back(task, i);
+        }
+        task(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    };
+
+    run(threads, [&](std::size_t i) {
+        std::stable_sort(bounds[i], bounds[i + 1], comp);
+    });
+    while (bounds.size() > 2) {
+        run((bounds.size() - 1) / 2, [&](std::size_t i) {
+            std::inplace_merge(bounds[2 * i], bounds[2 * i + 1], bounds[2 * i + 2], comp);
+        });
+        // границы слитых пар и, при нечетном числе частей, последней части
+        std::vector<Iterator> merged;
+        merged.reserve(bounds.size() / 2 + 1);
+        for (std::size_t i = 0; i < bounds.size(); i += 2) {
+            merged.push_back(bounds[i]);
+        }
+        if (bounds.size() % 2 == 0) {
+            merged.push_back(bounds.back());
+        }
+        bounds = std::move(merged);
+    }
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Двоичный протокол сервера таблицы. Сообщение - кадр из заголовка
+// (длина тела, 4 байта little-endian) и тела: байт кода и данные.
+// Клиент может отправлять запросы не дожидаясь ответов, сервер отвечает
+// на запросы одного подключения в порядке их получения.
+namespace protocol {
+
+enum class Opcode : std::uint8_t {
+    Set = 1,         // позиция, текст ячейки -> пустой ответ
+    Get = 2,         // позиция -> значение ячейки
+    Clear = 3,       // позиция -> пустой ответ
+    PrintRange = 4,  // левая верхняя и правая нижняя позиции -> значения,
+                     // разделенные табуляцией, строки - переводом строки
+};
+
+enum class Status : std::uint8_t {
+    Ok = 0,
+    Error = 1,  // данные ответа - текст ошибки
+};
+
+inline constexpr std::size_t HEADER_SIZE = 4;
+// Кадры большего размера считаются ошибкой протокола
+inline constexpr std::size_t MAX_FRAME_SIZE = 1 << 20;
+
+namespace detail {
+
+inline void AppendUint32(std::string& output, std::uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        output.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+inline std::uint32_t ReadUint32(const char* data) {
+    std::uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= static_cast<std::uint32_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+    }
+    return value;
+}
+
+// Позиция записывается как строка и столбец по 2 байта
+inline void AppendPosition(std::string& output, Position pos) {
+    output.push_back(static_cast<char>(pos.row & 0xFF));
+    output.push_back(static_cast<char>((pos.row >> 8) & 0xFF));
+    output.push_back(static_cast<char>(pos.col & 0xFF));
+    output.push_back(static_cast<char>((pos.col >> 8) & 0xFF));
+}
+
+inline void AppendFrame(std::string& output, std::uint8_t code, std::string_view head,
+    std::string_view data) {
+    AppendUint32(output, static_cast<std::uint32_t>(1 + head.size() + data.size()));
+    output.push_back(static_cast<char>(code));
+    output.append(head);
+    output.append(data);
+}
+
+}  // namespace detail
+
+inline constexpr std::size_t POSITION_SIZE = 4;
+
+inline Position ReadPosition(std::string_view data) {
+    auto byte = [&data](int i) {
+        return static_cast<int>(static_cast<unsigned char>(data[i]));
+    };
+    return { byte(0) | (byte(1) << 8), byte(2) | (byte(3) << 8) };
+}
+
+// Добавляет в output запрос с одной позицией и, для Set, текстом ячейки
+inline void AppendRequest(std::string& output, Opcode opcode, Position pos,
+    std::string_view text = {}) {
+    std::string head;
+    detail::AppendPosition(head, pos);
+    detail::AppendFrame(output, static_cast<std::uint8_t>(opcode), head, text);
+}
+
+// Добавляет в output запрос PrintRange
+inline void AppendPrintRange(std::string& output, Position first, Position last) {
+    std::string head;
+    detail::AppendPosition(head, first);
+    detail::AppendPosition(head, last);
+    detail::AppendFrame(output, static_cast<std::uint8_t>(Opcode::PrintRange), head, {});
+}
+
+inline void AppendResponse(std::string& output, Status status, std::string_view data = {}) {
+    detail::AppendFrame(output, static_cast<std::uint8_t>(status), {}, data);
+}
+
+enum class FrameResult {
+    Complete,    // кадр прочитан, offset указывает на следующий кадр
+    Incomplete,  // кадр получен не полностью
+    Invalid,     // пустой или слишком большой кадр
+};
+
+// Читает кадр, начинающийся в buffer с позиции offset
+inline FrameResult ReadFrame(std::string_view buffer, std::size_t& offset, std::uint8_t& code,
+    std::string_view& data) {
+    if (buffer.size() - offset < HEADER_SIZE) {
+        return FrameResult::Incomplete;
+    }
+    std::size_t size = detail::ReadUint32(buffer.data() + offset);
+    if (size == 0 || size > MAX_FRAME_SIZE) {
+        return FrameResult::Invalid;
+    }
+    if (buffer.size() - offset - HEADER_SIZE < size) {
+        return FrameResult::Incomplete;
+    }
+    code = static_cast<std::uint8_t>(buffer[offset + HEADER_SIZE]);
+    data = buffer.substr(offset + HEADER_SIZE + 1, size - 1);
+    offset += HEADER_SIZE + size;
+    return FrameResult::Complete;
+}
+
+}  // namespace protocol
@@ -0,0 +1,78 @@
+#include "range_dependencies.h"
+
+#include "stats.h"
+
+void RangeDependencies::Add(CellId id, const std::vector<Range>& ranges) {
+    auto& cell_ranges = ranges_[id];
+    for (auto range : ranges) {
+        if (dependents_[range].insert(id).second) {
+            cell_ranges.push_back(range);
+        }
+    }
+}
+
+bool RangeDependencies::Remove(CellId id) {
+    auto ptr = ranges_.find(id);
+    if (ptr == ranges_.end()) {
+        return false;
+    }
+    for (auto range : ptr->second) {
+        auto dependents = dependents_.find(range);
+        dependents->second.erase(id);
+        if (dependents->second.empty()) {
+            dependents_.erase(dependents);
+        }
+    }
+    ranges_.erase(ptr);
+    return true;
+}
+
+bool RangeDependencies::HasDependents(Position pos) const {
+    for (const auto& [range, cells] : dependents_) {
+        if (range.Contains(pos)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RangeDependencies::IsEmpty() const {
+    return ranges_.empty();
+}
+
+std::vector<CellId> RangeDependencies::GetCells() const {
+    std::vector<CellId> result;
+    result.reserve(ranges_.size());
+    for (const auto& [id, ranges] : ranges_) {
+        result.push_back(id);
+    }
+    return result;
+}
+
+void RangeDependencies::Remap(const std::vector<CellId>& new_ids) {
+    std::unordered_map<CellId, std::vector<Range>> ranges;
+    ranges.reserve(ranges_.size());
+    for (auto& [id, cell_ranges] : ranges_) {
+        ranges.emplace(new_ids[id], std::move(cell_ranges));
+    }
+    ranges_ = std::move(ranges);
+    for (auto& [range, cells] : dependents_) {
+        std::unordered_set<CellId> remapped;
+        remapped.reserve(cells.size());
+        for (auto id : cells) {
+            remapped.insert(new_ids[id]);
+        }
+        cells = std::move(remapped);
+    }
+}
+
+std::size_t RangeDependencies::GetMemoryUsage() const {
+    std::size_t result = memory::HashTableHeap(dependents_) + memory::HashTableHeap(ranges_);
+    for (const auto& [range, cells] : dependents_) {
+        result += memory::HashTableHeap(cells);
+    }
+    for (const auto& [id, cell_ranges] : ranges_) {
+        result += memory::VectorHeap(cell_ranges);
+    }
+    return result;
+}
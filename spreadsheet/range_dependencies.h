@@ -0,0 +1,52 @@
+#pragma once
+
+#include "cell_table.h"
+#include "common.h"
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Обратные связи ячеек листа с формулами, которые зависят от областей
+// листа целиком, как функции поиска. Такие связи не превращаются в связи
+// с каждой ячейкой области: область A1:A16384 потребовала бы создать
+// тысячи пустых ячеек. Одинаковые области хранятся один раз, поэтому
+// формулы, ищущие в общей таблице, занимают одну запись.
+class RangeDependencies {
+public:
+    // Запоминает, что формула ячейки id зависит от областей ranges
+    void Add(CellId id, const std::vector<Range>& ranges);
+
+    // Забывает области ячейки id, возвращает false, если их не было
+    bool Remove(CellId id);
+
+    // Вызывает visitor для каждой ячейки, формула которой зависит от
+    // области, содержащей позицию pos
+    template <typename Visitor>
+    void ForEachDependent(Position pos, Visitor visitor) const {
+        for (const auto& [range, cells] : dependents_) {
+            if (range.Contains(pos)) {
+                for (auto id : cells) {
+                    visitor(id);
+                }
+            }
+        }
+    }
+
+    // Проверяет, что от позиции pos зависит хотя бы одна формула
+    bool HasDependents(Position pos) const;
+
+    bool IsEmpty() const;
+
+    // Возвращает все ячейки, формулы которых зависят от областей
+    std::vector<CellId> GetCells() const;
+
+    // Переписывает идентификаторы ячеек после перенумерации
+    void Remap(const std::vector<CellId>& new_ids);
+
+    std::size_t GetMemoryUsage() const;
+
+private:
+    std::unordered_map<Range, std::unordered_set<CellId>, RangeHash> dependents_;
+    std::unordered_map<CellId, std::vector<Range>> ranges_;
+};
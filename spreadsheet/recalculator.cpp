@@ -0,0 +1,112 @@
+#include "recalculator.h"
+
+#include "cell.h"
+
+#include <algorithm>
+
+BackgroundRecalculator::BackgroundRecalculator(CellTable& cells)
+    : cells_(cells)
+    , worker_([this] {
+        Run();
+    }) {
+}
+
+BackgroundRecalculator::~BackgroundRecalculator() {
+    {
+        std::lock_guard lock(queue_mutex_);
+        stop_ = true;
+    }
+    queue_changed_.notify_one();
+    worker_.join();
+}
+
+void BackgroundRecalculator::Schedule(CellId id, std::optional<CellInterface::Value> old_value) {
+    scheduled_.push_back(id);
+    if (!old_value.has_value()) {
+        return;
+    }
+    if (id >= stale_values_.size()) {
+        stale_values_.resize(std::max<size_t>(id + 1, cells_.GetCapacity()));
+    }
+    // Если ячейка сброшена повторно до пересчета, сохраняется первое значение
+    if (!stale_values_[id].has_value()) {
+        stale_values_[id] = std::move(old_value);
+    }
+}
+
+void BackgroundRecalculator::Flush() {
+    if (scheduled_.empty()) {
+        return;
+    }
+    {
+        std::lock_guard lock(queue_mutex_);
+        queue_.insert(queue_.end(), scheduled_.begin(), scheduled_.end());
+    }
+    scheduled_.clear();
+    queue_changed_.notify_one();
+}
+
+void BackgroundRecalculator::Forget(CellId id) {
+    if (id < stale_values_.size()) {
+        stale_values_[id].reset();
+    }
+}
+
+const CellInterface::Value* BackgroundRecalculator::FindStaleValue(CellId id) const {
+    if (id < stale_values_.size() && stale_values_[id].has_value()) {
+        return &*stale_values_[id];
+    }
+    return nullptr;
+}
+
+void BackgroundRecalculator::Wait() {
+    std::unique_lock lock(queue_mutex_);
+    queue_done_.wait(lock, [this] {
+        return queue_.empty() && !busy_;
+    });
+}
+
+void BackgroundRecalculator::Run() {
+    while (true) {
+        CellId id;
+        {
+            std::unique_lock lock(queue_mutex_);
+            busy_ = false;
+            if (queue_.empty()) {
+                queue_done_.notify_all();
+            }
+            queue_changed_.wait(lock, [this] {
+                return stop_ || !queue_.empty();
+            });
+            if (stop_) {
+                return;
+            }
+            id = queue_.front();
+            queue_.pop_front();
+            busy_ = true;
+        }
+        // Мьютекс очереди не удерживается вместе с мьютексом таблицы,
+        // поэтому Flush под мьютексом таблицы не приводит к взаимоблокировке.
+        // Мьютекс таблицы захватывается на один шаг вычисления, то есть не
+        // больше чем на одну формулу: невычисленные формулы, которые читает
+        // ячейка, кладутся в стек и вычисляются раньше нее.
+        std::vector<std::pair<CellId, size_t>> stack{{id, 0}};
+        while (!stack.empty()) {
+            std::lock_guard lock(cells_.GetMutex());
+            auto& [cell_id, index] = stack.back();
+            // Ячейка могла быть удалена или перенумерована, пока мьютекс
+            // был свободен, тогда шаг вычисляет другую ячейку, что безопасно
+            const Cell* cell = cell_id < cells_.GetCapacity() ? cells_.Get(cell_id) : nullptr;
+            const Cell* next = cell != nullptr ? cell->EvaluateStep(index) : nullptr;
+            if (next != nullptr) {
+                stack.push_back({next->GetId(), 0});
+            }
+            else {
+                stack.pop_back();
+            }
+            if (stack.empty()) {
+                Forget(id);
+            }
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "cell_table.h"
+#include "common.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Фоновый пересчет формул листа в режиме Async. Изменение таблицы только
+// ставит сброшенные ячейки в очередь, поток пересчета берет их по одной и
+// вычисляет под мьютексом таблицы ячеек, поэтому изменение ждет не дольше
+// вычисления одной ячейки. Пока ячейка не пересчитана, хранится ее прежнее
+// значение, которое можно прочитать без ожидания.
+class BackgroundRecalculator {
+public:
+    explicit BackgroundRecalculator(CellTable& cells);
+
+    // Останавливает поток, ячейки из очереди остаются невычисленными и
+    // вычисляются при чтении
+    ~BackgroundRecalculator();
+
+    BackgroundRecalculator(const BackgroundRecalculator&) = delete;
+    BackgroundRecalculator& operator=(const BackgroundRecalculator&) = delete;
+
+    // Запоминает ячейку для пересчета и ее прежнее значение, если оно было.
+    // Вызывается под мьютексом таблицы ячеек, в очередь ячейки попадают при
+    // вызове Flush.
+    void Schedule(CellId id, std::optional<CellInterface::Value> old_value);
+
+    // Передает запомненные ячейки потоку пересчета
+    void Flush();
+
+    // Забывает прежнее значение удаляемой ячейки, чтобы его не получила
+    // ячейка, которой достанется тот же идентификатор. Вызывается под
+    // мьютексом таблицы ячеек.
+    void Forget(CellId id);
+
+    // Возвращает прежнее значение еще не пересчитанной ячейки или nullptr.
+    // Вызывается под мьютексом таблицы ячеек.
+    const CellInterface::Value* FindStaleValue(CellId id) const;
+
+    // Ждет, пока поток пересчета обработает все ячейки очереди.
+    // Не должен вызываться под мьютексом таблицы ячеек.
+    void Wait();
+
+private:
+    CellTable& cells_;
+
+    // Защищены мьютексом таблицы ячеек. Прежние значения хранятся по
+    // идентификаторам ячеек, чтобы сброс большого числа формул не строил
+    // хеш-таблицу.
+    std::vector<CellId> scheduled_;
+    std::vector<std::optional<CellInterface::Value>> stale_values_;
+
+    // Защищены queue_mutex_
+    std::mutex queue_mutex_;
+    std::condition_variable queue_changed_;
+    std::condition_variable queue_done_;
+    std::deque<CellId> queue_;
+    bool busy_ = false;
+    bool stop_ = false;
+
+    // Объявлен последним, чтобы запускаться после инициализации остальных полей
+    std::thread worker_;
+
+    void Run();
+};
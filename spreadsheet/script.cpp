@@ -0,0 +1,228 @@
+#include "script.h"
+
+#include "number_format.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+using namespace std::literals;
+
+namespace {
+
+// Размер блока, которым читается сценарий
+const size_t CHUNK_SIZE = 1 << 20;
+
+bool IsSpace(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+// Отделяет от line первое слово, пробелы перед ним пропускаются
+std::string_view NextToken(std::string_view& line) {
+    size_t begin = 0;
+    while (begin < line.size() && IsSpace(line[begin])) {
+        ++begin;
+    }
+    size_t end = begin;
+    while (end < line.size() && !IsSpace(line[end])) {
+        ++end;
+    }
+    auto token = line.substr(begin, end - begin);
+    line.remove_prefix(end);
+    return token;
+}
+
+// Отделяет от line текст в кавычках
+std::string_view NextQuotedText(std::string_view& line) {
+    size_t begin = 0;
+    while (begin < line.size() && IsSpace(line[begin])) {
+        ++begin;
+    }
+    if (begin == line.size() || line[begin] != '"') {
+        throw std::invalid_argument("missing quote");
+    }
+    size_t end = line.find('"', begin + 1);
+    if (end == line.npos) {
+        throw std::invalid_argument("missing quote");
+    }
+    auto text = line.substr(begin + 1, end - begin - 1);
+    line.remove_prefix(end + 1);
+    return text;
+}
+
+// Число строк блока, начинающихся с команды set
+size_t CountSetCommands(std::string_view data) {
+    size_t count = 0;
+    for (size_t line_start = 0; line_start < data.size();) {
+        size_t line_end = data.find('\n', line_start);
+        if (line_end == data.npos) {
+            line_end = data.size();
+        }
+        auto line = data.substr(line_start, line_end - line_start);
+        if (NextToken(line) == "set"sv) {
+            ++count;
+        }
+        line_start = line_end + 1;
+    }
+    return count;
+}
+
+Position ParsePosition(std::string_view& line) {
+    auto pos = Position::FromString(NextToken(line));
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("invalid position");
+    }
+    return pos;
+}
+
+}  // namespace
+
+std::ostream& operator<<(std::ostream& output, const ScriptStats& stats) {
+    using namespace std::chrono;
+    double seconds = duration<double>(stats.duration).count();
+    output << "commands:     "s << stats.commands << '\n'
+        << "errors:       "s << stats.errors << '\n'
+        << "time:         "s << duration_cast<milliseconds>(stats.duration).count() << " ms\n"s;
+    if (seconds > 0) {
+        output << "commands/sec: "s << static_cast<std::uint64_t>(stats.commands / seconds) << '\n'
+            << "MB/sec:       "s << stats.bytes / seconds / (1 << 20) << '\n';
+    }
+    return output;
+}
+
+ScriptRunner::ScriptRunner(WorkbookInterface& workbook, SheetInterface* sheet, std::ostream& output,
+    std::ostream& errors)
+    : workbook_(workbook)
+    , sheet_(sheet)
+    , output_(output)
+    , errors_(errors) {
+}
+
+void ScriptRunner::Run(std::istream& input, size_t size_hint) {
+    auto start = std::chrono::steady_clock::now();
+    std::string buffer;
+    size_t kept = 0;
+    while (true) {
+        buffer.resize(kept + CHUNK_SIZE);
+        input.read(buffer.data() + kept, CHUNK_SIZE);
+        size_t size = kept + input.gcount();
+        stats_.bytes += input.gcount();
+        if (size == kept) {
+            // Последняя строка сценария может не заканчиваться переводом строки
+            if (kept > 0) {
+                ExecuteLine(std::string_view(buffer.data(), kept));
+            }
+            break;
+        }
+        std::string_view data(buffer.data(), size);
+        if (stats_.bytes == size && size_hint > size) {
+            sheet_->ReserveCells(CountSetCommands(data) * (size_hint / size));
+        }
+        size_t line_start = 0;
+        for (size_t line_end; (line_end = data.find('\n', line_start)) != data.npos;
+            line_start = line_end + 1) {
+            ExecuteLine(data.substr(line_start, line_end - line_start));
+        }
+        // Незаконченная строка переносится в начало буфера
+        kept = size - line_start;
+        buffer.erase(0, line_start);
+    }
+    output_.flush();
+    stats_.duration += std::chrono::steady_clock::now() - start;
+}
+
+void ScriptRunner::ExecuteLine(std::string_view line) {
+    ++line_number_;
+    auto rest = line;
+    auto command = NextToken(rest);
+    if (command.empty() || command[0] == '#') {
+        return;
+    }
+    ++stats_.commands;
+    try {
+        Execute(command, rest);
+        return;
+    }
+    catch (const std::invalid_argument& exc) {
+        errors_ << "line "s << line_number_ << ": error, "s << exc.what() << '\n';
+    }
+    catch (const InvalidPositionException&) {
+        errors_ << "line "s << line_number_ << ": error: invalid position\n"s;
+    }
+    catch (const FormulaException&) {
+        errors_ << "line "s << line_number_ << ": error: invalid formula\n"s;
+    }
+    catch (const CircularDependencyException&) {
+        errors_ << "line "s << line_number_ << ": error: circular dependency\n"s;
+    }
+    catch (const InvalidSheetNameException&) {
+        errors_ << "line "s << line_number_ << ": error: invalid sheet name\n"s;
+    }
+    ++stats_.errors;
+}
+
+void ScriptRunner::Execute(std::string_view command, std::string_view line) {
+    if (command == "set"sv) {
+        auto pos = ParsePosition(line);
+        sheet_->SetCell(pos, std::string(NextQuotedText(line)));
+    }
+    else if (command == "clear"sv) {
+        sheet_->ClearCell(ParsePosition(line));
+    }
+    else if (command == "print"sv) {
+        auto argument = NextToken(line);
+        if (argument == "-v"sv) {
+            sheet_->PrintValues(output_);
+        }
+        else if (argument == "-t"sv) {
+            sheet_->PrintTexts(output_);
+        }
+        else {
+            auto pos = Position::FromString(argument);
+            if (!pos.IsValid()) {
+                throw InvalidPositionException("invalid position");
+            }
+            auto cell = sheet_->GetCell(pos);
+            if (cell == nullptr) {
+                output_ << "empty cell\n"s;
+            }
+            else {
+                output_ << "value: "s;
+                PrintValue(output_, cell->GetValue());
+                output_ << "; text: "s << cell->GetText() << '\n';
+            }
+        }
+    }
+    else if (command == "sheet"sv) {
+        auto name = NextToken(line);
+        auto sheet = workbook_.GetSheet(name);
+        sheet_ = sheet != nullptr ? sheet : workbook_.CreateSheet(std::string(name));
+    }
+    else if (command == "recalc"sv) {
+        auto mode = NextToken(line);
+        if (mode == "lazy"sv) {
+            sheet_->SetRecalculationMode(RecalculationMode::Lazy);
+        }
+        else if (mode == "eager"sv) {
+            sheet_->SetRecalculationMode(RecalculationMode::Eager);
+        }
+        else if (mode == "async"sv) {
+            sheet_->SetRecalculationMode(RecalculationMode::Async);
+        }
+        else {
+            throw std::invalid_argument("unknown recalculation mode '"s + std::string(mode) + "'"s);
+        }
+    }
+    else if (command == "stats"sv) {
+        output_ << sheet_->GetStats();
+    }
+    else if (command == "memory"sv) {
+        output_ << sheet_->GetMemoryUsage();
+    }
+    else {
+        throw std::invalid_argument("'"s + std::string(command) + "' is not a spreadsheet command"s);
+    }
+    if (!NextToken(line).empty()) {
+        throw std::invalid_argument("unexpected text after command");
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string_view>
+
+// Счетчики выполнения сценария
+struct ScriptStats {
+    std::uint64_t commands = 0;  // выполненные команды, включая ошибочные
+    std::uint64_t errors = 0;    // команды, завершившиеся ошибкой
+    std::uint64_t bytes = 0;     // прочитанные байты сценария
+    std::chrono::steady_clock::duration duration{};
+};
+
+std::ostream& operator<<(std::ostream& output, const ScriptStats& stats);
+
+// Пакетное выполнение команд консоли (set, clear, print, sheet, recalc,
+// stats, memory) без интерактивного ввода. Каждая команда занимает одну
+// строку, пустые строки и строки, начинающиеся с "#", пропускаются.
+// Сценарий читается большими блоками, команды разбираются без копирования
+// строк. Ошибочная команда выводит сообщение с номером строки в errors и
+// не прерывает выполнение.
+class ScriptRunner {
+public:
+    ScriptRunner(WorkbookInterface& workbook, SheetInterface* sheet, std::ostream& output,
+        std::ostream& errors);
+
+    // Выполняет все команды из input. Если известен размер сценария в байтах,
+    // по первому блоку оценивается число команд set и место под ячейки
+    // резервируется заранее.
+    void Run(std::istream& input, std::size_t size_hint = 0);
+
+    // Выполняет одну команду, line не содержит перевода строки
+    void ExecuteLine(std::string_view line);
+
+    const ScriptStats& GetStats() const {
+        return stats_;
+    }
+
+private:
+    WorkbookInterface& workbook_;
+    SheetInterface* sheet_;
+    std::ostream& output_;
+    std::ostream& errors_;
+    ScriptStats stats_;
+    std::uint64_t line_number_ = 0;
+
+    void Execute(std::string_view command, std::string_view line);
+};
@@ -0,0 +1,314 @@
+#include "server.h"
+
+#include "number_format.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+
+void AppendValue(std::ostringstream& output, const CellInterface* cell) {
+    if (cell == nullptr) {
+        return;
+    }
+    PrintValue(output, cell->GetValue());
+}
+
+}  // namespace
+
+void Server::HandleRequest(std::uint8_t opcode, std::string_view data, std::string& output) {
+    using protocol::Opcode;
+    using protocol::Status;
+    const size_t position_size = protocol::POSITION_SIZE;
+
+    try {
+        switch (static_cast<Opcode>(opcode)) {
+        case Opcode::Set:
+            if (data.size() < position_size) {
+                break;
+            }
+            sheet_.SetCell(protocol::ReadPosition(data), std::string(data.substr(position_size)));
+            protocol::AppendResponse(output, Status::Ok);
+            return;
+        case Opcode::Get:
+        {
+            if (data.size() != position_size) {
+                break;
+            }
+            std::ostringstream value;
+            AppendValue(value, sheet_.GetCell(protocol::ReadPosition(data)));
+            protocol::AppendResponse(output, Status::Ok, value.str());
+            return;
+        }
+        case Opcode::Clear:
+            if (data.size() != position_size) {
+                break;
+            }
+            sheet_.ClearCell(protocol::ReadPosition(data));
+            protocol::AppendResponse(output, Status::Ok);
+            return;
+        case Opcode::PrintRange:
+        {
+            if (data.size() != 2 * position_size) {
+                break;
+            }
+            Position first = protocol::ReadPosition(data);
+            Position last = protocol::ReadPosition(data.substr(position_size));
+            if (!Range{ first, last }.IsValid()) {
+                protocol::AppendResponse(output, Status::Error, "invalid range"sv);
+                return;
+            }
+            std::ostringstream values;
+            for (int row = first.row; row <= last.row; ++row) {
+                for (int col = first.col; col <= last.col; ++col) {
+                    if (col != first.col) {
+                        values << '\t';
+                    }
+                    AppendValue(values, sheet_.GetCell({ row, col }));
+                }
+                values << '\n';
+                if (static_cast<size_t>(values.tellp()) >= protocol::MAX_FRAME_SIZE) {
+                    protocol::AppendResponse(output, Status::Error, "range is too large"sv);
+                    return;
+                }
+            }
+            protocol::AppendResponse(output, Status::Ok, values.str());
+            return;
+        }
+        default:
+            protocol::AppendResponse(output, Status::Error, "unknown opcode"sv);
+            return;
+        }
+        protocol::AppendResponse(output, Status::Error, "malformed request"sv);
+    }
+    catch (const std::exception& exc) {
+        protocol::AppendResponse(output, Status::Error, exc.what());
+    }
+}
+
+#ifdef _WIN32
+
+Server::Server(SheetInterface& sheet, std::string socket_path)
+    : sheet_(sheet)
+    , socket_path_(std::move(socket_path)) {
+}
+
+Server::~Server() = default;
+
+void Server::Run() {
+    throw std::runtime_error("server mode is not supported on this platform");
+}
+
+void Server::Stop() {
+}
+
+#else
+
+namespace {
+
+// Пока ответы подключения не отправлены и занимают больше этого размера,
+// новые запросы подключения не читаются
+const size_t MAX_PENDING_OUTPUT = 4 << 20;
+const size_t READ_CHUNK_SIZE = 64 << 10;
+
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;
+#endif
+
+[[noreturn]] void ThrowSystemError(const char* what) {
+    throw std::runtime_error(what + ": "s + std::strerror(errno));
+}
+
+void SetNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ThrowSystemError("fcntl");
+    }
+}
+
+struct Connection {
+    int fd = -1;
+    std::string input;
+    std::string output;
+    size_t output_offset = 0;
+    bool is_closed = false;
+};
+
+// Отправляет накопленные ответы, пока сокет принимает данные
+void Flush(Connection& connection) {
+    while (connection.output_offset < connection.output.size()) {
+        ssize_t sent = send(connection.fd, connection.output.data() + connection.output_offset,
+            connection.output.size() - connection.output_offset, SEND_FLAGS);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                connection.is_closed = true;
+            }
+            return;
+        }
+        connection.output_offset += sent;
+    }
+    connection.output.clear();
+    connection.output_offset = 0;
+}
+
+}  // namespace
+
+Server::Server(SheetInterface& sheet, std::string socket_path)
+    : sheet_(sheet)
+    , socket_path_(std::move(socket_path)) {
+    if (pipe(stop_pipe_) < 0) {
+        ThrowSystemError("pipe");
+    }
+    SetNonBlocking(stop_pipe_[0]);
+    SetNonBlocking(stop_pipe_[1]);
+}
+
+Server::~Server() {
+    close(stop_pipe_[0]);
+    close(stop_pipe_[1]);
+}
+
+void Server::Stop() {
+    char byte = 0;
+    [[maybe_unused]] auto result = write(stop_pipe_[1], &byte, 1);
+}
+
+void Server::Run() {
+    sockaddr_un address{};
+    if (socket_path_.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("socket path is too long: "s + socket_path_);
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, socket_path_.c_str(), socket_path_.size() + 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        ThrowSystemError("socket");
+    }
+    unlink(socket_path_.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+        || listen(listener, SOMAXCONN) < 0) {
+        int error = errno;
+        close(listener);
+        errno = error;
+        ThrowSystemError("bind");
+    }
+    SetNonBlocking(listener);
+
+    std::vector<Connection> connections;
+    std::vector<pollfd> fds;
+    bool is_running = true;
+    while (is_running) {
+        fds.clear();
+        fds.push_back({ stop_pipe_[0], POLLIN, 0 });
+        fds.push_back({ listener, POLLIN, 0 });
+        for (const auto& connection : connections) {
+            short events = connection.output.size() < MAX_PENDING_OUTPUT ? POLLIN : 0;
+            if (!connection.output.empty()) {
+                events |= POLLOUT;
+            }
+            fds.push_back({ connection.fd, events, 0 });
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ThrowSystemError("poll");
+        }
+        if (fds[0].revents != 0) {
+            char byte;
+            while (read(stop_pipe_[0], &byte, 1) > 0) {
+            }
+            is_running = false;
+        }
+
+        for (size_t i = 0; i < connections.size(); ++i) {
+            auto& connection = connections[i];
+            short revents = fds[i + 2].revents;
+            if (revents & (POLLERR | POLLNVAL)) {
+                connection.is_closed = true;
+                continue;
+            }
+            if (revents & (POLLIN | POLLHUP)) {
+                size_t consumed = 0;
+                char buffer[READ_CHUNK_SIZE];
+                ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+                if (received <= 0) {
+                    if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                        connection.is_closed = true;
+                    }
+                }
+                else {
+                    connection.input.append(buffer, received);
+                }
+                // Ответы на все полностью полученные запросы копятся в output
+                // и отправляются вместе
+                std::uint8_t opcode;
+                std::string_view data;
+                protocol::FrameResult result;
+                while ((result = protocol::ReadFrame(connection.input, consumed, opcode, data))
+                    == protocol::FrameResult::Complete) {
+                    HandleRequest(opcode, data, connection.output);
+                }
+                if (result == protocol::FrameResult::Invalid) {
+                    connection.is_closed = true;
+                }
+                connection.input.erase(0, consumed);
+            }
+            if (!connection.output.empty()) {
+                Flush(connection);
+            }
+        }
+
+        auto closed = std::remove_if(connections.begin(), connections.end(),
+            [](const Connection& connection) {
+                if (connection.is_closed) {
+                    close(connection.fd);
+                }
+                return connection.is_closed;
+            });
+        connections.erase(closed, connections.end());
+
+        if (fds[1].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listener, nullptr, nullptr)) >= 0) {
+                SetNonBlocking(fd);
+#ifdef SO_NOSIGPIPE
+                int on = 1;
+                setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+                Connection connection;
+                connection.fd = fd;
+                connections.push_back(std::move(connection));
+            }
+        }
+    }
+
+    for (const auto& connection : connections) {
+        close(connection.fd);
+    }
+    close(listener);
+    unlink(socket_path_.c_str());
+}
+
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Сервер таблицы на локальном (Unix domain) сокете. Протокол описан в
+// protocol.h. Все подключения обслуживает один поток с poll(), поэтому
+// таблица не требует блокировок, а запросы, отправленные клиентом без
+// ожидания ответов, обрабатываются пачкой и их ответы отправляются одной
+// записью в сокет. Не поддерживается в Windows.
+class Server {
+public:
+    Server(SheetInterface& sheet, std::string socket_path);
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    ~Server();
+
+    // Создает сокет и обслуживает подключения до вызова Stop. При ошибке
+    // создания сокета бросает std::runtime_error.
+    void Run();
+
+    // Завершает Run. Может вызываться из другого потока.
+    void Stop();
+
+    // Обрабатывает один запрос и добавляет ответ в output
+    void HandleRequest(std::uint8_t opcode, std::string_view data, std::string& output);
+
+private:
+    SheetInterface& sheet_;
+    std::string socket_path_;
+
+    // Канал, запись в который будит poll() в Run при вызове Stop
+    int stop_pipe_[2] = {-1, -1};
+};
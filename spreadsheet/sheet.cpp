@@ -1,13 +1,27 @@
 #include "sheet.h"
 
 #include "cell.h"
+#include "column_kernel.h"
 #include "common.h"
+#include "number_format.h"
+#include "parallel_sort.h"
+#include "trace.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <mutex>
+#include <numeric>
 #include <optional>
+#include <thread>
+#include <tuple>
 #include <iomanip>
+#include <unordered_set>
+#include <vector>
 
 using namespace std::literals;
 
@@ -27,49 +41,66 @@ void Sheet::MaybeFitSizeToClearPosition(Position pos) {
             row_size = std::max(pos.row + 1, row_size);
             col_size = std::max(pos.row + 1, col_size);
         }
+        numbers_.ForEach([&](Position pos, double) {
+            row_size = std::max(pos.row + 1, row_size);
+            col_size = std::max(pos.col + 1, col_size);
+        });
         size_.rows = row_size;
         size_.cols = col_size;
     }
 }
 
 void Sheet::SetCell(Position pos, std::string text) {
+    trace::Span span("Sheet::SetCell", pos);
+    auto lock = LockIfAsync(*cells_);
     Size old_size = size_;
     bool is_new_cell = false;
     if (!pos.IsValid()) {
         throw InvalidPositionException("out of range"s);
     }
     auto cell = GetConcreteCell(pos);
+    if (cell == nullptr && SetColumnNumber(pos, text)) {
+        return;
+    }
     if (cell == nullptr) {
         is_new_cell = true;
         cell = NewCell(pos);
     }
     else {
         //      ,    
-        if (cell->GetText() == text) {
+        if (cell->HasText(text)) {
             return;
         }
     }
     //  ,      
-    std::unique_ptr<Cell> temp_cell (new Cell(*this));
+    Cell temp_cell(*this, pos);
     try {
-        temp_cell->Set(text);
+        temp_cell.Set(std::move(text));
     }
-    catch (InvalidPositionException &exc) {
+    catch (...) {
         if (is_new_cell) {
             data_.erase(pos);
             size_ = old_size;
         }
-        throw exc;
+        throw;
     }
     //     
-    if (temp_cell->FindCircularDependency(cell)) {
+    bool is_circular = false;
+    {
+        trace::Span check_span("FindCircularDependency", pos);
+        is_circular = temp_cell.FindCircularDependency(cell);
+    }
+    if (is_circular) {
         if (is_new_cell) {
             data_.erase(pos);
             size_ = old_size;
         }
         throw CircularDependencyException("circular dependency"s);
     }
-    cell->ResetContent(temp_cell.get());
+    cell->ResetContent(&temp_cell, &invalidated_);
+    UpdateNumber(pos, *cell);
+    UpdateLookupIndex(pos, cell);
+    RecalculateInvalidated();
 }
 
 const Cell* Sheet::GetConcreteCell(Position pos) const {
@@ -77,7 +108,7 @@ const Cell* Sheet::GetConcreteCell(Position pos) const {
         throw InvalidPositionException("out of range"s);
     }
     const auto ptr = data_.find(pos);
-    return (ptr != data_.end()) ? data_.at(pos).get() : nullptr;
+    return (ptr != data_.end()) ? ptr->second.get() : nullptr;
 }
 
 Cell* Sheet::GetConcreteCell(Position pos) {
@@ -85,38 +116,1224 @@ Cell* Sheet::GetConcreteCell(Position pos) {
         throw InvalidPositionException("out of range"s);
     }
     const auto ptr = data_.find(pos);
-    return (ptr != data_.end()) ? data_.at(pos).get() : nullptr;
+    return (ptr != data_.end()) ? ptr->second.get() : nullptr;
+}
+
+Cell* Sheet::MaterializeCell(Position pos) const {
+    auto lock = LockIfAsync(*cells_);
+    if (auto ptr = data_.find(pos); ptr != data_.end()) {
+        return ptr->second.get();
+    }
+    double number = 0;
+    if (!pos.IsValid() || !numbers_.Get(pos, number)) {
+        return nullptr;
+    }
+    //      ,      
+    Cell* cell = const_cast<Sheet*>(this)->NewCell(pos);
+    cell->Set(FormatNumber(number));
+    return cell;
+}
+
+Sheet::Sheet()
+    :own_formulas_(std::make_unique<FormulaCache>())
+    ,formulas_(own_formulas_.get())
+    ,own_cells_(std::make_unique<CellTable>())
+    ,cells_(own_cells_.get())
+{
+}
+
+Sheet::Sheet(Workbook& workbook, std::string name)
+    :formulas_(&workbook.GetFormulaCache())
+    ,cells_(&workbook.GetCellTable())
+    ,workbook_(&workbook)
+    ,name_(std::move(name))
+{
+}
+
+std::vector<SheetPosition> Sheet::GetDependents(Position pos, bool transitive) const {
+    return CollectRelatedCells(pos, transitive, true);
+}
+
+std::vector<SheetPosition> Sheet::GetPrecedents(Position pos, bool transitive) const {
+    return CollectRelatedCells(pos, transitive, false);
+}
+
+std::vector<SheetPosition> Sheet::CollectRelatedCells(Position pos, bool transitive,
+    bool dependents) const {
+    std::vector<SheetPosition> result;
+    const Cell* start = GetConcreteCell(pos);
+    //        ,    
+    //    
+    if (start == nullptr && dependents && range_dependencies_.HasDependents(pos)) {
+        start = MaterializeCell(pos);
+    }
+    if (start == nullptr) {
+        return result;
+    }
+    std::vector<std::uint64_t> visited((cells_->GetCapacity() + 63) / 64);
+    auto visit = [&visited](CellId id) {
+        //        
+        if (id / 64 >= visited.size()) {
+            visited.resize(id / 64 + 1);
+        }
+        auto& word = visited[id / 64];
+        const std::uint64_t bit = std::uint64_t{1} << (id % 64);
+        if (word & bit) {
+            return false;
+        }
+        word |= bit;
+        return true;
+    };
+    visit(start->GetId());
+    std::vector<CellId> stack;
+    auto push_related = [&](const Cell* cell) {
+        auto push = [&](CellId id) {
+            if (visit(id)) {
+                stack.push_back(id);
+            }
+        };
+        auto& sheet = cell->GetSheet();
+        if (dependents) {
+            for (auto id : cell->GetParents()) {
+                push(id);
+            }
+            sheet.range_dependencies_.ForEachDependent(cell->GetPosition(), push);
+        }
+        else {
+            for (auto id : cell->GetChildrens()) {
+                push(id);
+            }
+            //     ,   
+            for (auto range : cell->GetRanges()) {
+                const int last_row = std::min(range.last.row, sheet.size_.rows - 1);
+                const int last_col = std::min(range.last.col, sheet.size_.cols - 1);
+                for (int row = range.first.row; row <= last_row; ++row) {
+                    for (int col = range.first.col; col <= last_col; ++col) {
+                        if (auto other = sheet.MaterializeCell({row, col})) {
+                            push(other->GetId());
+                        }
+                    }
+                }
+            }
+        }
+    };
+    push_related(start);
+    while (!stack.empty()) {
+        const Cell* cell = cells_->Get(stack.back());
+        stack.pop_back();
+        result.push_back({cell->GetSheet().GetName(), cell->GetPosition()});
+        if (transitive) {
+            push_related(cell);
+        }
+    }
+    return result;
+}
+
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return (workbook_ != nullptr) ? workbook_->GetConcreteSheet(name) : nullptr;
+}
+
+Sheet* Sheet::FindConcreteSheet(std::string_view name) {
+    return (workbook_ != nullptr) ? workbook_->GetConcreteSheet(name) : nullptr;
+}
+
+const std::string& Sheet::GetName() const {
+    return name_;
+}
+
+SheetStats Sheet::GetStats() const {
+    return stats_.GetSnapshot();
+}
+
+namespace {
+//        
+const size_t MIN_KERNEL_RUN = 8;
+}
+
+void Sheet::RecalculateAll() const {
+    if (size_ == Size{ 0, 0 }) {
+        return;
+    }
+    RecalculateRange({ { 0, 0 }, { size_.rows - 1, size_.cols - 1 } });
+}
+
+void Sheet::RecalculateRange(Range range) const {
+    auto lock = LockIfAsync(*cells_);
+    std::vector<std::pair<Position, Cell*>> formulas;
+    auto is_dirty = [](Cell* cell) {
+        return !cell->HasCachedValue() && cell->GetFormula() != nullptr;
+    };
+    //      ,    
+    const Size size = range.GetSize();
+    if (static_cast<size_t>(size.rows) * size.cols < dirty_formulas_.size()) {
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            for (int col = range.first.col; col <= range.last.col; ++col) {
+                if (auto it = data_.find({ row, col }); it != data_.end() && is_dirty(it->second.get())) {
+                    formulas.push_back({it->first, it->second.get()});
+                    dirty_formulas_.erase(it->second.get());
+                }
+            }
+        }
+    }
+    else {
+        for (auto it = dirty_formulas_.begin(); it != dirty_formulas_.end();) {
+            Cell* cell = *it;
+            const bool dirty = is_dirty(cell);
+            if (dirty && !range.Contains(cell->GetPosition())) {
+                ++it;
+                continue;
+            }
+            if (dirty) {
+                formulas.push_back({cell->GetPosition(), cell});
+            }
+            it = dirty_formulas_.erase(it);
+        }
+    }
+    //       
+    std::sort(formulas.begin(), formulas.end(), [](const auto& lhs, const auto& rhs) {
+        return std::tie(lhs.first.col, lhs.first.row) < std::tie(rhs.first.col, rhs.first.row);
+    });
+    std::vector<Cell*> run;
+    for (size_t i = 0; i < formulas.size();) {
+        auto [origin, cell] = formulas[i];
+        auto program = cell->GetFormula()->GetProgram();
+        //          
+        if (program == nullptr || cell->HasCachedValue()) {
+            cell->GetValue();
+            ++i;
+            continue;
+        }
+        ColumnKernel kernel(*program, origin);
+        run.assign(1, cell);
+        size_t next = i + 1;
+        for (; next < formulas.size(); ++next) {
+            auto [pos, next_cell] = formulas[next];
+            if (pos.col != origin.col || pos.row != origin.row + static_cast<int>(run.size())
+                || next_cell->HasCachedValue()) {
+                break;
+            }
+            auto next_program = next_cell->GetFormula()->GetProgram();
+            if (next_program == nullptr || !kernel.IsSameShape(*next_program, pos)) {
+                break;
+            }
+            run.push_back(next_cell);
+        }
+        if (run.size() >= MIN_KERNEL_RUN && !kernel.ReferencesOwnColumn()) {
+            EvaluateRun(kernel, run);
+        }
+        else {
+            for (auto cell : run) {
+                cell->GetValue();
+            }
+        }
+        i = next;
+    }
+}
+
+void Sheet::EvaluateRun(ColumnKernel& kernel, const std::vector<Cell*>& cells) const {
+    trace::Span span("ColumnKernel", cells.front()->GetPosition());
+    const int size = static_cast<int>(cells.size());
+    for (int first = 0; first < size; first += ColumnKernel::BLOCK_SIZE) {
+        int count = std::min(ColumnKernel::BLOCK_SIZE, size - first);
+        kernel.Evaluate(*this, first, count, &numbers_);
+        for (int i = 0; i < count; ++i) {
+            cells[first + i]->SetCachedValue(kernel.GetValue(i));
+        }
+    }
+    stats_.AddKernelRows(cells.size());
+}
+
+MemoryUsage Sheet::GetMemoryUsage() const {
+    auto lock = LockIfAsync(*cells_);
+    MemoryUsage result;
+    result.hash_table = memory::HashTableHeap(data_) + memory::HashTableHeap(dirty_formulas_);
+    result.numeric_columns = numbers_.GetMemoryUsage();
+    result.text = strings_.GetMemoryUsage();
+    result.formula_cache = formulas_->GetMemoryUsage();
+    result.lookup_indexes = memory::HashTableHeap(lookup_indexes_)
+        + range_dependencies_.GetMemoryUsage();
+    for (const auto& [col, index] : lookup_indexes_) {
+        result.lookup_indexes += index.GetMemoryUsage();
+    }
+    size_t cell_numbers = 0;
+    for (const auto& [pos, cell] : data_) {
+        cell->AddMemoryUsage(result);
+        cell_numbers += cell->GetNumber().has_value();
+    }
+    //        numbers_
+    result.cells += numbers_.GetCount() - cell_numbers;
+    return result;
+}
+
+void Sheet::SetRecalculationMode(RecalculationMode mode) {
+    if (mode == recalculation_mode_) {
+        return;
+    }
+    if (recalculator_ != nullptr) {
+        // ,     ,   
+        recalculator_.reset();
+        cells_->SetAsyncSheet(false);
+    }
+    recalculation_mode_ = mode;
+    if (mode == RecalculationMode::Eager) {
+        RecalculateAll();
+    }
+    else if (mode == RecalculationMode::Async) {
+        cells_->SetAsyncSheet(true);
+        recalculator_ = std::make_unique<BackgroundRecalculator>(*cells_);
+    }
+}
+
+RecalculationMode Sheet::GetRecalculationMode() const {
+    return recalculation_mode_;
+}
+
+CellSnapshot Sheet::GetSnapshot(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("out of range"s);
+    }
+    auto lock = LockIfAsync(*cells_);
+    auto cell = GetConcreteCell(pos);
+    if (cell == nullptr) {
+        double number = 0;
+        if (numbers_.Get(pos, number)) {
+            return {number, false};
+        }
+        return {std::string{}, false};
+    }
+    if (recalculator_ != nullptr && !cell->HasCachedValue()) {
+        if (auto value = recalculator_->FindStaleValue(cell->GetId())) {
+            return {*value, true};
+        }
+    }
+    return {cell->GetValue(), false};
+}
+
+void Sheet::WaitForRecalculation() const {
+    if (recalculator_ != nullptr) {
+        recalculator_->Wait();
+    }
+}
+
+void Sheet::ForgetStaleValue(const Cell& cell) {
+    if (recalculator_ != nullptr) {
+        recalculator_->Forget(cell.GetId());
+    }
+}
+void Sheet::RecalculateInvalidated() {
+    std::vector<Sheet*> notified;
+    std::vector<Sheet*> scheduled;
+    //        , 
+    //    
+    for (const auto& invalidated : invalidated_) {
+        invalidated.cell->GetSheet().InvalidateLookupValue(invalidated.cell->GetPosition());
+    }
+    for (auto& [cell, old_value] : invalidated_) {
+        auto& sheet = cell->GetSheet();
+        const bool eager = sheet.GetRecalculationMode() == RecalculationMode::Eager;
+        const bool is_formula = cell->GetFormula() != nullptr;
+        if (eager && is_formula) {
+            cell->GetValue();
+        }
+        else if (sheet.recalculator_ != nullptr && is_formula) {
+            if (std::find(scheduled.begin(), scheduled.end(), &sheet) == scheduled.end()) {
+                scheduled.push_back(&sheet);
+            }
+            sheet.recalculator_->Schedule(cell->GetId(), std::move(old_value));
+        }
+        if (sheet.subscribers_.empty()) {
+            continue;
+        }
+        if (sheet.pending_changes_.invalidated.empty()) {
+            notified.push_back(&sheet);
+        }
+        //      , 
+        //  
+        const bool changed = eager
+            && (!is_formula || !old_value.has_value() || !(*old_value == *cell->GetCachedValue()));
+        sheet.AddPendingChange(cell->GetPosition(), changed);
+    }
+    invalidated_.clear();
+    for (auto sheet : scheduled) {
+        sheet->recalculator_->Flush();
+    }
+    for (auto sheet : notified) {
+        sheet->NotifySubscribers();
+    }
+}
+
+void Sheet::AddPendingChange(Position pos, bool changed) {
+    pending_changes_.invalidated.push_back(pos);
+    if (changed) {
+        pending_changes_.changed.push_back(pos);
+    }
+}
+
+void Sheet::NotifySubscribers() {
+    ValueChanges changes;
+    std::swap(changes, pending_changes_);
+    for (auto positions : {&changes.invalidated, &changes.changed}) {
+        std::sort(positions->begin(), positions->end());
+        positions->erase(std::unique(positions->begin(), positions->end()), positions->end());
+    }
+    //  ,      
+    auto subscribers = subscribers_;
+    for (const auto& [id, handler] : subscribers) {
+        handler(changes);
+    }
+}
+
+size_t Sheet::Subscribe(ChangeHandler handler) {
+    subscribers_.push_back({next_subscription_, std::move(handler)});
+    return next_subscription_++;
+}
+
+void Sheet::Unsubscribe(size_t id) {
+    subscribers_.erase(std::remove_if(subscribers_.begin(), subscribers_.end(),
+        [id](const auto& subscriber) {
+            return subscriber.first == id;
+        }), subscribers_.end());
+}
+
+CellTable& Sheet::GetCellTable() const {
+    return *cells_;
+}
+
+void Sheet::CompactCellIds() {
+    if (workbook_ != nullptr) {
+        workbook_->CompactCellIds();
+        return;
+    }
+    //    ,   
+    WaitForRecalculation();
+    auto lock = LockIfAsync(*cells_);
+    std::vector<Cell*> order;
+    AppendCellsInRowOrder(order);
+    RemapCellIds(cells_->Compact(order));
+}
+
+void Sheet::AppendCellsInRowOrder(std::vector<Cell*>& order) const {
+    std::vector<std::pair<Position, Cell*>> cells;
+    cells.reserve(data_.size());
+    for (const auto& [pos, cell] : data_) {
+        cells.push_back({pos, cell.get()});
+    }
+    std::sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+        return std::tie(lhs.first.row, lhs.first.col) < std::tie(rhs.first.row, rhs.first.col);
+    });
+    for (const auto& [pos, cell] : cells) {
+        order.push_back(cell);
+    }
+}
+
+void Sheet::RemapCellIds(const std::vector<CellId>& new_ids) {
+    for (const auto& [pos, cell] : data_) {
+        cell->RemapIds(new_ids);
+    }
+    range_dependencies_.Remap(new_ids);
+}
+
+void Sheet::ReserveCells(size_t count) {
+    auto lock = LockIfAsync(*cells_);
+    data_.reserve(count);
+}
+
+void Sheet::SetStringInterning(bool enable) {
+    intern_strings_ = enable;
+}
+
+bool Sheet::IsStringInterningEnabled() const {
+    return intern_strings_;
+}
+
+StringPool& Sheet::GetStringPool() {
+    return strings_;
+}
+
+void Sheet::SetFormulaCacheCapacity(size_t capacity) {
+    formulas_->SetCapacity(capacity);
+}
+
+FormulaCache& Sheet::GetFormulaCache() {
+    return *formulas_;
+}
+
+const NumericColumns& Sheet::GetNumericColumns() const {
+    return numbers_;
+}
+
+void Sheet::UpdateNumber(Position pos, const Cell& cell) {
+    if (auto number = cell.GetNumber()) {
+        numbers_.Set(pos, *number);
+    }
+    else {
+        numbers_.Reset(pos);
+    }
+}
+
+bool Sheet::SetColumnNumber(Position pos, std::string_view text) {
+    auto number = ParseCanonicalNumber(text);
+    //     ,   
+    if (!number.has_value() || range_dependencies_.HasDependents(pos)) {
+        return false;
+    }
+    //      ,     
+    double old_number = 0;
+    if (numbers_.Get(pos, old_number) && old_number == *number
+        && std::signbit(old_number) == std::signbit(*number)) {
+        return true;
+    }
+    MaybeIncreaseSizeToIncludePosition(pos);
+    numbers_.Set(pos, *number);
+    stats_.AddInvalidation(1);
+    UpdateLookupIndex(pos, nullptr);
+    if (!subscribers_.empty()) {
+        AddPendingChange(pos, recalculation_mode_ == RecalculationMode::Eager);
+        NotifySubscribers();
+    }
+    return true;
+}
+
+std::vector<std::pair<Position, double>> Sheet::GetColumnNumbers() const {
+    std::vector<std::pair<Position, double>> result;
+    numbers_.ForEach([&](Position pos, double number) {
+        if (data_.count(pos) == 0) {
+            result.push_back({pos, number});
+        }
+    });
+    return result;
+}
+
+namespace {
+void SetLookupKey(LookupIndex& index, int row, Cell* cell) {
+    if (cell == nullptr) {
+        index.Reset(row);
+        return;
+    }
+    if (cell->GetFormula() != nullptr) {
+        index.SetFormula(row);
+        return;
+    }
+    if (auto number = cell->GetNumber()) {
+        index.Set(row, *number);
+        return;
+    }
+    auto value = cell->GetValue();
+    if (std::holds_alternative<std::string>(value) && !std::get<std::string>(value).empty()) {
+        index.Set(row, std::move(std::get<std::string>(value)));
+    }
+    else {
+        index.Reset(row);
+    }
+}
+}
+
+void Sheet::UpdateLookupIndex(Position pos, Cell* cell) {
+    if (lookup_indexes_.empty()) {
+        return;
+    }
+    auto index = lookup_indexes_.find(pos.col);
+    if (index == lookup_indexes_.end()) {
+        return;
+    }
+    double number = 0;
+    if (cell == nullptr && numbers_.Get(pos, number)) {
+        index->second.Set(pos.row, number);
+    }
+    else {
+        SetLookupKey(index->second, pos.row, cell);
+    }
+}
+
+void Sheet::InvalidateLookupValue(Position pos) {
+    if (lookup_indexes_.empty()) {
+        return;
+    }
+    auto index = lookup_indexes_.find(pos.col);
+    if (index != lookup_indexes_.end()) {
+        index->second.InvalidateFormula(pos.row);
+    }
+}
+
+LookupIndex& Sheet::GetLookupIndex(int col) const {
+    auto [index, inserted] = lookup_indexes_.try_emplace(col);
+    if (inserted) {
+        stats_.AddLookupIndexBuild();
+        for (int row = 0; row < size_.rows; ++row) {
+            auto cell = data_.find({row, col});
+            double number = 0;
+            if (cell != data_.end()) {
+                SetLookupKey(index->second, row, cell->second.get());
+            }
+            else if (numbers_.Get({row, col}, number)) {
+                index->second.Set(row, number);
+            }
+        }
+    }
+    return index->second;
+}
+
+std::optional<int> Sheet::LookupRow(Range column, const CellInterface::Value& key,
+    LookupMode mode) const {
+    if (!column.IsValid() || column.first.col != column.last.col) {
+        throw InvalidPositionException("invalid range"s);
+    }
+    LookupIndex::Key lookup_key;
+    if (std::holds_alternative<double>(key)) {
+        lookup_key = std::get<double>(key);
+    }
+    else if (std::holds_alternative<std::string>(key) && !std::get<std::string>(key).empty()) {
+        lookup_key = std::get<std::string>(key);
+    }
+    else {
+        return std::nullopt;
+    }
+    const int col = column.first.col;
+    //  ,    ,  GetValue
+    return GetLookupIndex(col).Find(lookup_key, mode, column.first.row, column.last.row,
+        [this, col](int row) -> std::optional<LookupIndex::Key> {
+            auto value = GetConcreteCell({row, col})->GetValue();
+            if (std::holds_alternative<double>(value)) {
+                return std::get<double>(value);
+            }
+            return std::nullopt;
+        });
+}
+
+std::optional<int> Sheet::FindUnreadLookupFormula(int col, int first_row, int last_row) const {
+    auto index = lookup_indexes_.find(col);
+    if (index == lookup_indexes_.end()) {
+        return std::nullopt;
+    }
+    return index->second.FindStaleFormula(first_row, last_row);
+}
+
+RangeDependencies& Sheet::GetRangeDependencies() {
+    return range_dependencies_;
+}
+
+const RangeDependencies& Sheet::GetRangeDependencies() const {
+    return range_dependencies_;
+}
+
+void Sheet::RebuildNumbers(const std::vector<std::pair<Position, double>>& column_numbers) {
+    lookup_indexes_.clear();
+    numbers_.Clear();
+    for (const auto& [pos, cell] : data_) {
+        UpdateNumber(pos, *cell);
+    }
+    for (const auto& [pos, number] : column_numbers) {
+        numbers_.Set(pos, number);
+    }
+}
+
+void Sheet::AddDirtyFormula(Cell* cell) {
+    dirty_formulas_.insert(cell);
+}
+
+void Sheet::RemoveDirtyFormula(Cell* cell) {
+    dirty_formulas_.erase(cell);
+}
+
+StatsCounters& Sheet::GetStatsCounters() const {
+    return stats_;
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
-    return GetConcreteCell(pos);
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("out of range"s);
+    }
+    return MaterializeCell(pos);
 }
 CellInterface* Sheet::GetCell(Position pos) {
-    return GetConcreteCell(pos);
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("out of range"s);
+    }
+    return MaterializeCell(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("out of range"s);
     }
-    auto cell = GetConcreteCell(pos);
-    if (cell != nullptr) {
-        //       -   ,     
-        if (cell->IsReferenced()) {
+    auto lock = LockIfAsync(*cells_);
+    //      numbers_,    ,
+    //        
+    auto cell = range_dependencies_.HasDependents(pos) ? MaterializeCell(pos) : GetConcreteCell(pos);
+    double number = 0;
+    if (cell == nullptr && !numbers_.Get(pos, number)) {
+        return;
+    }
+    numbers_.Reset(pos);
+    UpdateLookupIndex(pos, nullptr);
+    //       -   ,     .
+    //  ,    ,  ,   .
+    if (cell != nullptr && (cell->IsReferenced() || range_dependencies_.HasDependents(pos))) {
+        cell->Clear();
+        stats_.AddInvalidation(cell->CacheInvalidation(&invalidated_));
+        RecalculateInvalidated();
+    }
+    else {
+        if (cell != nullptr) {
             cell->Clear();
+            ForgetStaleValue(*cell);
+            data_.erase(pos);
+        }
+        MaybeFitSizeToClearPosition(pos);
+        if (!subscribers_.empty()) {
+            AddPendingChange(pos, recalculation_mode_ == RecalculationMode::Eager);
+            NotifySubscribers();
+        }
+    }
+}
+
+namespace {
+int GetLine(Position pos, bool rows) {
+    return rows ? pos.row : pos.col;
+}
+
+void ShiftLine(Position& pos, bool rows, int shift) {
+    (rows ? pos.row : pos.col) += shift;
+}
+}
+
+void Sheet::InsertRows(int before, int count) {
+    InsertLines(true, before, count);
+}
+
+void Sheet::InsertColumns(int before, int count) {
+    InsertLines(false, before, count);
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    DeleteLines(true, first, count);
+}
+
+void Sheet::DeleteColumns(int first, int count) {
+    DeleteLines(false, first, count);
+}
+
+void Sheet::FitSizeToCells() {
+    size_ = {};
+    for (const auto& [pos, cell] : data_) {
+        MaybeIncreaseSizeToIncludePosition(pos);
+    }
+    numbers_.ForEach([this](Position pos, double) {
+        MaybeIncreaseSizeToIncludePosition(pos);
+    });
+}
+
+void Sheet::InsertLines(bool rows, int before, int count) {
+    const int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (before < 0 || before >= limit || count < 0) {
+        throw InvalidPositionException("out of range"s);
+    }
+    if (count == 0) {
+        return;
+    }
+    auto lock = LockIfAsync(*cells_);
+    for (const auto& [pos, cell] : data_) {
+        if (GetLine(pos, rows) >= before && GetLine(pos, rows) + count >= limit) {
+            throw InvalidPositionException("out of range"s);
+        }
+    }
+    auto column_numbers = GetColumnNumbers();
+    bool shifted_numbers = false;
+    for (auto& [pos, number] : column_numbers) {
+        if (GetLine(pos, rows) < before) {
+            continue;
+        }
+        if (GetLine(pos, rows) + count >= limit) {
+            throw InvalidPositionException("out of range"s);
+        }
+        ShiftLine(pos, rows, count);
+        shifted_numbers = true;
+    }
+    //    ,       
+    std::unordered_set<CellId> affected;
+    std::vector<decltype(data_)::node_type> shifted;
+    for (auto it = data_.begin(); it != data_.end();) {
+        if (GetLine(it->first, rows) < before) {
+            ++it;
+            continue;
+        }
+        const auto& parents = it->second->GetParents();
+        affected.insert(parents.begin(), parents.end());
+        shifted.push_back(data_.extract(it++));
+    }
+    //        
+    const auto range_cells = range_dependencies_.GetCells();
+    affected.insert(range_cells.begin(), range_cells.end());
+    for (auto& node : shifted) {
+        ShiftLine(node.key(), rows, count);
+        node.mapped()->SetPosition(node.key());
+        data_.insert(std::move(node));
+    }
+    //    ,    , 
+    //   ,      
+    std::vector<Cell*> changed;
+    for (auto id : affected) {
+        auto cell = cells_->Get(id);
+        auto result = HandleShiftedReferences(cell, rows, true, before, count);
+        if (result == FormulaInterface::HandlingResult::ReferencesChanged) {
+            changed.push_back(cell);
+        }
+    }
+    for (auto id : range_cells) {
+        cells_->Get(id)->ResetRanges();
+    }
+    for (auto cell : changed) {
+        cell->CacheInvalidation(&invalidated_);
+    }
+    if (!shifted.empty() || shifted_numbers) {
+        (rows ? size_.rows : size_.cols) += count;
+        RebuildNumbers(column_numbers);
+    }
+    RecalculateInvalidated();
+}
+
+void Sheet::DeleteLines(bool rows, int first, int count) {
+    const int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (first < 0 || first >= limit || count < 0) {
+        throw InvalidPositionException("out of range"s);
+    }
+    if (count == 0) {
+        return;
+    }
+    auto lock = LockIfAsync(*cells_);
+    const int last = first + count;
+    //         
+    auto column_numbers = GetColumnNumbers();
+    column_numbers.erase(std::remove_if(column_numbers.begin(), column_numbers.end(),
+        [&](const auto& number) {
+            int line = GetLine(number.first, rows);
+            return line >= first && line < last;
+        }), column_numbers.end());
+    for (auto& [pos, number] : column_numbers) {
+        if (GetLine(pos, rows) >= last) {
+            ShiftLine(pos, rows, -count);
+        }
+    }
+    std::unordered_set<CellId> deleted;
+    for (const auto& [pos, cell] : data_) {
+        int line = GetLine(pos, rows);
+        if (line >= first && line < last) {
+            deleted.insert(cell->GetId());
+        }
+    }
+    //      ,    
+    std::unordered_set<CellId> affected;
+    for (auto id : deleted) {
+        auto cell = cells_->Get(id);
+        for (auto parent : cell->GetParents()) {
+            if (deleted.count(parent) == 0) {
+                affected.insert(parent);
+            }
+        }
+        cell->Detach();
+    }
+    //        
+    const auto range_cells = range_dependencies_.GetCells();
+    affected.insert(range_cells.begin(), range_cells.end());
+    std::vector<decltype(data_)::node_type> shifted;
+    for (auto it = data_.begin(); it != data_.end();) {
+        int line = GetLine(it->first, rows);
+        if (line < first) {
+            ++it;
+        }
+        else if (line < last) {
+            ForgetStaleValue(*it->second);
+            it = data_.erase(it);
         }
         else {
-            cell->Clear();
-            data_.erase(pos);
-            MaybeFitSizeToClearPosition(pos);
+            const auto& parents = it->second->GetParents();
+            affected.insert(parents.begin(), parents.end());
+            shifted.push_back(data_.extract(it++));
         }
-    } 
+    }
+    for (auto& node : shifted) {
+        ShiftLine(node.key(), rows, -count);
+        node.mapped()->SetPosition(node.key());
+        data_.insert(std::move(node));
+    }
+    std::vector<Cell*> changed;
+    for (auto id : affected) {
+        auto cell = cells_->Get(id);
+        auto result = HandleShiftedReferences(cell, rows, false, first, count);
+        if (result == FormulaInterface::HandlingResult::ReferencesChanged) {
+            changed.push_back(cell);
+        }
+    }
+    //       
+    for (auto id : range_cells) {
+        cells_->Get(id)->ResetRanges();
+    }
+    for (auto cell : changed) {
+        cell->CacheInvalidation(&invalidated_);
+    }
+    RebuildNumbers(column_numbers);
+    FitSizeToCells();
+    RecalculateInvalidated();
+}
+
+FormulaInterface::HandlingResult Sheet::HandleShiftedReferences(Cell* cell, bool rows,
+    bool insert, int first, int count) const {
+    auto formula = cell->GetFormula();
+    auto handle = [&](std::string_view sheet) {
+        if (insert) {
+            return rows ? formula->HandleInsertedRows(first, count, sheet)
+                : formula->HandleInsertedCols(first, count, sheet);
+        }
+        return rows ? formula->HandleDeletedRows(first, count, sheet)
+            : formula->HandleDeletedCols(first, count, sheet);
+    };
+    auto result = FormulaInterface::HandlingResult::NothingChanged;
+    if (&cell->GetSheet() == this) {
+        result = handle({});
+    }
+    if (!name_.empty()) {
+        result = std::max(result, handle(name_));
+    }
+    return result;
+}
+
+namespace {
+//      ,   
+const int MIN_PARALLEL_SORT_ROWS = 4096;
+
+//        :  
+// ,   .   ,  
+//  .
+int CompareValues(const CellInterface::Value& lhs, const CellInterface::Value& rhs) {
+    if (lhs.index() != rhs.index()) {
+        auto rank = [](const CellInterface::Value& value) {
+            return std::holds_alternative<double>(value) ? 0
+                : std::holds_alternative<std::string>(value) ? 1 : 2;
+        };
+        return rank(lhs) - rank(rhs);
+    }
+    if (const auto* number = std::get_if<double>(&lhs)) {
+        double other = std::get<double>(rhs);
+        return *number < other ? -1 : other < *number ? 1 : 0;
+    }
+    if (const auto* text = std::get_if<std::string>(&lhs)) {
+        return text->compare(std::get<std::string>(rhs));
+    }
+    return static_cast<int>(std::get<FormulaError>(lhs).GetCategory())
+        - static_cast<int>(std::get<FormulaError>(rhs).GetCategory());
+}
+}
+
+void Sheet::SortRange(Range range, const std::vector<SortKey>& keys) {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("out of range"s);
+    }
+    const std::vector<SortKey> sort_keys = keys.empty()
+        ? std::vector<SortKey>{{range.first.col, true}} : keys;
+    for (const auto& key : sort_keys) {
+        if (key.col < range.first.col || key.col > range.last.col) {
+            throw InvalidPositionException("sort key is out of range"s);
+        }
+    }
+    auto lock = LockIfAsync(*cells_);
+    const int rows = range.last.row - range.first.row + 1;
+    const size_t key_count = sort_keys.size();
+    //   k  i  - values[i * key_count + k],
+    //   - nullopt
+    std::vector<std::optional<CellInterface::Value>> values;
+    values.reserve(static_cast<size_t>(rows) * key_count);
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (const auto& key : sort_keys) {
+            auto cell = GetConcreteCell({row, key.col});
+            double number = 0;
+            if (cell != nullptr && !cell->IsEmpty()) {
+                values.emplace_back(cell->GetValue());
+            }
+            else if (cell == nullptr && numbers_.Get({row, key.col}, number)) {
+                values.emplace_back(number);
+            }
+            else {
+                values.emplace_back();
+            }
+        }
+    }
+    //    ,    values
+    auto less = [&values, &sort_keys, key_count](int lhs, int rhs) {
+        for (size_t k = 0; k < key_count; ++k) {
+            const auto& left = values[lhs * key_count + k];
+            const auto& right = values[rhs * key_count + k];
+            if (!left || !right) {
+                if (left.has_value() != right.has_value()) {
+                    return left.has_value();
+                }
+                continue;
+            }
+            int order = CompareValues(*left, *right);
+            if (order != 0) {
+                return sort_keys[k].ascending ? order < 0 : order > 0;
+            }
+        }
+        return false;
+    };
+    std::vector<int> order(rows);
+    std::iota(order.begin(), order.end(), 0);
+    const size_t threads = rows < MIN_PARALLEL_SORT_ROWS
+        ? 1 : std::max(std::thread::hardware_concurrency(), 1u);
+    ParallelStableSort(order.begin(), order.end(), less, threads);
+
+    //      i 
+    std::vector<int> new_rows(rows);
+    bool moved = false;
+    for (int i = 0; i < rows; ++i) {
+        new_rows[order[i]] = range.first.row + i;
+        moved = moved || order[i] != i;
+    }
+    if (!moved) {
+        return;
+    }
+
+    //      -,   
+    //   ,     
+    std::unordered_set<CellId> affected;
+    std::vector<decltype(data_)::node_type> moved_cells;
+    for (auto it = data_.begin(); it != data_.end();) {
+        const Position pos = it->first;
+        if (!range.Contains(pos) || new_rows[pos.row - range.first.row] == pos.row) {
+            ++it;
+            continue;
+        }
+        const auto& parents = it->second->GetParents();
+        affected.insert(parents.begin(), parents.end());
+        numbers_.Reset(pos);
+        if (!subscribers_.empty()) {
+            AddPendingChange(pos, true);
+        }
+        moved_cells.push_back(data_.extract(it++));
+    }
+    //       numbers_:  
+    //     ,     -  
+    std::vector<std::pair<Position, double>> moved_numbers;
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        const int new_row = new_rows[row - range.first.row];
+        for (int col = range.first.col; new_row != row && col <= range.last.col; ++col) {
+            double number = 0;
+            if (!numbers_.Get({row, col}, number)) {
+                continue;
+            }
+            numbers_.Reset({row, col});
+            moved_numbers.push_back({{new_row, col}, number});
+            if (!subscribers_.empty()) {
+                AddPendingChange({row, col}, true);
+            }
+        }
+    }
+    for (auto& node : moved_cells) {
+        node.key().row = new_rows[node.key().row - range.first.row];
+        node.mapped()->SetPosition(node.key());
+        UpdateNumber(node.key(), *node.mapped());
+        if (!subscribers_.empty()) {
+            AddPendingChange(node.key(), true);
+        }
+        data_.insert(std::move(node));
+    }
+    for (const auto& [pos, number] : moved_numbers) {
+        numbers_.Set(pos, number);
+        if (!subscribers_.empty()) {
+            AddPendingChange(pos, true);
+        }
+    }
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        lookup_indexes_.erase(col);
+    }
+    for (auto id : affected) {
+        auto cell = cells_->Get(id);
+        auto formula = cell->GetFormula();
+        if (&cell->GetSheet() == this) {
+            formula->HandleSortedRows(range, new_rows);
+        }
+        if (!name_.empty()) {
+            formula->HandleSortedRows(range, new_rows, name_);
+        }
+    }
+    //     ,   
+    // 
+    for (auto id : range_dependencies_.GetCells()) {
+        auto cell = cells_->Get(id);
+        for (const auto& cell_range : cell->GetRanges()) {
+            if (cell_range.IsValid() && cell_range.first.row <= range.last.row
+                && range.first.row <= cell_range.last.row
+                && cell_range.first.col <= range.last.col
+                && range.first.col <= cell_range.last.col) {
+                cell->CacheInvalidation(&invalidated_);
+                break;
+            }
+        }
+    }
+    FitSizeToCells();
+    RecalculateInvalidated();
+    if (!pending_changes_.invalidated.empty()) {
+        NotifySubscribers();
+    }
+}
+
+namespace {
+//   key  64 ,  j  -  j.  
+//   .
+template <typename Compare>
+std::uint64_t CompareWord(const double* values, double key, Compare compare) {
+    std::uint64_t result = 0;
+    for (int j = 0; j < 64; ++j) {
+        result |= static_cast<std::uint64_t>(compare(values[j], key)) << j;
+    }
+    return result;
+}
+
+std::uint64_t CompareWord(const double* values, double key, CompareOp op) {
+    switch (op) {
+        case CompareOp::Equal:
+            return CompareWord(values, key, std::equal_to<>());
+        case CompareOp::NotEqual:
+            return CompareWord(values, key, std::not_equal_to<>());
+        case CompareOp::Less:
+            return CompareWord(values, key, std::less<>());
+        case CompareOp::LessOrEqual:
+            return CompareWord(values, key, std::less_equal<>());
+        case CompareOp::Greater:
+            return CompareWord(values, key, std::greater<>());
+        case CompareOp::GreaterOrEqual:
+            return CompareWord(values, key, std::greater_equal<>());
+    }
+    return 0;
+}
+
+//     order  op
+bool Fits(int order, CompareOp op) {
+    switch (op) {
+        case CompareOp::Equal:
+            return order == 0;
+        case CompareOp::NotEqual:
+            return order != 0;
+        case CompareOp::Less:
+            return order < 0;
+        case CompareOp::LessOrEqual:
+            return order <= 0;
+        case CompareOp::Greater:
+            return order > 0;
+        case CompareOp::GreaterOrEqual:
+            return order >= 0;
+    }
+    return false;
+}
+}
+
+RowBitmap Sheet::QueryRows(Range range, const std::vector<QueryCondition>& conditions) const {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("out of range"s);
+    }
+    for (const auto& condition : conditions) {
+        if (condition.col < range.first.col || condition.col > range.last.col) {
+            throw InvalidPositionException("query column is out of range"s);
+        }
+    }
+    auto lock = LockIfAsync(*cells_);
+    RowBitmap rows;
+    rows.words.assign(range.last.row / 64 + 1, 0);
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        rows.words[row / 64] |= std::uint64_t{1} << (row % 64);
+    }
+    //      ,  
+    // :      
+    std::vector<const QueryCondition*> order;
+    order.reserve(conditions.size());
+    for (const auto& condition : conditions) {
+        order.push_back(&condition);
+    }
+    std::stable_partition(order.begin(), order.end(), [](const QueryCondition* condition) {
+        return std::holds_alternative<double>(condition->value);
+    });
+    for (auto condition : order) {
+        FilterRows(*condition, rows);
+    }
+    return rows;
+}
+
+void Sheet::FilterRows(const QueryCondition& condition, RowBitmap& rows) const {
+    const auto* text = std::get_if<std::string>(&condition.value);
+    if (text != nullptr && !text->empty() && condition.op == CompareOp::Equal) {
+        //       : 
+        //       
+        const auto& index = GetLookupIndex(condition.col);
+        std::vector<std::uint64_t> matched(rows.words.size());
+        const int end_row = static_cast<int>(rows.words.size()) * 64;
+        for (int row : index.GetRows(*text)) {
+            if (row >= end_row) {
+                break;
+            }
+            matched[row / 64] |= std::uint64_t{1} << (row % 64);
+        }
+        for (int row : index.GetFormulaRows()) {
+            if (row >= end_row) {
+                break;
+            }
+            if (rows.Contains(row)
+                && GetConcreteCell({row, condition.col})->GetValue() == condition.value) {
+                matched[row / 64] |= std::uint64_t{1} << (row % 64);
+            }
+        }
+        for (size_t word = 0; word < rows.words.size(); ++word) {
+            rows.words[word] &= matched[word];
+        }
+        return;
+    }
+    const bool numeric = std::holds_alternative<double>(condition.value);
+    for (size_t word = 0; word < rows.words.size(); ++word) {
+        auto& candidates = rows.words[word];
+        if (candidates == 0) {
+            continue;
+        }
+        const int first_row = static_cast<int>(word) * 64;
+        // ,    ,  ,   
+        std::uint64_t numbers = 0;
+        std::uint64_t matched = 0;
+        const int block_index = first_row / NumericColumns::BLOCK_ROWS;
+        if (auto block = numbers_.GetBlock(condition.col, block_index)) {
+            const int offset = first_row % NumericColumns::BLOCK_ROWS;
+            numbers = block->valid[offset / 64];
+            if (numeric) {
+                matched = CompareWord(block->values + offset, std::get<double>(condition.value),
+                    condition.op) & numbers;
+            }
+        }
+        // ,       
+        const std::uint64_t rest = candidates & ~numbers;
+        for (int bit = 0; bit < 64 && rest >> bit != 0; ++bit) {
+            if (((rest >> bit) & 1) == 0) {
+                continue;
+            }
+            auto cell = GetConcreteCell({first_row + bit, condition.col});
+            if (cell == nullptr || cell->IsEmpty()) {
+                continue;
+            }
+            auto value = cell->GetValue();
+            if (value.index() == condition.value.index()
+                && Fits(CompareValues(value, condition.value), condition.op)) {
+                matched |= std::uint64_t{1} << bit;
+            }
+        }
+        candidates &= matched;
+    }
 }
 
 Size Sheet::GetPrintableSize() const {
     return size_;
 }
 
+namespace {
+//     
+const int PRINT_STRIPE_ROWS = 256;
+//      ,   
+const size_t MIN_PARALLEL_PRINT_CELLS = 16384;
+
 int GetRowsHeaderSize(int rows) {
     int result = 0;
     while (rows > 0) {
@@ -126,33 +1343,40 @@ int GetRowsHeaderSize(int rows) {
     return result;
 }
 
-std::string Sheet::GetBoundary(int width) const {
-    std::string result;
-    auto size = GetPrintableSize();
-    int rows_header_size = GetRowsHeaderSize(size.rows);
-    for (size_t i = 0; i < rows_header_size; ++i) {
-        result += '-';
+//  text     ,  std::setw
+void AppendAligned(std::string& buffer, std::string_view text, int width = PRINT_COLUMN_WIDTH) {
+    if (text.size() < static_cast<size_t>(width)) {
+        buffer.append(width - text.size(), ' ');
     }
+    buffer += text;
+}
+
+//       
+void AppendCellText(std::string& buffer, std::string_view text) {
+    if (text.size() <= PRINT_COLUMN_WIDTH) {
+        AppendAligned(buffer, text);
+    }
+    else {
+        buffer += text.substr(0, PRINT_COLUMN_WIDTH - 3);
+        buffer += "..."sv;
+    }
+}
+}
+
+std::string Sheet::GetBoundary(int width, Range range) const {
+    std::string result(GetRowsHeaderSize(range.last.row + 1), '-');
     result += '|';
-    for (int i = 0; i < size.cols; ++i)
-    {
-        for (int j = 0; j < width; ++j) {
-            result += '-';
-        }
+    for (int i = range.first.col; i <= range.last.col; ++i) {
+        result.append(width, '-');
         result += '|';
     }
-    
     return result;
 }
 
-void Sheet::PrintTableHeader(std::ostream& output) const {
-    int rows_header_size = GetRowsHeaderSize(size_.rows);
-    for (size_t i = 0; i < rows_header_size; ++i) {
-        output << ' ';
-    }
-    output << '|';
-    for (size_t i = 0; i < size_.cols; ++i)
-    {
+void Sheet::PrintTableHeader(std::ostream& output, Range range) const {
+    std::string header(GetRowsHeaderSize(range.last.row + 1), ' ');
+    header += '|';
+    for (int i = range.first.col; i <= range.last.col; ++i) {
         int c = i;
         std::string result;
         result.reserve(17);
@@ -160,53 +1384,144 @@ void Sheet::PrintTableHeader(std::ostream& output) const {
             result.insert(result.begin(), 'A' + c % 26);
             c = c / 26 - 1;
         }
-        output << std::setw(12) << result << '|';
+        AppendAligned(header, result);
+        header += '|';
     }
-    output << '\n';
+    header += '\n';
+    output << header;
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    if (size_ == Size{ 0, 0 }) {
-        output << "empty sheet\n"s;
-        return;
-    };
-    PrintTableHeader(output);
-    int rows_header_size = GetRowsHeaderSize(size_.rows);
-    output << GetBoundary(12) << '\n';
-    for (int y = 0; y < size_.rows; ++y) {
-        bool is_first = true;
-        for (int x = 0; x < size_.cols; ++x) {
-            if (is_first) {
-                output << std::setw(rows_header_size) << y + 1 << '|';
-            }
-            else {
-                output << '|';
+void Sheet::PrintRows(std::string& buffer, Range range, bool values, int rows_header_size,
+    const std::string& boundary, std::uint64_t& number_formats) const {
+    for (int y = range.first.row; y <= range.last.row; ++y) {
+        AppendAligned(buffer, std::to_string(y + 1), rows_header_size);
+        for (int x = range.first.col; x <= range.last.col; ++x) {
+            buffer += '|';
+            const auto cell = GetConcreteCell({ y, x });
+            double number = 0;
+            if (cell == nullptr && numbers_.Get({ y, x }, number)) {
+                //     -  ,  
+                //  ,   ,    
+                char text[MAX_NUMBER_TEXT_SIZE];
+                if (values) {
+                    AppendAligned(buffer, std::string_view(text,
+                        FormatNumber(number, text, PRINT_COLUMN_WIDTH) - text));
+                    ++number_formats;
+                }
+                else {
+                    AppendCellText(buffer, std::string_view(text, FormatNumber(number, text) - text));
+                }
+                continue;
             }
-            is_first = false;
-            const auto cell = GetCell({ y, x });
             if (cell == nullptr) {
-                output << "            "s;
+                buffer.append(PRINT_COLUMN_WIDTH, ' ');
                 continue;
             }
-            const auto& value = cell->GetValue();
+            if (!values) {
+                AppendCellText(buffer, cell->GetText());
+                continue;
+            }
+            const auto& value = cell->GetComputedValue();
             if (std::holds_alternative<double>(value)) {
-                output << std::setw(12) << std::get<double>(value);
+                AppendAligned(buffer, cell->GetNumberText(number_formats));
             }
             else if (std::holds_alternative<std::string>(value)) {
-                std::string text = std::get<std::string>(value);
-                if (text.size() <= 12) {
-                    output << std::setw(12) << text;
-                }
-                else {
-                    output << std::string_view(text.data(), 9) << "..."s;
-                }
+                AppendCellText(buffer, std::get<std::string>(value));
             }
             else {
-                output << std::setw(12) << std::get<FormulaError>(value);
+                AppendAligned(buffer, std::get<FormulaError>(value).ToString());
+            }
+        }
+        buffer += "|\n"sv;
+        buffer += boundary;
+        buffer += '\n';
+    }
+}
+
+void Sheet::PrintRange(std::ostream& output, Range range, bool values) const {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("invalid range"s);
+    }
+    //         , 
+    //  
+    auto lock = LockIfAsync(*cells_);
+    if (values) {
+        RecalculateRange(range);
+    }
+    PrintTableHeader(output, range);
+    const int rows_header_size = GetRowsHeaderSize(range.last.row + 1);
+    const std::string boundary = GetBoundary(PRINT_COLUMN_WIDTH, range);
+    output << boundary << '\n';
+
+    std::vector<Range> stripes;
+    for (int row = range.first.row; row <= range.last.row; row += PRINT_STRIPE_ROWS) {
+        int last_row = std::min(row + PRINT_STRIPE_ROWS - 1, range.last.row);
+        stripes.push_back({ { row, range.first.col }, { last_row, range.last.col } });
+    }
+    const Size size = range.GetSize();
+    size_t threads = print_threads_ != 0 ? print_threads_
+        : std::max(std::thread::hardware_concurrency(), 1u);
+    threads = std::min(threads, stripes.size());
+    //    Async     
+    if (threads <= 1 || static_cast<size_t>(size.rows) * size.cols < MIN_PARALLEL_PRINT_CELLS
+        || cells_->HasAsyncSheets()) {
+        std::string buffer;
+        std::uint64_t number_formats = 0;
+        for (const auto& stripe : stripes) {
+            buffer.clear();
+            PrintRows(buffer, stripe, values, rows_header_size, boundary, number_formats);
+            output << buffer;
+        }
+        stats_.AddNumberFormats(number_formats);
+        return;
+    }
+
+    //       ,    
+    // .    GetNumberText     .
+    //          
+    //   ,   .
+    std::vector<std::string> buffers(stripes.size());
+    std::atomic<size_t> next_stripe{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto work = [&] {
+        std::uint64_t number_formats = 0;
+        try {
+            for (size_t i; (i = next_stripe.fetch_add(1)) < stripes.size();) {
+                PrintRows(buffers[i], stripes[i], values, rows_header_size, boundary,
+                    number_formats);
             }
         }
-        output << '|' << '\n' << GetBoundary(12) << '\n';
+        catch (...) {
+            std::lock_guard guard(error_mutex);
+            error = std::current_exception();
+            next_stripe = stripes.size();
+        }
+        stats_.AddNumberFormats(number_formats);
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers) {
+        worker.join();
     }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    for (const auto& buffer : buffers) {
+        output << buffer;
+    }
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    if (size_ == Size{ 0, 0 }) {
+        output << "empty sheet\n"s;
+        return;
+    };
+    PrintRange(output, { { 0, 0 }, { size_.rows - 1, size_.cols - 1 } }, true);
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
@@ -214,34 +1529,19 @@ void Sheet::PrintTexts(std::ostream& output) const {
         output << "empty sheet"s;
         return;
     };
-    PrintTableHeader(output);
-    int rows_header_size = GetRowsHeaderSize(size_.rows);
-    output << GetBoundary(12) << '\n';
-    for (int y = 0; y < size_.rows; ++y) {
-        bool is_first = true;
-        for (int x = 0; x < size_.cols; ++x) {
-            if (is_first) {
-                output << std::setw(rows_header_size) << y + 1 << '|';
-            }
-            else {
-                output << '|';
-            }
-            is_first = false;
-            const auto cell = GetCell({ y, x });
-            if (cell == nullptr) {
-                output << "            "s;
-                continue;
-            }
-            std::string  text = cell->GetText();
-            if (text.size() <= 12) {
-                output << std::setw(12) << text;
-            }
-            else {
-                output << std::string_view(text.data(), 9) << "..."s;
-            }
-        }
-        output << '|' << '\n' << GetBoundary(12) << '\n';
-    }
+    PrintRange(output, { { 0, 0 }, { size_.rows - 1, size_.cols - 1 } }, false);
+}
+
+void Sheet::PrintValues(std::ostream& output, Range range) const {
+    PrintRange(output, range, true);
+}
+
+void Sheet::PrintTexts(std::ostream& output, Range range) const {
+    PrintRange(output, range, false);
+}
+
+void Sheet::SetPrintThreads(size_t threads) {
+    print_threads_ = threads;
 }
 
 /*
@@ -296,8 +1596,14 @@ void Sheet::PrintTexts(std::ostream& output) const {
 
 Cell* Sheet::NewCell(Position pos) {
     MaybeIncreaseSizeToIncludePosition(pos);
-    data_[pos].reset(new Cell(*this));
-    return data_[pos].get();
+    auto& cell = data_[pos];
+    cell.reset(new (GetCellTable().GetAllocator()) Cell(*this, pos));
+    return cell.get();
+}
+
+void Sheet::RemoveNewCell(Position pos) {
+    data_.erase(pos);
+    MaybeFitSizeToClearPosition(pos);
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -2,26 +2,53 @@
 
 #include "cell.h"
 #include "common.h"
+#include "formula_cache.h"
+#include "lookup_index.h"
+#include "numeric_columns.h"
+#include "range_dependencies.h"
+#include "recalculator.h"
+#include "stats.h"
+#include "string_pool.h"
 
 #include <functional>
 #include <unordered_map>
+#include <unordered_set>
 
 class Cell;
+class ColumnKernel;
+class Workbook;
+
+//     
+inline constexpr int PRINT_COLUMN_WIDTH = 12;
 
 class Sheet : public SheetInterface {
 public:
+    Sheet();
+
+    //    workbook   name
+    Sheet(Workbook& workbook, std::string name);
+
     //   ,
     //    
     void SetCell(Position pos, std::string text) override;
 
     //     
     Cell* NewCell(Position pos);
+    //   ,  NewCell,   
+    void RemoveNewCell(Position pos);
 
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
     void ClearCell(Position pos) override;
 
+    void InsertRows(int before, int count = 1) override;
+    void InsertColumns(int before, int count = 1) override;
+    void DeleteRows(int first, int count = 1) override;
+    void DeleteColumns(int first, int count = 1) override;
+
+    void SortRange(Range range, const std::vector<SortKey>& keys) override;
+
     //     
     Size GetPrintableSize() const override;
 
@@ -30,14 +57,158 @@ public:
 
     //      
     void PrintTexts(std::ostream& output) const override;
+
+    void PrintValues(std::ostream& output, Range range) const override;
+    void PrintTexts(std::ostream& output, Range range) const override;
+
+    void SetPrintThreads(size_t threads) override;
     
     const Cell* GetConcreteCell(Position pos) const;
     Cell* GetConcreteCell(Position pos);
+
+    //   pos  nullptr,   .  ,
+    //     numbers_,     
+    // :       .
+    Cell* MaterializeCell(Position pos) const;
+
+    std::vector<SheetPosition> GetDependents(Position pos, bool transitive) const override;
+    std::vector<SheetPosition> GetPrecedents(Position pos, bool transitive) const override;
+
+    std::optional<int> LookupRow(Range column, const CellInterface::Value& key,
+        LookupMode mode) const override;
+
+    //     [first_row, last_row]   
+    // col,        , 
+    // nullopt.     ,   
+    //  .     ,  nullopt:
+    //    ,   .
+    std::optional<int> FindUnreadLookupFormula(int col, int first_row, int last_row) const;
+
+    RowBitmap QueryRows(Range range, const std::vector<QueryCondition>& conditions) const override;
+
+    const SheetInterface* FindSheet(std::string_view name) const override;
+
+    //      name  nullptr
+    Sheet* FindConcreteSheet(std::string_view name);
+
+    //   ,       
+    const std::string& GetName() const;
+
+    SheetStats GetStats() const override;
+
+    void RecalculateAll() const override;
+
+    MemoryUsage GetMemoryUsage() const override;
+
+    void SetRecalculationMode(RecalculationMode mode) override;
+    RecalculationMode GetRecalculationMode() const override;
+
+    CellSnapshot GetSnapshot(Position pos) const override;
+    void WaitForRecalculation() const override;
+
+    size_t Subscribe(ChangeHandler handler) override;
+    void Unsubscribe(size_t id) override;
+
+    void ReserveCells(size_t count) override;
+
+    //    ,        
+    CellTable& GetCellTable() const;
+
+    //    (   ) 
+    void CompactCellIds() override;
+
+    //   order    ,  
+    void AppendCellsInRowOrder(std::vector<Cell*>& order) const;
+
+    //      
+    void RemapCellIds(const std::vector<CellId>& new_ids);
+
+    void SetStringInterning(bool enable) override;
+    bool IsStringInterningEnabled() const;
+    StringPool& GetStringPool();
+
+    void SetFormulaCacheCapacity(size_t capacity) override;
+    //    ,        
+    FormulaCache& GetFormulaCache();
+
+    //       
+    const NumericColumns& GetNumericColumns() const;
+
+    //      ,   
+    RangeDependencies& GetRangeDependencies();
+    const RangeDependencies& GetRangeDependencies() const;
+
+    //  ,    
+    StatsCounters& GetStatsCounters() const;
+
+    //   cell,     , 
+    //   
+    void AddDirtyFormula(Cell* cell);
+
+    //    cell
+    void RemoveDirtyFormula(Cell* cell);
     
 private:
+    //     ,      
+    StringPool strings_;
+    bool intern_strings_ = false;
+
+    //   :     ,  - 
+    std::unique_ptr<FormulaCache> own_formulas_;
+    FormulaCache* formulas_;
+
+    //   :     ,  - .
+    //   ,     .
+    std::unique_ptr<CellTable> own_cells_;
+    CellTable* cells_;
+
+    // ,        
+    // ,       . 
+    //      ,   , 
+    //  .   ,    .
+    mutable std::unordered_set<Cell*> dirty_formulas_;
+
     std::unordered_map<Position, std::unique_ptr<Cell>, PositionHash> data_;
     Size size_;
 
+    // ,    , nullptr     
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+
+    mutable StatsCounters stats_;
+
+    RecalculationMode recalculation_mode_ = RecalculationMode::Lazy;
+
+    //    , 0 -   
+    size_t print_threads_ = 0;
+
+    // ,    
+    std::vector<InvalidatedCell> invalidated_;
+
+    //         
+    std::vector<std::pair<size_t, ChangeHandler>> subscribers_;
+    size_t next_subscription_ = 0;
+
+    //   ,    
+    ValueChanges pending_changes_;
+
+    //   ,     .
+    // ,       FormatNumber, 
+    //  ,    data_,    .
+    NumericColumns numbers_;
+
+    //        . 
+    //          
+    //   .
+    mutable std::unordered_map<int, LookupIndex> lookup_indexes_;
+
+    // ,    
+    RangeDependencies range_dependencies_;
+
+    //     Async.   , 
+    //    .
+    std::unique_ptr<BackgroundRecalculator> recalculator_;
+
     //      ,
     //     NewCell
     void MaybeIncreaseSizeToIncludePosition(Position pos);
@@ -46,7 +217,100 @@ private:
     //     ClearCell 
     void MaybeFitSizeToClearPosition(Position pos);
 
-    std::string GetBoundary(int width) const;
-    void PrintTableHeader(std::ostream& output) const;
+    //    invalidated_,    
+    // Eager,         Async,
+    //       invalidated_.
+    //    GetValue:  
+    //   .
+    void RecalculateInvalidated();
+
+    //   pending_changes_  pos,   
+    //  (changed == true - )
+    void AddPendingChange(Position pos, bool changed);
+
+    //  pending_changes_    
+    void NotifySubscribers();
+
+    //        
+    void ForgetStaleValue(const Cell& cell);
+
+    //     pos  numbers_
+    void UpdateNumber(Position pos, const Cell& cell);
+
+    //  text   pos  ,    , text -
+    //          . 
+    // false,    text .
+    bool SetColumnNumber(Position pos, std::string_view text);
+
+    //   numbers_,      data_
+    std::vector<std::pair<Position, double>> GetColumnNumbers() const;
+
+    //    pos     ,  
+    // , cell == nullptr -  
+    void UpdateLookupIndex(Position pos, Cell* cell);
+
+    //    pos     ,  
+    // .   ,     .
+    void InvalidateLookupValue(Position pos);
+
+    //     col,    
+    LookupIndex& GetLookupIndex(int col) const;
+
+    //   rows  ,     
+    //   condition
+    void FilterRows(const QueryCondition& condition, RowBitmap& rows) const;
+
+    //   numbers_     column_numbers 
+    //     ,    
+    void RebuildNumbers(const std::vector<std::pair<Position, double>>& column_numbers);
+
+    //       ,
+    //      
+    void FitSizeToCells();
+
+    //  count  (rows == true)    before:
+    //          ,
+    //      
+    void InsertLines(bool rows, int before, int count);
+
+    //  count  (rows == true)     first
+    void DeleteLines(bool rows, int first, int count);
+
+    //     cell,    
+    //    (insert == true)     .
+    //       .
+    FormulaInterface::HandlingResult HandleShiftedReferences(Cell* cell, bool rows,
+        bool insert, int first, int count) const;
+
+    //     pos   (dependents == true)  
+    // .       
+    // ,    ,   .
+    std::vector<SheetPosition> CollectRelatedCells(Position pos, bool transitive,
+        bool dependents) const;
+
+    //    range      , 
+    //   .    dirty_formulas_.  
+    //    .
+    void RecalculateRange(Range range) const;
+
+    //   cells    
+    void EvaluateRun(ColumnKernel& kernel, const std::vector<Cell*>& cells) const;
+
+    std::string GetBoundary(int width, Range range) const;
+    void PrintTableHeader(std::ostream& output, Range range) const;
+
+    //   buffer   range   ,
+    //      rows_header_size. 
+    //     ,    : 
+    //     number_formats.
+    void PrintRows(std::string& buffer, Range range, bool values, int rows_header_size,
+        const std::string& boundary, std::uint64_t& number_formats) const;
+
+    //   (values == true)     range.
+    //         , 
+    //   .      , 
+    //   print_threads_,  -   ; 
+    //   .
+    void PrintRange(std::ostream& output, Range range, bool values) const;
 
 };
\ No newline at end of file
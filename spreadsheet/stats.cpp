@@ -0,0 +1,170 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+using namespace std::literals;
+
+void StatsCounters::Increment(Counter& counter, std::uint64_t value) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+void StatsCounters::AddParse(std::chrono::steady_clock::duration duration) {
+    Increment(formula_parses_);
+    Increment(parse_time_ns_,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+void StatsCounters::AddFormulaCacheHit() {
+    Increment(formula_cache_hits_);
+}
+
+void StatsCounters::AddFormulaCacheMiss() {
+    Increment(formula_cache_misses_);
+}
+
+void StatsCounters::AddEvaluation() {
+    Increment(evaluations_);
+}
+
+void StatsCounters::AddCacheHit() {
+    Increment(cache_hits_);
+}
+
+void StatsCounters::AddCacheMiss() {
+    Increment(cache_misses_);
+}
+
+void StatsCounters::AddCycleCheckVisit() {
+    Increment(cycle_check_visits_);
+}
+
+void StatsCounters::AddPlaceholderCell() {
+    Increment(placeholder_cells_);
+}
+
+void StatsCounters::AddKernelRows(std::uint64_t count) {
+    Increment(kernel_rows_, count);
+}
+
+void StatsCounters::AddNumberFormats(std::uint64_t count) {
+    Increment(number_formats_, count);
+}
+
+void StatsCounters::AddLookupIndexBuild() {
+    Increment(lookup_index_builds_);
+}
+
+void StatsCounters::AddInvalidation(std::uint64_t count) {
+    Increment(invalidations_);
+    Increment(invalidated_cells_, count);
+    // Корзина i содержит изменения, затронувшие [2^(i-1), 2^i) ячеек
+    int bucket = 0;
+    while (count > 0 && bucket + 1 < SheetStats::FANOUT_BUCKETS) {
+        count >>= 1;
+        ++bucket;
+    }
+    Increment(invalidation_fanout_[bucket]);
+}
+
+SheetStats StatsCounters::GetSnapshot() const {
+    auto load = [](const Counter& counter) {
+        return counter.load(std::memory_order_relaxed);
+    };
+    SheetStats result;
+    result.formula_parses = load(formula_parses_);
+    result.parse_time_ns = load(parse_time_ns_);
+    result.formula_cache_hits = load(formula_cache_hits_);
+    result.formula_cache_misses = load(formula_cache_misses_);
+    result.evaluations = load(evaluations_);
+    result.cache_hits = load(cache_hits_);
+    result.cache_misses = load(cache_misses_);
+    result.cycle_check_visits = load(cycle_check_visits_);
+    result.placeholder_cells = load(placeholder_cells_);
+    result.invalidations = load(invalidations_);
+    result.invalidated_cells = load(invalidated_cells_);
+    result.kernel_rows = load(kernel_rows_);
+    result.number_formats = load(number_formats_);
+    result.lookup_index_builds = load(lookup_index_builds_);
+    for (int i = 0; i < SheetStats::FANOUT_BUCKETS; ++i) {
+        result.invalidation_fanout[i] = load(invalidation_fanout_[i]);
+    }
+    return result;
+}
+
+std::ostream& operator<<(std::ostream& output, const SheetStats& stats) {
+    output << "formula parses:      "s << stats.formula_parses
+           << " ("s << stats.parse_time_ns / 1000 << " us)\n"s;
+    output << "formula cache:       "s << stats.formula_cache_hits << " / "s
+           << stats.formula_cache_misses << " hits / misses ("s << std::fixed
+           << std::setprecision(1) << stats.FormulaCacheHitRatio() * 100
+           << std::defaultfloat << "% hits)\n"s;
+    output << "evaluations:         "s << stats.evaluations << '\n';
+    output << "cache hits / misses: "s << stats.cache_hits << " / "s << stats.cache_misses << '\n';
+    output << "cycle check visits:  "s << stats.cycle_check_visits << '\n';
+    output << "placeholder cells:   "s << stats.placeholder_cells << '\n';
+    output << "invalidations:       "s << stats.invalidations
+           << " ("s << stats.invalidated_cells << " cells)\n"s;
+    output << "column kernel rows:  "s << stats.kernel_rows << '\n';
+    output << "number formats:      "s << stats.number_formats << '\n';
+    output << "lookup index builds: "s << stats.lookup_index_builds << '\n';
+    output << "invalidation fan-out:\n"s;
+    for (int i = 0; i < SheetStats::FANOUT_BUCKETS; ++i) {
+        if (stats.invalidation_fanout[i] == 0) {
+            continue;
+        }
+        std::uint64_t low = (i == 0) ? 0 : std::uint64_t{1} << (i - 1);
+        std::string high = (i + 1 == SheetStats::FANOUT_BUCKETS) ? "..."s
+            : std::to_string((std::uint64_t{1} << i) - 1);
+        output << std::setw(10) << low << '-' << std::left << std::setw(10) << high
+               << std::right << stats.invalidation_fanout[i] << '\n';
+    }
+    return output;
+}
+
+MemoryUsage& MemoryUsage::operator+=(const MemoryUsage& other) {
+    cells += other.cells;
+    cell_storage += other.cell_storage;
+    text += other.text;
+    formula_ast += other.formula_ast;
+    dependency_edges += other.dependency_edges;
+    cached_values += other.cached_values;
+    hash_table += other.hash_table;
+    numeric_columns += other.numeric_columns;
+    formula_cache += other.formula_cache;
+    lookup_indexes += other.lookup_indexes;
+    return *this;
+}
+
+std::ostream& operator<<(std::ostream& output, const MemoryUsage& usage) {
+    output << "cells:               "s << usage.cells << '\n';
+    output << "cell storage:        "s << usage.cell_storage << " B\n"s;
+    output << "text:                "s << usage.text << " B\n"s;
+    output << "formula AST:         "s << usage.formula_ast << " B\n"s;
+    output << "dependency edges:    "s << usage.dependency_edges << " B\n"s;
+    output << "cached values:       "s << usage.cached_values << " B\n"s;
+    output << "hash table:          "s << usage.hash_table << " B\n"s;
+    output << "numeric columns:     "s << usage.numeric_columns << " B\n"s;
+    output << "formula cache:       "s << usage.formula_cache << " B\n"s;
+    output << "lookup indexes:      "s << usage.lookup_indexes << " B\n"s;
+    output << "total:               "s << usage.Total() << " B ("s
+           << std::fixed << std::setprecision(1) << usage.BytesPerCell()
+           << std::defaultfloat << " B per cell)\n"s;
+    return output;
+}
+
+namespace memory {
+
+std::size_t HeapBlock(std::size_t size) {
+    const std::size_t header = sizeof(std::size_t);
+    const std::size_t alignment = 16;
+    const std::size_t min_block = 32;
+    return std::max(min_block, (size + header + alignment - 1) / alignment * alignment);
+}
+
+std::size_t StringHeap(const std::string& str) {
+    return str.capacity() > std::string{}.capacity() ? HeapBlock(str.capacity() + 1) : 0;
+}
+
+}  // namespace memory
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Счетчики работы таблицы. Обновляются атомарно с relaxed-упорядочиванием,
+// поэтому их можно не отключать в production: каждое обновление стоит
+// одной атомарной операции без барьеров.
+class StatsCounters {
+public:
+    void AddParse(std::chrono::steady_clock::duration duration);
+    void AddFormulaCacheHit();
+    void AddFormulaCacheMiss();
+    void AddEvaluation();
+    void AddCacheHit();
+    void AddCacheMiss();
+    void AddCycleCheckVisit();
+    void AddPlaceholderCell();
+    void AddKernelRows(std::uint64_t count);
+    void AddNumberFormats(std::uint64_t count);
+    void AddLookupIndexBuild();
+
+    // Учитывает одно изменение ячейки, инвалидировавшее count ячеек
+    void AddInvalidation(std::uint64_t count);
+
+    SheetStats GetSnapshot() const;
+
+private:
+    using Counter = std::atomic<std::uint64_t>;
+
+    static void Increment(Counter& counter, std::uint64_t value = 1);
+
+    Counter formula_parses_{0};
+    Counter parse_time_ns_{0};
+    Counter formula_cache_hits_{0};
+    Counter formula_cache_misses_{0};
+    Counter cycle_check_visits_{0};
+    Counter placeholder_cells_{0};
+    Counter invalidations_{0};
+    Counter invalidated_cells_{0};
+    Counter kernel_rows_{0};
+    Counter lookup_index_builds_{0};
+    Counter invalidation_fanout_[SheetStats::FANOUT_BUCKETS] = {};
+    // Счетчики, которые обновляют при чтении значений разные потоки, лежат
+    // в отдельных строках кэша, чтобы потоки не делили строки между собой
+    alignas(64) Counter evaluations_{0};
+    alignas(64) Counter cache_hits_{0};
+    alignas(64) Counter cache_misses_{0};
+    alignas(64) Counter number_formats_{0};
+};
+
+// Оценка размеров блоков динамической памяти для GetMemoryUsage
+namespace memory {
+
+// Размер блока, который распределитель выделяет под size байт:
+// заголовок блока и выравнивание по 16 байт
+std::size_t HeapBlock(std::size_t size);
+
+// Динамическая память строки, короткие строки хранятся внутри объекта
+std::size_t StringHeap(const std::string& str);
+
+// Корзины и узлы хеш-таблицы (unordered_map или unordered_set)
+template <typename HashTable>
+std::size_t HashTableHeap(const HashTable& table) {
+    // Узел хранит указатель на следующий узел, значение и кэшированный хеш
+    const std::size_t node = HeapBlock(sizeof(void*) + sizeof(typename HashTable::value_type)
+        + sizeof(std::size_t));
+    // Таблица из одной корзины хранит ее внутри себя
+    const std::size_t buckets = table.bucket_count() > 1
+        ? HeapBlock(table.bucket_count() * sizeof(void*)) : 0;
+    return buckets + table.size() * node;
+}
+
+// Буфер вектора
+template <typename Vector>
+std::size_t VectorHeap(const Vector& vector) {
+    return vector.capacity() == 0 ? 0
+        : HeapBlock(vector.capacity() * sizeof(typename Vector::value_type));
+}
+
+}  // namespace memory
@@ -0,0 +1,68 @@
+#include "string_pool.h"
+
+#include "stats.h"
+
+#include <cassert>
+#include <utility>
+
+InternedString::InternedString(detail::PooledString* entry)
+    : entry_(entry) {
+    ++entry_->refs;
+}
+
+InternedString::InternedString(const InternedString& other)
+    : entry_(other.entry_) {
+    if (entry_ != nullptr) {
+        ++entry_->refs;
+    }
+}
+
+InternedString::InternedString(InternedString&& other) noexcept
+    : entry_(std::exchange(other.entry_, nullptr)) {
+}
+
+InternedString& InternedString::operator=(InternedString other) noexcept {
+    std::swap(entry_, other.entry_);
+    return *this;
+}
+
+InternedString::~InternedString() {
+    if (entry_ != nullptr && --entry_->refs == 0) {
+        entry_->pool->Release(entry_);
+    }
+}
+
+const std::string& InternedString::Get() const {
+    static const std::string empty;
+    return entry_ != nullptr ? entry_->text : empty;
+}
+
+InternedString StringPool::Intern(std::string text) {
+    auto it = entries_.find(text);
+    if (it == entries_.end()) {
+        auto entry = std::make_unique<detail::PooledString>();
+        entry->text = std::move(text);
+        entry->text.shrink_to_fit();
+        entry->pool = this;
+        std::string_view key = entry->text;
+        it = entries_.emplace(key, std::move(entry)).first;
+    }
+    return InternedString(it->second.get());
+}
+
+std::size_t StringPool::GetSize() const {
+    return entries_.size();
+}
+
+std::size_t StringPool::GetMemoryUsage() const {
+    std::size_t result = memory::HashTableHeap(entries_);
+    for (const auto& [key, entry] : entries_) {
+        result += memory::HeapBlock(sizeof(detail::PooledString)) + memory::StringHeap(entry->text);
+    }
+    return result;
+}
+
+void StringPool::Release(detail::PooledString* entry) {
+    assert(entry->refs == 0);
+    entries_.erase(entry->text);
+}
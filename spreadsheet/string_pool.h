@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+class StringPool;
+
+namespace detail {
+struct PooledString {
+    std::string text;
+    std::size_t refs = 0;
+    StringPool* pool = nullptr;
+};
+}
+
+// Строка из пула: неизменяемый буфер, общий для всех ячеек с одинаковым
+// текстом. Строки одного пула сравниваются сравнением указателей.
+class InternedString {
+public:
+    InternedString() = default;
+    InternedString(const InternedString& other);
+    InternedString(InternedString&& other) noexcept;
+    InternedString& operator=(InternedString other) noexcept;
+    ~InternedString();
+
+    const std::string& Get() const;
+
+    bool operator==(const InternedString& other) const {
+        return entry_ == other.entry_;
+    }
+
+    bool operator!=(const InternedString& other) const {
+        return entry_ != other.entry_;
+    }
+
+private:
+    friend class StringPool;
+
+    explicit InternedString(detail::PooledString* entry);
+
+    detail::PooledString* entry_ = nullptr;
+};
+
+// Пул строк таблицы. Строка удаляется из пула, когда на нее не остается
+// ссылок, поэтому пул должен пережить все свои строки.
+class StringPool {
+public:
+    StringPool() = default;
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    // Возвращает строку пула с текстом text, добавляя ее при необходимости
+    InternedString Intern(std::string text);
+
+    // Число различных строк в пуле
+    std::size_t GetSize() const;
+
+    // Память пула: буферы строк и хеш-таблица
+    std::size_t GetMemoryUsage() const;
+
+private:
+    friend class InternedString;
+
+    // Ключ указывает на текст, хранящийся в самой записи
+    std::unordered_map<std::string_view, std::unique_ptr<detail::PooledString>> entries_;
+
+    void Release(detail::PooledString* entry);
+};
@@ -1,7 +1,8 @@
 #include "common.h"
 
+#include <bitset>
 #include <cctype>
-#include <sstream>
+#include <charconv>
 #include <algorithm>
 
 const int LETTERS = 26;
@@ -59,8 +60,8 @@ Position Position::FromString(std::string_view str) {
     }
 
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (error != std::errc{} || end != digits.data() + digits.size()) {
         return Position::NONE;
     }
 
@@ -75,4 +76,66 @@ Position Position::FromString(std::string_view str) {
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+}
+
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col
+        && pos.col <= last.col;
+}
+
+Size Range::GetSize() const {
+    return { last.row - first.row + 1, last.col - first.col + 1 };
+}
+
+bool SheetPosition::operator==(const SheetPosition& rhs) const {
+    return sheet == rhs.sheet && pos == rhs.pos;
+}
+
+bool SheetPosition::operator<(const SheetPosition& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+}
+
+std::string SheetPosition::ToString() const {
+    if (!pos.IsValid()) {
+        return "";
+    }
+    bool is_identifier = !sheet.empty() && !std::isdigit(static_cast<unsigned char>(sheet[0]))
+        && std::all_of(sheet.begin(), sheet.end(), [](const char c) {
+            return c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')
+                || std::isdigit(static_cast<unsigned char>(c));
+        });
+    std::string result = is_identifier ? sheet : '\'' + sheet + '\'';
+    return result + '!' + pos.ToString();
+}
+bool RowBitmap::Contains(int row) const {
+    const size_t word = static_cast<size_t>(row) / 64;
+    return row >= 0 && word < words.size() && ((words[word] >> (row % 64)) & 1);
+}
+
+int RowBitmap::Count() const {
+    int result = 0;
+    for (auto word : words) {
+        result += static_cast<int>(std::bitset<64>(word).count());
+    }
+    return result;
+}
+
+std::vector<int> RowBitmap::GetRows() const {
+    std::vector<int> result;
+    for (size_t word = 0; word < words.size(); ++word) {
+        for (int bit = 0; bit < 64 && words[word] >> bit != 0; ++bit) {
+            if ((words[word] >> bit) & 1) {
+                result.push_back(static_cast<int>(word * 64) + bit);
+            }
+        }
+    }
+    return result;
+}
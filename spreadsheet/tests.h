@@ -1,15 +1,27 @@
 #pragma once
 
+#include <algorithm>
 #include <limits>
+#include <thread>
 
 #include "common.h"
+#include "trace.h"
 #include "formula.h"
+#include "number_format.h"
+#include "parallel_sort.h"
+#include "protocol.h"
+#include "script.h"
+#include "server.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
 
+inline std::ostream& operator<<(std::ostream& output, const SheetPosition& cell) {
+    return output << cell.sheet << '!' << cell.pos;
+}
+
 inline Position operator"" _pos(const char* str, std::size_t) {
     return Position::FromString(str);
 }
@@ -360,6 +372,1344 @@ namespace {
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 
     }
+
+    void TestInsertRowsAndColumns() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "2");
+        sheet->SetCell("B1"_pos, "=A1+A2");
+        sheet->SetCell("B3"_pos, "=A2*B1");
+
+        sheet->InsertRows(1, 2);
+        ASSERT(sheet->GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetText(), "2");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=A1+A4");
+        ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetText(), "=A4*B1");
+        ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 5, 2 }));
+
+        sheet->InsertColumns(0);
+        ASSERT_EQUAL(sheet->GetCell("C5"_pos)->GetText(), "=B4*C1");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetReferencedCells(), (std::vector{ "B1"_pos, "B4"_pos }));
+
+        //      
+        sheet->SetCell("B4"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("C5"_pos)->GetValue(), CellInterface::Value(30.0));
+
+        bool caught = false;
+        try {
+            sheet->InsertRows(0, Position::MAX_ROWS - 1);
+        }
+        catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetText(), "5");
+    }
+
+    void TestDeleteRowsAndColumns() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "2");
+        sheet->SetCell("A3"_pos, "3");
+        sheet->SetCell("B4"_pos, "=A1+A3");
+        sheet->SetCell("C4"_pos, "=A2");
+        ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        sheet->DeleteRows(1);
+        ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetText(), "=A1+A2");
+        ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet->GetCell("C3"_pos)->GetText(), "=#REF!");
+        ASSERT_EQUAL(sheet->GetCell("C3"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT(sheet->GetCell("C3"_pos)->GetReferencedCells().empty());
+
+        sheet->DeleteColumns(0);
+        ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "=#REF!+#REF!");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 3, 2 }));
+    }
+
+    void TestWorkbookCrossSheetReferences() {
+        auto book = CreateWorkbook();
+        auto main_sheet = book->CreateSheet("Main");
+        auto data = book->CreateSheet("Data");
+        auto quoted = book->CreateSheet("My data");
+        ASSERT_EQUAL(book->GetSheetNames(), (std::vector<std::string>{ "Main", "Data", "My data" }));
+
+        data->SetCell("A1"_pos, "10");
+        quoted->SetCell("C3"_pos, "1");
+        main_sheet->SetCell("A1"_pos, "=Data!A1*2");
+        main_sheet->SetCell("B1"_pos, "='My data'!C3+A1");
+        ASSERT_EQUAL(main_sheet->GetCell("B1"_pos)->GetText(), "='My data'!C3+A1");
+        ASSERT_EQUAL(main_sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(21.0));
+
+        //       
+        data->SetCell("A1"_pos, "4");
+        ASSERT_EQUAL(main_sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(9.0));
+
+        bool caught = false;
+        try {
+            data->SetCell("A1"_pos, "=Main!B1");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(data->GetCell("A1"_pos)->GetText(), "4");
+
+        caught = false;
+        try {
+            main_sheet->SetCell("C1"_pos, "=Missing!A1");
+        }
+        catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(main_sheet->GetCell("C1"_pos) == nullptr);
+
+        caught = false;
+        try {
+            book->CreateSheet("Data");
+        }
+        catch (const InvalidSheetNameException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        data->InsertRows(0);
+        ASSERT_EQUAL(main_sheet->GetCell("A1"_pos)->GetText(), "=Data!A2*2");
+        data->DeleteRows(1);
+        ASSERT_EQUAL(main_sheet->GetCell("A1"_pos)->GetText(), "=#REF!*2");
+        ASSERT_EQUAL(main_sheet->GetCell("B1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Ref));
+    }
+
+    void TestStats() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "=A1*2");
+        sheet->SetCell("A3"_pos, "=A2+A1");
+        sheet->SetCell("A4"_pos, "=A2+A3+C1");
+
+        auto stats = sheet->GetStats();
+        ASSERT_EQUAL(stats.formula_parses, 3u);
+        ASSERT_EQUAL(stats.placeholder_cells, 1u);
+        ASSERT_EQUAL(stats.evaluations, 0u);
+
+        sheet->GetCell("A4"_pos)->GetValue();
+        sheet->GetCell("A4"_pos)->GetValue();
+        stats = sheet->GetStats();
+        ASSERT_EQUAL(stats.evaluations, 3u);
+        //     : A1  , C1 -  .
+        // A2  A3   A4,      .
+        ASSERT_EQUAL(stats.cache_misses, 6u);
+        ASSERT_EQUAL(stats.cache_hits, 4u);
+
+        //  A1  A1, A2, A3  A4
+        auto invalidated = stats.invalidated_cells;
+        sheet->SetCell("A1"_pos, "2");
+        stats = sheet->GetStats();
+        ASSERT_EQUAL(stats.invalidated_cells - invalidated, 4u);
+        ASSERT_EQUAL(stats.invalidation_fanout[3], 1u);
+    }
+
+    void TestTrace() {
+        auto sheet = CreateSheet();
+        trace::Clear();
+        sheet->SetCell("A1"_pos, "=1+2");
+        std::ostringstream empty;
+        trace::WriteChromeTrace(empty);
+        ASSERT(empty.str().find("\"ph\":\"X\"") == std::string::npos);
+
+        trace::Enable(true);
+        sheet->SetCell("B2"_pos, "=A1*2");
+        sheet->GetCell("B2"_pos)->GetValue();
+        sheet->InsertRows(0);
+        sheet->SetCell("A2"_pos, "5");
+        sheet->GetCell("B3"_pos)->GetValue();
+        trace::Enable(false);
+
+        std::ostringstream out;
+        trace::WriteChromeTrace(out);
+        const auto json = out.str();
+        trace::Clear();
+        ASSERT(json.rfind("{\"traceEvents\":[", 0) == 0);
+        ASSERT(json.find("\"name\":\"ParseFormula\"") != std::string::npos);
+        ASSERT(json.find("\"name\":\"Sheet::SetCell\"") != std::string::npos);
+        ASSERT(json.find("\"name\":\"FindCircularDependency\"") != std::string::npos);
+        ASSERT(json.find("\"name\":\"CacheInvalidation\"") != std::string::npos);
+        ASSERT(json.find("\"name\":\"Cell::GetValue\"") != std::string::npos);
+        //      
+        ASSERT(json.find("\"cell\":\"B2\"") != std::string::npos);
+        ASSERT(json.find("\"cell\":\"B3\"") != std::string::npos);
+    }
+
+    void TestMemoryUsage() {
+        auto sheet = CreateSheet();
+        auto usage = sheet->GetMemoryUsage();
+        ASSERT_EQUAL(usage.cells, 0u);
+        ASSERT_EQUAL(usage.Total(), 0u);
+
+        const std::string long_text = "a text that does not fit into a short string";
+        sheet->SetCell("A1"_pos, long_text);
+        usage = sheet->GetMemoryUsage();
+        ASSERT_EQUAL(usage.cells, 1u);
+        ASSERT(usage.text > long_text.size());
+        ASSERT_EQUAL(usage.formula_ast, 0u);
+        ASSERT_EQUAL(usage.dependency_edges, 0u);
+        ASSERT(usage.hash_table > 0);
+
+        //       
+        auto cached = usage.cached_values;
+        sheet->GetCell("A1"_pos)->GetValue();
+        ASSERT_EQUAL(sheet->GetMemoryUsage().cached_values, cached);
+
+        //          
+        sheet->SetCell("B1"_pos, "=(C1+1)*2");
+        usage = sheet->GetMemoryUsage();
+        ASSERT_EQUAL(usage.cells, 3u);
+        ASSERT(usage.formula_ast > 0);
+        ASSERT(usage.dependency_edges > 0);
+        ASSERT_EQUAL(usage.Total(), usage.cell_storage + usage.text + usage.formula_ast
+            + usage.dependency_edges + usage.cached_values + usage.hash_table
+            + usage.formula_cache);
+        ASSERT(usage.BytesPerCell() * 3 == static_cast<double>(usage.Total()));
+
+        //      
+        auto edges = usage.dependency_edges;
+        sheet->ClearCell("B1"_pos);
+        usage = sheet->GetMemoryUsage();
+        ASSERT_EQUAL(usage.formula_ast, 0u);
+        ASSERT(usage.dependency_edges < edges);
+    }
+
+    void TestFormulaConstantFolding() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "2");
+        sheet->SetCell("B1"_pos, "=A1*(60*60*24)");
+        sheet->SetCell("B2"_pos, "=+(2+3)*(4-1)");
+        sheet->SetCell("B3"_pos, "=-(-A1)*1-0");
+        sheet->SetCell("B4"_pos, "=A1+1/0");
+        sheet->SetCell("B5"_pos, "=A1*(1+1e308*10)");
+
+        //      ,    
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=A1*60*60*24");
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "=+(2+3)*(4-1)");
+        ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetText(), "=--A1*1-0");
+
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(172800.0));
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(15.0));
+        ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        //       ,   
+        sheet->InsertRows(0);
+        ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetText(), "=--A2*1-0");
+        sheet->SetCell("A2"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(432000.0));
+        ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetValue(), CellInterface::Value(5.0));
+    }
+
+    void TestColumnKernel() {
+        auto kernel_sheet = CreateSheet();
+        auto plain_sheet = CreateSheet();
+        const int rows = 2500;
+        for (auto sheet : {kernel_sheet.get(), plain_sheet.get()}) {
+            for (int row = 0; row < rows; ++row) {
+                sheet->SetCell({row, 1}, std::to_string(row));
+                sheet->SetCell({row, 2}, (row % 97 == 5) ? "0" : "2");
+                if (row % 101 != 7) {
+                    sheet->SetCell({row, 3}, (row % 89 == 3) ? "text" : "1.5");
+                }
+                auto r = std::to_string(row + 1);
+                sheet->SetCell({row, 4}, "=-(B" + r + "*C" + r + "-D" + r + ")/C" + r + "+0.5");
+            }
+            sheet->SetCell({rows / 2, 4}, "=B1");
+        }
+        kernel_sheet->RecalculateAll();
+        ASSERT_EQUAL(kernel_sheet->GetStats().kernel_rows, static_cast<std::uint64_t>(rows - 1));
+        for (int row = 0; row < rows; ++row) {
+            ASSERT_EQUAL(kernel_sheet->GetCell({row, 4})->GetValue(),
+                plain_sheet->GetCell({row, 4})->GetValue());
+        }
+        ASSERT_EQUAL(kernel_sheet->GetCell({5, 4})->GetValue(),
+            CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(kernel_sheet->GetCell({3, 4})->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+
+        //   ,   
+        kernel_sheet->SetCell("B10"_pos, "1e308");
+        kernel_sheet->SetCell("B20"_pos, "3");
+        kernel_sheet->ClearCell("E20"_pos);
+        const auto evaluations = kernel_sheet->GetStats().evaluations;
+        kernel_sheet->RecalculateAll();
+        ASSERT_EQUAL(kernel_sheet->GetStats().evaluations, evaluations + 1);
+        ASSERT_EQUAL(kernel_sheet->GetCell("E10"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        // ,    ,    
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        for (int row = 1; row < 20; ++row) {
+            sheet->SetCell({row, 0}, "=A" + std::to_string(row) + "*2");
+        }
+        sheet->RecalculateAll();
+        ASSERT_EQUAL(sheet->GetStats().kernel_rows, 0u);
+        ASSERT_EQUAL(sheet->GetCell("A20"_pos)->GetValue(), CellInterface::Value(524288.0));
+    }
+
+    void TestNumericColumns() {
+        auto sheet = CreateSheet();
+        ASSERT_EQUAL(sheet->GetMemoryUsage().numeric_columns, 0u);
+        for (int row = 0; row < 20; ++row) {
+            sheet->SetCell({row, 0}, std::to_string(row));
+            auto r = std::to_string(row + 1);
+            sheet->SetCell({row, 1}, "=A" + r + "*2");
+        }
+        const auto numbers_memory = sheet->GetMemoryUsage().numeric_columns;
+        ASSERT(numbers_memory >= sizeof(double) * 1024);
+
+        //     ,    
+        sheet->SetCell("A5"_pos, "text");
+        sheet->ClearCell("A6"_pos);
+        sheet->SetCell("A7"_pos, "2.5");
+        sheet->RecalculateAll();
+        ASSERT_EQUAL(sheet->GetStats().kernel_rows, 20u);
+        ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(sheet->GetCell("B6"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(sheet->GetCell("B7"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        sheet->InsertRows(0, 3);
+        sheet->SetCell("A10"_pos, "1");
+        sheet->RecalculateAll();
+        ASSERT_EQUAL(sheet->GetCell("B10"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet->GetCell("B23"_pos)->GetValue(), CellInterface::Value(38.0));
+
+        //    
+        for (int row = 0; row < 30; ++row) {
+            sheet->ClearCell({row, 0});
+        }
+        ASSERT(sheet->GetMemoryUsage().numeric_columns < numbers_memory);
+    }
+
+    void TestColumnNumbers() {
+        auto sheet = CreateSheet();
+        const int rows = 4096;
+        for (int row = 0; row < rows; ++row) {
+            sheet->SetCell({row, 0}, std::to_string(row));
+            sheet->SetCell({row, 1}, std::to_string(row % 7) + ".5");
+        }
+        //       ,   
+        auto usage = sheet->GetMemoryUsage();
+        ASSERT_EQUAL(usage.cells, 2u * rows);
+        ASSERT_EQUAL(usage.cell_storage, 0u);
+        ASSERT(usage.BytesPerCell() < 9.0);
+
+        std::ostringstream values, texts;
+        sheet->PrintValues(values, {"A1"_pos, "B10"_pos});
+        sheet->PrintTexts(texts, {"A1"_pos, "B10"_pos});
+        ASSERT_EQUAL(sheet->GetSnapshot("B6"_pos).value, CellInterface::Value(5.5));
+        ASSERT_EQUAL(sheet->QueryRows({"A1"_pos, {rows - 1, 1}},
+            {{0, CompareOp::GreaterOrEqual, 4094.0}}).GetRows(), (std::vector<int>{4094, 4095}));
+        ASSERT_EQUAL(sheet->GetMemoryUsage().cell_storage, 0u);
+
+        //    GetCell   ,   
+        for (int row = 0; row < 10; ++row) {
+            ASSERT_EQUAL(sheet->GetCell({row, 1})->GetText(), std::to_string(row % 7) + ".5");
+        }
+        sheet->SetCell("C1"_pos, "=A2*B2");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.5));
+        ASSERT_EQUAL(sheet->GetMemoryUsage().cells, 2u * rows + 1);
+        std::ostringstream cell_values, cell_texts;
+        sheet->PrintValues(cell_values, {"A1"_pos, "B10"_pos});
+        sheet->PrintTexts(cell_texts, {"A1"_pos, "B10"_pos});
+        ASSERT_EQUAL(cell_values.str(), values.str());
+        ASSERT_EQUAL(cell_texts.str(), texts.str());
+        sheet->SetCell("A2"_pos, "4");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        // ,    ,   
+        sheet->SetCell("D1"_pos, "1.50");
+        sheet->SetCell("D2"_pos, "-0");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetText(), "1.50");
+        ASSERT_EQUAL(sheet->GetCell("D2"_pos)->GetText(), "-0");
+
+        //          
+        sheet->SetCell("E1"_pos, "=MATCH(100,A1:A4096,0)");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(101.0));
+        sheet->SetCell("A50"_pos, "100");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(50.0));
+        ASSERT_EQUAL(sheet->GetPrecedents("E1"_pos, false).size(), static_cast<size_t>(rows));
+
+        //    ,   
+        auto shifted = CreateSheet();
+        for (int row = 0; row < 10; ++row) {
+            shifted->SetCell({row, 0}, std::to_string(10 - row));
+        }
+        shifted->SortRange({"A1"_pos, "A10"_pos}, {});
+        ASSERT_EQUAL(shifted->GetSnapshot("A1"_pos).value, CellInterface::Value(1.0));
+        ASSERT_EQUAL(shifted->GetSnapshot("A10"_pos).value, CellInterface::Value(10.0));
+        shifted->InsertRows(0, 2);
+        ASSERT_EQUAL(shifted->GetSnapshot("A3"_pos).value, CellInterface::Value(1.0));
+        ASSERT_EQUAL(shifted->GetPrintableSize(), (Size{ 12, 1 }));
+        shifted->DeleteRows(0, 3);
+        ASSERT_EQUAL(shifted->GetSnapshot("A1"_pos).value, CellInterface::Value(2.0));
+        ASSERT_EQUAL(shifted->GetPrintableSize(), (Size{ 9, 1 }));
+        shifted->ClearCell("A9"_pos);
+        ASSERT_EQUAL(shifted->GetPrintableSize(), (Size{ 8, 1 }));
+        ASSERT(shifted->GetCell("A9"_pos) == nullptr);
+        ASSERT_EQUAL(shifted->GetMemoryUsage().cells, 8u);
+        ASSERT_EQUAL(shifted->GetMemoryUsage().cell_storage, 0u);
+    }
+
+    void TestStringInterning() {
+        auto plain = CreateSheet();
+        auto pooled = CreateSheet();
+        pooled->SetStringInterning(true);
+        const std::vector<std::string> labels = {
+            "Pending approval by the regional office", "Approved by the regional office", "EUR", "'=USD"};
+        for (auto sheet : {plain.get(), pooled.get()}) {
+            for (int row = 0; row < 400; ++row) {
+                sheet->SetCell({row, 0}, labels[row % labels.size()]);
+                sheet->SetCell({row, 1}, labels[(row + 1) % labels.size()]);
+            }
+            sheet->SetCell("C1"_pos, "=A3");
+        }
+        for (int row = 0; row < 400; ++row) {
+            for (int col = 0; col < 2; ++col) {
+                ASSERT_EQUAL(pooled->GetCell({row, col})->GetText(), plain->GetCell({row, col})->GetText());
+                ASSERT_EQUAL(pooled->GetCell({row, col})->GetValue(), plain->GetCell({row, col})->GetValue());
+            }
+        }
+        ASSERT_EQUAL(pooled->GetCell("A4"_pos)->GetValue(), CellInterface::Value(std::string("=USD")));
+        ASSERT_EQUAL(pooled->GetCell("C1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+
+        //      ,     
+        auto plain_usage = plain->GetMemoryUsage();
+        auto pooled_usage = pooled->GetMemoryUsage();
+        ASSERT(pooled_usage.text * 10 < plain_usage.text);
+        ASSERT(pooled_usage.Total() < plain_usage.Total());
+
+        //        
+        auto invalidations = pooled->GetStats().invalidations;
+        pooled->SetCell("A4"_pos, "'=USD");
+        ASSERT_EQUAL(pooled->GetStats().invalidations, invalidations);
+        //           
+        pooled->SetCell("B4"_pos, "'=1");
+        invalidations = pooled->GetStats().invalidations;
+        pooled->SetCell("B4"_pos, "=1");
+        ASSERT(pooled->GetStats().invalidations > invalidations);
+        ASSERT_EQUAL(pooled->GetCell("B4"_pos)->GetValue(), CellInterface::Value(1.0));
+        invalidations = pooled->GetStats().invalidations;
+        pooled->SetCell("B4"_pos, "=1");
+        ASSERT_EQUAL(pooled->GetStats().invalidations, invalidations);
+
+        // ,     ,   
+        for (int row = 0; row < 400; ++row) {
+            pooled->ClearCell({row, 0});
+            pooled->ClearCell({row, 1});
+        }
+        ASSERT(pooled->GetMemoryUsage().text < pooled_usage.text);
+    }
+
+    void TestEagerRecalculation() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        for (int row = 1; row < 100; ++row) {
+            sheet->SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+        sheet->SetRecalculationMode(RecalculationMode::Eager);
+        ASSERT(sheet->GetRecalculationMode() == RecalculationMode::Eager);
+
+        //    ,     
+        sheet->SetCell("A1"_pos, "5");
+        auto stats = sheet->GetStats();
+        ASSERT_EQUAL(sheet->GetCell("A100"_pos)->GetValue(), CellInterface::Value(104.0));
+        ASSERT_EQUAL(sheet->GetStats().cache_misses, stats.cache_misses);
+        ASSERT_EQUAL(sheet->GetStats().evaluations, stats.evaluations);
+
+        //  ,    ,   
+        sheet->ClearCell("A1"_pos);
+        stats = sheet->GetStats();
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(sheet->GetStats().evaluations, stats.evaluations);
+
+        //        
+        sheet->SetCell("A1"_pos, "1");
+        sheet->DeleteRows(49);
+        stats = sheet->GetStats();
+        ASSERT_EQUAL(sheet->GetCell("A50"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(sheet->GetStats().evaluations, stats.evaluations);
+
+        //       
+        sheet->SetRecalculationMode(RecalculationMode::Lazy);
+        sheet->SetCell("A1"_pos, "2");
+        stats = sheet->GetStats();
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT(sheet->GetStats().evaluations > stats.evaluations);
+    }
+
+    void TestAsyncRecalculation() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        for (int row = 1; row < 1000; ++row) {
+            sheet->SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+        sheet->SetRecalculationMode(RecalculationMode::Async);
+        ASSERT_EQUAL(sheet->GetCell("A1000"_pos)->GetValue(), CellInterface::Value(1000.0));
+
+        //    ,    
+        sheet->SetCell("A1"_pos, "5");
+        auto snapshot = sheet->GetSnapshot("A1000"_pos);
+        ASSERT_EQUAL(snapshot.value, CellInterface::Value(snapshot.stale ? 1000.0 : 1004.0));
+
+        sheet->WaitForRecalculation();
+        auto stats = sheet->GetStats();
+        snapshot = sheet->GetSnapshot("A1000"_pos);
+        ASSERT(!snapshot.stale);
+        ASSERT_EQUAL(snapshot.value, CellInterface::Value(1004.0));
+        ASSERT_EQUAL(sheet->GetStats().evaluations, stats.evaluations);
+
+        //      
+        sheet->SetCell("A1"_pos, "7");
+        ASSERT_EQUAL(sheet->GetCell("A1000"_pos)->GetValue(), CellInterface::Value(1006.0));
+        ASSERT_EQUAL(sheet->GetSnapshot("Z100"_pos).value, CellInterface::Value(std::string{}));
+
+        //      
+        sheet->ClearCell("A1000"_pos);
+        sheet->SetCell("A1000"_pos, "=A1*2");
+        ASSERT_EQUAL(sheet->GetSnapshot("A1000"_pos).value, CellInterface::Value(14.0));
+
+        sheet->SetRecalculationMode(RecalculationMode::Lazy);
+        sheet->SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(sheet->GetCell("A999"_pos)->GetValue(), CellInterface::Value(999.0));
+    }
+
+    void TestDeepChainEvaluation() {
+        //  ,       
+        const int size = 200000;
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        for (int i = 1; i < size; ++i) {
+            Position pos{ i % Position::MAX_ROWS, i / Position::MAX_ROWS };
+            Position prev{ (i - 1) % Position::MAX_ROWS, (i - 1) / Position::MAX_ROWS };
+            sheet->SetCell(pos, "=" + prev.ToString() + "+1");
+        }
+        Position last{ (size - 1) % Position::MAX_ROWS, (size - 1) / Position::MAX_ROWS };
+        ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), CellInterface::Value(double(size)));
+        ASSERT_EQUAL(sheet->GetStats().evaluations, static_cast<std::uint64_t>(size - 1));
+
+        //        
+        sheet->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet->GetCell(last)->GetValue(), CellInterface::Value(double(size + 1)));
+        try {
+            sheet->SetCell("A1"_pos, "=" + last.ToString());
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+    }
+
+    void TestFormulaCache() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("B1"_pos, "3");
+        for (int row = 0; row < 100; ++row) {
+            sheet->SetCell({row, 0}, "=B1*2");
+        }
+        auto stats = sheet->GetStats();
+        ASSERT_EQUAL(stats.formula_parses, 1u);
+        ASSERT_EQUAL(stats.formula_cache_hits, 99u);
+        ASSERT_EQUAL(stats.FormulaCacheHitRatio(), 0.99);
+        ASSERT_EQUAL(sheet->GetCell("A100"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        //        
+        sheet->InsertRows(0);
+        sheet->SetCell("B1"_pos, "4");
+        sheet->SetCell("A1"_pos, "=B1*2");
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "=B2*2");
+        ASSERT_EQUAL(sheet->GetCell("A101"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=B1*2");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+        //     
+        sheet->SetFormulaCacheCapacity(0);
+        sheet->SetCell("C1"_pos, "=B2*2");
+        sheet->SetCell("C2"_pos, "=B2*2");
+        ASSERT_EQUAL(sheet->GetStats().formula_parses, stats.formula_parses + 2);
+
+        //    ,     
+        auto book = CreateWorkbook();
+        auto first = book->CreateSheet("First");
+        auto second = book->CreateSheet("Second");
+        first->SetCell("A1"_pos, "=B1*2+First!B2");
+        first->SetCell("B1"_pos, "1");
+        second->SetCell("B1"_pos, "5");
+        second->SetCell("A1"_pos, "=B1*2+First!B2");
+        ASSERT_EQUAL(second->GetStats().formula_parses, 0u);
+        ASSERT_EQUAL(second->GetStats().formula_cache_hits, 1u);
+        ASSERT_EQUAL(first->GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        first->SetCell("B2"_pos, "100");
+        ASSERT_EQUAL(first->GetCell("A1"_pos)->GetValue(), CellInterface::Value(102.0));
+        ASSERT_EQUAL(second->GetCell("A1"_pos)->GetValue(), CellInterface::Value(110.0));
+
+        //        
+        second->SetFormulaCacheCapacity(0);
+        first->SetCell("C1"_pos, "=B1*2+First!B2");
+        ASSERT_EQUAL(first->GetStats().formula_parses, 2u);
+
+        //      ,  
+        //    
+        for (int row = 0; row < 3000; ++row) {
+            first->SetCell({row, 5}, std::to_string(row));
+        }
+        for (int row = 0; row < 3000; ++row) {
+            first->ClearCell({row, 5});
+            second->SetCell({row, 5}, "text " + std::to_string(row));
+        }
+        ASSERT_EQUAL(second->GetCell("F3000"_pos)->GetValue(), CellInterface::Value(std::string("text 2999")));
+        ASSERT(first->GetCell("F1"_pos) == nullptr);
+    }
+
+    void TestParserSessionReuse() {
+        //         
+        for (int i = 0; i < 100; ++i) {
+            try {
+                ParseFormula("1+(2*" + std::to_string(i));
+                ASSERT(false);
+            }
+            catch (const FormulaException&) {
+            }
+            auto formula = ParseFormula("(A1+" + std::to_string(i) + ")*-2");
+            ASSERT_EQUAL(formula->GetExpression(), "(A1+" + std::to_string(i) + ")*-2");
+            ASSERT_EQUAL(formula->GetReferencedCells(), std::vector{ "A1"_pos });
+        }
+
+        //      
+        std::string expression;
+        std::thread worker([&expression] {
+            expression = ParseFormula("B2/(1-C3)")->GetExpression();
+        });
+        worker.join();
+        ASSERT_EQUAL(expression, "B2/(1-C3)");
+    }
+
+    void TestNumberFormatting() {
+        ASSERT_EQUAL(FormatNumber(0.1 + 0.2), "0.30000000000000004");
+        ASSERT_EQUAL(FormatNumber(100000), "100000");
+        ASSERT_EQUAL(FormatNumber(-2.5), "-2.5");
+        ASSERT_EQUAL(FormatNumber(1e20), "1e+20");
+        ASSERT_EQUAL(FormatNumber(1.5e-7), "1.5e-07");
+        ASSERT_EQUAL(std::stod(FormatNumber(1.0 / 3)), 1.0 / 3);
+        ASSERT_EQUAL(ParseFormula("0.1234567891*2")->GetExpression(), "0.1234567891*2");
+
+        //        
+        char buffer[MAX_NUMBER_TEXT_SIZE];
+        auto to_width = [&buffer](double value, size_t width) {
+            return std::string(buffer, FormatNumber(value, buffer, width));
+        };
+        ASSERT_EQUAL(to_width(1.0 / 3, 12), "0.3333333333");
+        ASSERT_EQUAL(to_width(-1.0 / 3, 12), "-0.333333333");
+        ASSERT_EQUAL(to_width(123456789012345.0, 12), "1.234568e+14");
+        ASSERT_EQUAL(to_width(2.5, 12), "2.5");
+        ASSERT_EQUAL(to_width(-1.7976931348623157e308, MIN_NUMBER_WIDTH), "-2e+308");
+
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1/3");
+        sheet->SetCell("C1"_pos, "=A1*2");
+        std::ostringstream first;
+        sheet->PrintValues(first);
+        ASSERT(first.str().find("|0.3333333333|") != std::string::npos);
+        ASSERT_EQUAL(sheet->GetStats().number_formats, 3u);
+
+        //        
+        std::ostringstream second;
+        sheet->PrintValues(second);
+        ASSERT_EQUAL(second.str(), first.str());
+        ASSERT_EQUAL(sheet->GetStats().number_formats, 3u);
+
+        sheet->SetCell("A1"_pos, "2");
+        std::ostringstream third;
+        sheet->PrintValues(third);
+        ASSERT(third.str().find("|0.6666666667|") != std::string::npos);
+
+        //     
+        std::istringstream lines(third.str());
+        std::string header, line;
+        std::getline(lines, header);
+        while (std::getline(lines, line)) {
+            ASSERT_EQUAL(line.size(), header.size());
+        }
+        ASSERT_EQUAL(sheet->GetStats().number_formats, 6u);
+    }
+
+    void TestParallelPrint() {
+        auto sheet = CreateSheet();
+        for (int row = 0; row < 2000; ++row) {
+            const auto r = std::to_string(row + 1);
+            sheet->SetCell({row, 0}, std::to_string(row * 0.37));
+            sheet->SetCell({row, 1}, "=A" + r + "/3");
+            sheet->SetCell({row, 2}, row % 7 == 0 ? "=1/0" : "text in a long cell " + r);
+            for (int col = 3; col < 10; ++col) {
+                sheet->SetCell({row, col}, "=B" + r + "*" + std::to_string(col));
+            }
+        }
+        //          
+        std::ostringstream serial_values, serial_texts, parallel_values, parallel_texts;
+        sheet->SetPrintThreads(1);
+        sheet->PrintValues(serial_values);
+        sheet->PrintTexts(serial_texts);
+        sheet->SetPrintThreads(4);
+        sheet->PrintValues(parallel_values);
+        sheet->PrintTexts(parallel_texts);
+        ASSERT_EQUAL(parallel_values.str(), serial_values.str());
+        ASSERT_EQUAL(parallel_texts.str(), serial_texts.str());
+
+        //    ,     
+        const auto stats = sheet->GetStats();
+        std::ostringstream again;
+        sheet->PrintValues(again);
+        ASSERT_EQUAL(again.str(), serial_values.str());
+        ASSERT_EQUAL(sheet->GetStats().cache_hits, stats.cache_hits);
+        ASSERT_EQUAL(sheet->GetStats().number_formats, stats.number_formats);
+
+        auto small = CreateSheet();
+        small->SetCell("B2"_pos, "=1/4");
+        small->SetCell("C2"_pos, "x");
+        small->SetCell("B3"_pos, "1e20");
+        small->SetCell("D4"_pos, "outside");
+        small->SetCell("E5"_pos, "=B2*2");
+        std::ostringstream range;
+        small->PrintValues(range, { "B2"_pos, "C3"_pos });
+        //     
+        ASSERT_EQUAL(small->GetStats().evaluations, 1u);
+        ASSERT_EQUAL(range.str(),
+            " |           B|           C|\n"
+            "-|------------|------------|\n"
+            "2|        0.25|           x|\n"
+            "-|------------|------------|\n"
+            "3|       1e+20|            |\n"
+            "-|------------|------------|\n");
+        try {
+            small->PrintTexts(range, { "C3"_pos, "B2"_pos });
+            ASSERT(false);
+        }
+        catch (const InvalidPositionException&) {
+        }
+    }
+
+    void TestChangeNotifications() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1*0");
+        sheet->SetCell("C1"_pos, "=A1+1");
+        sheet->SetRecalculationMode(RecalculationMode::Eager);
+
+        std::vector<ValueChanges> received;
+        auto id = sheet->Subscribe([&received](const ValueChanges& changes) {
+            received.push_back(changes);
+        });
+
+        //  B1  ,     
+        sheet->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(received.size(), 1u);
+        ASSERT_EQUAL(received[0].invalidated,
+            (std::vector<Position>{ "A1"_pos, "B1"_pos, "C1"_pos }));
+        ASSERT_EQUAL(received[0].changed, (std::vector<Position>{ "A1"_pos, "C1"_pos }));
+
+        //        
+        sheet->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(received.size(), 1u);
+
+        //  ,     
+        sheet->SetCell("D5"_pos, "text");
+        sheet->ClearCell("D5"_pos);
+        ASSERT_EQUAL(received.size(), 3u);
+        ASSERT_EQUAL(received[2].changed, (std::vector<Position>{ "D5"_pos }));
+
+        //      , changed 
+        sheet->SetRecalculationMode(RecalculationMode::Lazy);
+        sheet->SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(received.size(), 4u);
+        ASSERT_EQUAL(received[3].invalidated.size(), 3u);
+        ASSERT(received[3].changed.empty());
+
+        //  ,    ,  
+        bool caught = false;
+        try {
+            sheet->SetCell("F1"_pos, "=E7+Missing!A1");
+        }
+        catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(sheet->GetCell("E7"_pos) == nullptr);
+        ASSERT_EQUAL(received.size(), 4u);
+
+        sheet->Unsubscribe(id);
+        sheet->SetCell("A1"_pos, "4");
+        ASSERT_EQUAL(received.size(), 4u);
+    }
+
+    void TestServerProtocol() {
+        auto sheet = CreateSheet();
+        Server server(*sheet, "unused.sock");
+
+        //    ,      
+        std::string requests;
+        protocol::AppendRequest(requests, protocol::Opcode::Set, "A1"_pos, "2");
+        protocol::AppendRequest(requests, protocol::Opcode::Set, "B1"_pos, "=A1*3");
+        protocol::AppendRequest(requests, protocol::Opcode::Get, "B1"_pos);
+        protocol::AppendRequest(requests, protocol::Opcode::Set, "C1"_pos, "=C1");
+        protocol::AppendRequest(requests, protocol::Opcode::Clear, "A1"_pos);
+        protocol::AppendRequest(requests, protocol::Opcode::Set, "A2"_pos, "text");
+        protocol::AppendPrintRange(requests, "A1"_pos, "B2"_pos);
+        protocol::AppendRequest(requests, protocol::Opcode::Get, Position{ 20000, 0 });
+
+        std::string responses;
+        size_t offset = 0;
+        std::uint8_t code = 0;
+        std::string_view data;
+        while (protocol::ReadFrame(requests, offset, code, data) == protocol::FrameResult::Complete) {
+            server.HandleRequest(code, data, responses);
+        }
+        ASSERT_EQUAL(offset, requests.size());
+
+        using protocol::Status;
+        const std::vector<std::pair<Status, std::string>> expected = {
+            {Status::Ok, ""}, {Status::Ok, ""}, {Status::Ok, "6"}, {Status::Error, ""},
+            {Status::Ok, ""}, {Status::Ok, ""}, {Status::Ok, "\t#REF!\ntext\t\n"}, {Status::Error, ""},
+        };
+        offset = 0;
+        for (const auto& [status, value] : expected) {
+            ASSERT(protocol::ReadFrame(responses, offset, code, data) == protocol::FrameResult::Complete);
+            ASSERT_EQUAL(static_cast<int>(code), static_cast<int>(status));
+            if (status == Status::Ok) {
+                ASSERT_EQUAL(std::string(data), value);
+            }
+        }
+        ASSERT_EQUAL(offset, responses.size());
+
+        //    ,    
+        offset = 0;
+        ASSERT(protocol::ReadFrame(std::string_view(requests).substr(0, 6), offset, code, data)
+            == protocol::FrameResult::Incomplete);
+        ASSERT(protocol::ReadFrame(std::string(4, '\0'), offset, code, data) == protocol::FrameResult::Invalid);
+    }
+
+    void TestScript() {
+        auto workbook = CreateWorkbook();
+        auto sheet = workbook->CreateSheet("Sheet1");
+        std::ostringstream output;
+        std::ostringstream errors;
+        ScriptRunner runner(*workbook, sheet, output, errors);
+
+        //     ,   \r\n
+        std::istringstream script(
+            "# comment\n"
+            "set A1 \"2\"\r\n"
+            "  set B1 \"=A1*3\"\n"
+            "\n"
+            "set C1 \"=C1\"\n"
+            "set D1 \"unclosed\n"
+            "print B1\n"
+            "sheet Data\n"
+            "set ZZZZ1 \"x\"\n"
+            "set A1 \"text with spaces\"\n"
+            "unknown A1\n"
+            "print A1");
+        runner.Run(script);
+
+        const auto& stats = runner.GetStats();
+        ASSERT_EQUAL(stats.commands, 10u);
+        ASSERT_EQUAL(stats.errors, 4u);
+        ASSERT_EQUAL(stats.bytes, script.str().size());
+        ASSERT_EQUAL(output.str(), "value: 6; text: =A1*3\nvalue: text with spaces; text: text with spaces\n");
+        ASSERT_EQUAL(errors.str(),
+            "line 5: error: circular dependency\n"
+            "line 6: error, missing quote\n"
+            "line 9: error: invalid position\n"
+            "line 11: error, 'unknown' is not a spreadsheet command\n");
+        ASSERT(workbook->GetSheet("Data")->GetCell("A1"_pos) != nullptr);
+        ASSERT(sheet->GetCell("C1"_pos) == nullptr);
+    }
+
+    void TestCompactCellIds() {
+        auto book = CreateWorkbook();
+        auto main_sheet = book->CreateSheet("Main");
+        auto data = book->CreateSheet("Data");
+        //     ,  
+        //   
+        for (int row = 0; row < 100; ++row) {
+            data->SetCell({row, 3}, "temp");
+        }
+        data->DeleteColumns(3);
+        for (int row = 0; row < 50; ++row) {
+            data->SetCell({row, 0}, std::to_string(row));
+            main_sheet->SetCell({row, 0}, "=Data!A" + std::to_string(row + 1) + "*2");
+            main_sheet->SetCell({row, 1}, "=A" + std::to_string(row + 1) + "+1");
+        }
+        ASSERT_EQUAL(main_sheet->GetCell("B50"_pos)->GetValue(), CellInterface::Value(99.0));
+
+        main_sheet->CompactCellIds();
+
+        //     ,     ,
+        // :    ,  
+        data->SetCell("A50"_pos, "100");
+        ASSERT_EQUAL(main_sheet->GetCell("B50"_pos)->GetValue(), CellInterface::Value(201.0));
+        bool caught = false;
+        try {
+            data->SetCell("A1"_pos, "=Main!B1");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        data->DeleteRows(0);
+        ASSERT_EQUAL(main_sheet->GetCell("B1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(main_sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(3.0));
+        main_sheet->ClearCell("B2"_pos);
+        data->SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(main_sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(10.0));
+    }
+
+    void TestDependentsAndPrecedents() {
+        auto book = CreateWorkbook();
+        auto sheet = book->CreateSheet("Main");
+        auto report = book->CreateSheet("Report");
+        // A1 <- B1 <- C1, A1 <- B2 <- C1 (), C1 <- Report!A1
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1+1");
+        sheet->SetCell("B2"_pos, "=A1*2");
+        sheet->SetCell("C1"_pos, "=B1+B2+D1");
+        report->SetCell("A1"_pos, "=Main!C1");
+
+        auto sorted = [](std::vector<SheetPosition> cells) {
+            std::sort(cells.begin(), cells.end());
+            return cells;
+        };
+        using Cells = std::vector<SheetPosition>;
+        ASSERT_EQUAL(sorted(sheet->GetDependents("A1"_pos, false)),
+            (Cells{ {"Main", "B1"_pos}, {"Main", "B2"_pos} }));
+        ASSERT_EQUAL(sorted(sheet->GetDependents("A1"_pos, true)),
+            (Cells{ {"Main", "B1"_pos}, {"Main", "C1"_pos}, {"Main", "B2"_pos}, {"Report", "A1"_pos} }));
+        ASSERT_EQUAL(sorted(report->GetPrecedents("A1"_pos, false)), (Cells{ {"Main", "C1"_pos} }));
+        //   D1,    ,  
+        ASSERT_EQUAL(sorted(report->GetPrecedents("A1"_pos, true)),
+            (Cells{ {"Main", "A1"_pos}, {"Main", "B1"_pos}, {"Main", "C1"_pos}, {"Main", "D1"_pos},
+                {"Main", "B2"_pos} }));
+        ASSERT(sheet->GetDependents("Z100"_pos, true).empty());
+        ASSERT(sheet->GetPrecedents("A1"_pos, true).empty());
+
+        //     
+        auto chain = CreateSheet();
+        chain->SetCell("A1"_pos, "1");
+        for (int row = 1; row < 10000; ++row) {
+            chain->SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+        ASSERT_EQUAL(chain->GetDependents("A1"_pos, true).size(), 9999u);
+        ASSERT_EQUAL(chain->GetPrecedents("A10000"_pos, true).size(), 9999u);
+        ASSERT_EQUAL(chain->GetPrecedents("A10000"_pos, true).front().sheet, "");
+    }
+
+    void TestLookupFunctions() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "10");
+        sheet->SetCell("A2"_pos, "20");
+        sheet->SetCell("A3"_pos, "30");
+        sheet->SetCell("A4"_pos, "pear");
+        sheet->SetCell("A5"_pos, "apple");
+        for (int row = 0; row < 5; ++row) {
+            sheet->SetCell({row, 1}, std::to_string(row + 1));
+        }
+        sheet->SetCell("D1"_pos, "apple");
+        sheet->SetCell("C1"_pos, "=MATCH(20,A1:A5,0)");
+        sheet->SetCell("C2"_pos, "=VLOOKUP(25,A1:B5,2)");
+        sheet->SetCell("C3"_pos, "=XLOOKUP(D1,A1:A5,B1:B5)");
+        sheet->SetCell("C4"_pos, "=MATCH(25,A1:A5,-1)");
+        sheet->SetCell("C5"_pos, "=XLOOKUP(99,A1:A5,B1:B5)");
+        sheet->SetCell("C6"_pos, "=VLOOKUP(10,A1:B5,3)");
+        sheet->SetCell("C7"_pos, "=1+MATCH(( 50 ),A1:A5,0)");
+
+        auto value = [&sheet](Position pos) {
+            return sheet->GetCell(pos)->GetValue();
+        };
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), "=MATCH(20,A1:A5,0)");
+        ASSERT_EQUAL(sheet->GetCell("C7"_pos)->GetText(), "=1+MATCH(50,A1:A5,0)");
+        ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value("C2"_pos), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value("C3"_pos), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value("C4"_pos), CellInterface::Value(3.0));
+        ASSERT_EQUAL(value("C5"_pos), CellInterface::Value(FormulaError::Category::NotAvailable));
+        ASSERT_EQUAL(value("C6"_pos), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(value("C7"_pos), CellInterface::Value(FormulaError::Category::NotAvailable));
+        ASSERT_EQUAL(sheet->GetStats().lookup_index_builds, 1u);
+        ASSERT(sheet->GetMemoryUsage().lookup_indexes > 0);
+
+        //    ,   
+        // ,      
+        sheet->SetCell("A2"_pos, "25");
+        sheet->SetCell("A5"_pos, "=A1*5");
+        ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(FormulaError::Category::NotAvailable));
+        ASSERT_EQUAL(value("C2"_pos), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value("C3"_pos), CellInterface::Value(FormulaError::Category::NotAvailable));
+        ASSERT_EQUAL(value("C7"_pos), CellInterface::Value(6.0));
+        sheet->ClearCell("A2"_pos);
+        ASSERT_EQUAL(value("C2"_pos), CellInterface::Value(1.0));
+
+        //     A5   , 
+        //  A1  A5  
+        sheet->SetCell("C8"_pos, "=MATCH(55,A1:A5,1)");
+        ASSERT_EQUAL(value("C8"_pos), CellInterface::Value(5.0));
+        sheet->SetCell("A1"_pos, "12");
+        ASSERT_EQUAL(value("C7"_pos), CellInterface::Value(FormulaError::Category::NotAvailable));
+        ASSERT_EQUAL(value("C8"_pos), CellInterface::Value(3.0));
+        sheet->SetCell("C7"_pos, "=1+MATCH(60,A1:A5,0)");
+        ASSERT_EQUAL(value("C7"_pos), CellInterface::Value(6.0));
+        sheet->SetCell("A1"_pos, "10");
+        sheet->ClearCell("C8"_pos);
+        ASSERT_EQUAL(sheet->GetStats().lookup_index_builds, 1u);
+        ASSERT_EQUAL(sheet->GetDependents("A3"_pos, false).size(), 7u);
+
+        //   : C1   A1:A5
+        bool caught = false;
+        try {
+            sheet->SetCell("A3"_pos, "=C1");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "30");
+        caught = false;
+        try {
+            sheet->SetCell("B9"_pos, "=MATCH(1,B1:B10,0)");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        //         
+        auto chain = CreateSheet();
+        chain->SetCell("B1"_pos, "1");
+        chain->SetCell("A1"_pos, "=B1");
+        for (int row = 1; row < 200; ++row) {
+            chain->SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+        chain->SetCell("C1"_pos, "=MATCH(150,A1:A200,0)");
+        ASSERT_EQUAL(chain->GetCell("C1"_pos)->GetValue(), CellInterface::Value(150.0));
+        chain->SetCell("B1"_pos, "2");
+        ASSERT_EQUAL(chain->GetCell("C1"_pos)->GetValue(), CellInterface::Value(149.0));
+        ASSERT_EQUAL(chain->GetStats().evaluations, 402u);
+
+        for (const char* text : {"=SUM(A1:A5)", "=MATCH(1)", "=MATCH(A1:A2,A1:A2)", "=A1:A2"}) {
+            caught = false;
+            try {
+                sheet->SetCell("E1"_pos, text);
+            }
+            catch (const FormulaException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+
+        // ,   ,  
+        auto shifted = CreateSheet();
+        shifted->SetCell("A1"_pos, "1");
+        shifted->SetCell("A2"_pos, "2");
+        shifted->SetCell("A3"_pos, "3");
+        shifted->SetCell("B1"_pos, "=MATCH(3,A1:A3,0)");
+        ASSERT_EQUAL(shifted->GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+        shifted->InsertRows(1);
+        ASSERT_EQUAL(shifted->GetCell("B1"_pos)->GetText(), "=MATCH(3,A1:A4,0)");
+        ASSERT_EQUAL(shifted->GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+        shifted->DeleteRows(2, 2);
+        ASSERT_EQUAL(shifted->GetCell("B1"_pos)->GetText(), "=MATCH(3,A1:A2,0)");
+        ASSERT_EQUAL(shifted->GetCell("B1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::NotAvailable));
+        shifted->SetCell("C5"_pos, "=MATCH(1,A3:A4,0)");
+        shifted->DeleteRows(2, 2);
+        ASSERT_EQUAL(shifted->GetCell("C3"_pos)->GetText(), "=MATCH(1,#REF!,0)");
+        ASSERT_EQUAL(shifted->GetCell("C3"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Ref));
+    }
+
+    void TestConditionalFunctions() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "10");
+        sheet->SetCell("C1"_pos, "=B1*2");
+        sheet->SetCell("D1"_pos, "=IF(A1>0,B1,C1)");
+        auto value = [&sheet](Position pos) {
+            return sheet->GetCell(pos)->GetValue();
+        };
+        auto evaluations = [&sheet] {
+            return sheet->GetStats().evaluations;
+        };
+
+        //    
+        const auto before = evaluations();
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(10.0));
+        ASSERT_EQUAL(evaluations(), before + 1);
+        // C1  ,      D1
+        sheet->SetCell("C1"_pos, "=B1*3");
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(10.0));
+        ASSERT_EQUAL(evaluations(), before + 1);
+        sheet->SetCell("A1"_pos, "-1");
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(30.0));
+        ASSERT_EQUAL(evaluations(), before + 3);
+        sheet->SetCell("B1"_pos, "20");
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(60.0));
+
+        sheet->SetCell("F1"_pos, "abc");
+        sheet->SetCell("F2"_pos, "abd");
+        sheet->SetCell("E1"_pos, "=IFERROR(1/(A1+1),-1)");
+        sheet->SetCell("E2"_pos, "=CHOOSE(A1+3,B1,C1,5)");
+        sheet->SetCell("E3"_pos, "=CHOOSE(A1+5,B1,C1,5)");
+        sheet->SetCell("E4"_pos, "=IF(A1>5,1)");
+        sheet->SetCell("E5"_pos, "=(A1=-1)+(A1<>-1)*10+(A1<=0)*100");
+        sheet->SetCell("E6"_pos, "=F1<F2");
+        sheet->SetCell("E7"_pos, "=F1=B1");
+        sheet->SetCell("E8"_pos, "=IFERROR(E7,F1>=F2)");
+        ASSERT_EQUAL(value("E1"_pos), CellInterface::Value(-1.0));
+        ASSERT_EQUAL(value("E2"_pos), CellInterface::Value(60.0));
+        ASSERT_EQUAL(value("E3"_pos), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(value("E4"_pos), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value("E5"_pos), CellInterface::Value(101.0));
+        ASSERT_EQUAL(value("E6"_pos), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value("E7"_pos), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(value("E8"_pos), CellInterface::Value(0.0));
+
+        const std::pair<std::string, std::string> texts[] = {
+            {"=(1<2)<3", "=1<2<3"},
+            {"=1<(2<3)", "=1<(2<3)"},
+            {"=-(A1<2)", "=-(A1<2)"},
+            {"=(A1>=0)*2", "=(A1>=0)*2"},
+            {"=IF((A1>0),B1,(C1))", "=IF(A1>0,B1,C1)"},
+        };
+        for (const auto& [text, expected] : texts) {
+            sheet->SetCell("G1"_pos, text);
+            ASSERT_EQUAL(sheet->GetCell("G1"_pos)->GetText(), expected);
+        }
+
+        for (const char* text : {"=IF(1)", "=IFERROR(1,2,3)", "=IF(A1:A2,1,2)", "=CHOOSE(1)"}) {
+            bool caught = false;
+            try {
+                sheet->SetCell("G2"_pos, text);
+            }
+            catch (const FormulaException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+        bool caught = false;
+        try {
+            sheet->SetCell("H1"_pos, "=IF(0,H1,1)");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        //       
+        auto chain = CreateSheet();
+        const int rows = 10000;
+        chain->SetCell({0, 0}, "1");
+        for (int row = 1; row < rows; ++row) {
+            chain->SetCell({row, 0}, "=IF(1>0,A" + std::to_string(row) + "+1)");
+        }
+        ASSERT_EQUAL(chain->GetCell({rows - 1, 0})->GetValue(),
+            CellInterface::Value(static_cast<double>(rows)));
+    }
+
+    void TestSortRange() {
+        auto book = CreateWorkbook();
+        auto sheet = book->CreateSheet("Data");
+        auto other = book->CreateSheet("Report");
+        const char* cells[][2] = {
+            {"A1", "3"}, {"B1", "=A1*10"},
+            {"A2", "b"}, {"B2", "'t"},
+            {"A3", "1"}, {"B3", "=A3*10"},
+            {"B4", "x"},
+            {"A5", "2"}, {"B5", "=A5*10"},
+            {"D1", "=B3+A5"},
+            {"D2", "=MATCH(3,A1:A5,0)"},
+        };
+        for (const auto& [pos, text] : cells) {
+            sheet->SetCell(Position::FromString(pos), text);
+        }
+        other->SetCell("A1"_pos, "=Data!A1");
+        auto value = [&sheet](std::string_view pos) {
+            return sheet->GetCell(Position::FromString(pos))->GetValue();
+        };
+        auto text = [&sheet](std::string_view pos) {
+            auto cell = sheet->GetCell(Position::FromString(pos));
+            return cell ? cell->GetText() : std::string{};
+        };
+        ASSERT_EQUAL(value("D2"), CellInterface::Value(1.0));
+        const auto parses = sheet->GetStats().formula_parses;
+
+        //   ,    ,    
+        sheet->SortRange({"A1"_pos, "B5"_pos}, {});
+        const char* sorted[][2] = {
+            {"A1", "1"}, {"B1", "=A1*10"},
+            {"A2", "2"}, {"B2", "=A2*10"},
+            {"A3", "3"}, {"B3", "=A3*10"},
+            {"A4", "b"}, {"B4", "'t"},
+            {"A5", ""}, {"B5", "x"},
+            {"D1", "=B1+A2"},
+        };
+        for (const auto& [pos, expected] : sorted) {
+            ASSERT_EQUAL(text(pos), expected);
+        }
+        ASSERT_EQUAL(value("B1"), CellInterface::Value(10.0));
+        ASSERT_EQUAL(value("D1"), CellInterface::Value(12.0));
+        ASSERT_EQUAL(value("D2"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(other->GetCell("A1"_pos)->GetText(), "=Data!A3");
+        ASSERT_EQUAL(other->GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT_EQUAL(sheet->GetStats().formula_parses, parses);
+        sheet->SetCell("A3"_pos, "7");
+        ASSERT_EQUAL(value("B3"), CellInterface::Value(70.0));
+
+        //    ,     
+        auto table = CreateSheet();
+        const char* rows[][2] = {{"1", "a"}, {"", "b"}, {"2", "c"}, {"1", "d"}, {"2", "e"}};
+        for (int row = 0; row < 5; ++row) {
+            table->SetCell({row, 0}, rows[row][0]);
+            table->SetCell({row, 1}, rows[row][1]);
+        }
+        table->SortRange({{0, 0}, {4, 1}}, {{0, false}});
+        std::string order;
+        for (int row = 0; row < 5; ++row) {
+            order += table->GetCell({row, 1})->GetText();
+        }
+        ASSERT_EQUAL(order, "ceadb");
+        table->SortRange({{0, 0}, {4, 1}}, {{0, true}, {1, false}});
+        order.clear();
+        for (int row = 0; row < 5; ++row) {
+            order += table->GetCell({row, 1})->GetText();
+        }
+        ASSERT_EQUAL(order, "daecb");
+
+        for (const Range& range : {Range{{0, 0}, {4, 1}}, Range{{4, 0}, {0, 1}}}) {
+            bool caught = false;
+            try {
+                table->SortRange(range, {{2, true}});
+            }
+            catch (const InvalidPositionException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+
+        //     std::stable_sort
+        std::vector<std::pair<int, int>> items;
+        for (int i = 0; i < 10007; ++i) {
+            items.push_back({(i * 7919) % 101, i});
+        }
+        auto by_first = [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        };
+        auto expected = items;
+        std::stable_sort(expected.begin(), expected.end(), by_first);
+        for (size_t threads : {1, 2, 3, 4, 7}) {
+            auto actual = items;
+            ParallelStableSort(actual.begin(), actual.end(), by_first, threads);
+            ASSERT(actual == expected);
+        }
+    }
+
+    void TestQueryRows() {
+        auto sheet = CreateSheet();
+        const char* cells[][3] = {
+            {"1500", "EUR", "a"},
+            {"500", "EUR", "b"},
+            {"2000", "USD", "c"},
+            {"=A1+1", "EUR", "d"},
+            {"abc", "EUR", "e"},
+            {"", "EUR", "f"},
+            {"3000", "'EUR", "g"},
+            {"=1/0", "EUR", "h"},
+        };
+        for (int row = 0; row < 8; ++row) {
+            for (int col = 0; col < 3; ++col) {
+                sheet->SetCell({row, col}, cells[row][col]);
+            }
+        }
+        const Range range{{0, 0}, {7, 2}};
+        auto query = [&sheet, &range](const std::vector<QueryCondition>& conditions) {
+            return sheet->QueryRows(range, conditions).GetRows();
+        };
+
+        //    ,    -     
+        const std::vector<QueryCondition> euro_over_1000 = {
+            {1, CompareOp::Equal, std::string("EUR")},
+            {0, CompareOp::Greater, 1000.0},
+        };
+        ASSERT_EQUAL(query(euro_over_1000), (std::vector<int>{0, 3, 6}));
+        ASSERT_EQUAL(query({{0, CompareOp::NotEqual, 1500.0}}), (std::vector<int>{1, 2, 3, 6}));
+        ASSERT_EQUAL(query({{0, CompareOp::LessOrEqual, std::string("b")}}), (std::vector<int>{4}));
+        ASSERT_EQUAL(query({{0, CompareOp::Equal, FormulaError(FormulaError::Category::Arithmetic)}}),
+            (std::vector<int>{7}));
+        ASSERT_EQUAL(query({}).size(), 8u);
+        ASSERT_EQUAL(sheet->QueryRows({{2, 0}, {3, 2}}, euro_over_1000).GetRows(),
+            (std::vector<int>{3}));
+
+        //     
+        sheet->SetCell("A2"_pos, "1200");
+        sheet->SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(query(euro_over_1000), (std::vector<int>{1, 6}));
+
+        bool caught = false;
+        try {
+            sheet->QueryRows(range, {{3, CompareOp::Equal, 1.0}});
+        }
+        catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        //  "nan", "inf"   -     ,
+        //   
+        sheet->SetCell("A5"_pos, "nan");
+        sheet->SetCell("A6"_pos, "inf");
+        sheet->SetCell("A7"_pos, "0x10");
+        ASSERT_EQUAL(query({{0, CompareOp::NotEqual, 1500.0}}), (std::vector<int>{0, 1, 2, 3}));
+        ASSERT_EQUAL(query({{0, CompareOp::Greater, 15.0}}), (std::vector<int>{1, 2}));
+        ASSERT_EQUAL(query({{0, CompareOp::Equal, std::string("nan")}}), (std::vector<int>{4}));
+        for (auto pos : {"A5"_pos, "A6"_pos, "A7"_pos}) {
+            ASSERT(std::holds_alternative<std::string>(sheet->GetCell(pos)->GetValue()));
+        }
+        sheet->SetCell("C1"_pos, "=A5+1");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+
+        //          
+        auto table = CreateSheet();
+        for (int row = 0; row < 3000; ++row) {
+            table->SetCell({row, 0}, std::to_string(row));
+        }
+        auto rows = table->QueryRows({{100, 0}, {2999, 0}}, {
+            {0, CompareOp::GreaterOrEqual, 50.0},
+            {0, CompareOp::Less, 2500.0},
+        });
+        ASSERT_EQUAL(rows.Count(), 2400);
+        ASSERT(!rows.Contains(99));
+        ASSERT(rows.Contains(100));
+        ASSERT(rows.Contains(2499));
+        ASSERT(!rows.Contains(2500));
+    }
 }  // namespace
 namespace test {
     void RunTests() {
@@ -383,5 +1733,32 @@ namespace test {
         RUN_TEST(tr, TestCellReferences);
         RUN_TEST(tr, TestFormulaIncorrect);
         RUN_TEST(tr, TestCellCircularReferences);
+        RUN_TEST(tr, TestInsertRowsAndColumns);
+        RUN_TEST(tr, TestDeleteRowsAndColumns);
+        RUN_TEST(tr, TestWorkbookCrossSheetReferences);
+        RUN_TEST(tr, TestStats);
+        RUN_TEST(tr, TestTrace);
+        RUN_TEST(tr, TestMemoryUsage);
+        RUN_TEST(tr, TestFormulaConstantFolding);
+        RUN_TEST(tr, TestColumnKernel);
+        RUN_TEST(tr, TestNumericColumns);
+        RUN_TEST(tr, TestColumnNumbers);
+        RUN_TEST(tr, TestStringInterning);
+        RUN_TEST(tr, TestEagerRecalculation);
+        RUN_TEST(tr, TestChangeNotifications);
+        RUN_TEST(tr, TestAsyncRecalculation);
+        RUN_TEST(tr, TestDeepChainEvaluation);
+        RUN_TEST(tr, TestFormulaCache);
+        RUN_TEST(tr, TestParserSessionReuse);
+        RUN_TEST(tr, TestNumberFormatting);
+        RUN_TEST(tr, TestParallelPrint);
+        RUN_TEST(tr, TestServerProtocol);
+        RUN_TEST(tr, TestScript);
+        RUN_TEST(tr, TestCompactCellIds);
+        RUN_TEST(tr, TestDependentsAndPrecedents);
+        RUN_TEST(tr, TestLookupFunctions);
+        RUN_TEST(tr, TestConditionalFunctions);
+        RUN_TEST(tr, TestSortRange);
+        RUN_TEST(tr, TestQueryRows);
     }
 }
@@ -0,0 +1,266 @@
+// Нагрузочный клиент сервера таблицы: открывает несколько подключений,
+// в каждом держит заданное число неотвеченных запросов и выводит число
+// запросов в секунду и задержки ответов.
+//
+// Запуск: loadgen путь_к_сокету [подключения] [запросов_на_подключение]
+//         [глубина_конвейера] [доля_записей_в_процентах]
+
+#include "../protocol.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std::literals;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    std::string socket_path;
+    int connections = 8;
+    int requests = 100000;
+    int pipeline = 32;
+    int write_percent = 10;
+};
+
+struct ClientResult {
+    std::vector<std::int64_t> latencies_ns;
+    int errors = 0;
+    std::string failure;
+};
+
+// Запись в закрытое сервером подключение возвращает EPIPE, а не завершает
+// процесс сигналом SIGPIPE
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;
+#endif
+
+int Connect(const std::string& path) {
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("socket path is too long"s);
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        throw std::runtime_error("cannot connect to "s + path + ": "s + std::strerror(errno));
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return fd;
+}
+
+void SendAll(int fd, const std::string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t sent = send(fd, data.data() + offset, data.size() - offset, SEND_FLAGS);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EPIPE || errno == ECONNRESET) {
+                throw std::runtime_error("connection closed by server"s);
+            }
+            throw std::runtime_error("send: "s + std::strerror(errno));
+        }
+        offset += sent;
+    }
+}
+
+// Клиент читает формулы столбца A, заполненные Prepare, и пишет числа
+// в столбец со своим номером, первый клиент - в столбец B, на который
+// ссылаются формулы
+void RunClient(const Options& options, int client, ClientResult& result) {
+    int fd = Connect(options.socket_path);
+    std::mt19937 random(client);
+    std::uniform_int_distribution<int> row_distribution(0, 999);
+    std::uniform_int_distribution<int> percent_distribution(0, 99);
+
+    std::deque<Clock::time_point> in_flight;
+    std::string output;
+    std::string input;
+    int sent = 0;
+    int received = 0;
+    result.latencies_ns.reserve(options.requests);
+
+    auto fill_pipeline = [&] {
+        output.clear();
+        while (sent < options.requests && static_cast<int>(in_flight.size()) < options.pipeline) {
+            Position pos{ row_distribution(random), 0 };
+            if (percent_distribution(random) < options.write_percent) {
+                pos.col = 1 + client;
+                protocol::AppendRequest(output, protocol::Opcode::Set, pos, std::to_string(sent));
+            }
+            else {
+                protocol::AppendRequest(output, protocol::Opcode::Get, pos);
+            }
+            in_flight.push_back(Clock::now());
+            ++sent;
+        }
+        SendAll(fd, output);
+    };
+
+    fill_pipeline();
+    char buffer[64 << 10];
+    while (received < options.requests) {
+        ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+        if (count <= 0) {
+            throw std::runtime_error("connection closed by server"s);
+        }
+        input.append(buffer, count);
+        size_t offset = 0;
+        std::uint8_t status;
+        std::string_view data;
+        while (protocol::ReadFrame(input, offset, status, data) == protocol::FrameResult::Complete) {
+            auto now = Clock::now();
+            result.latencies_ns.push_back(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(now - in_flight.front()).count());
+            in_flight.pop_front();
+            if (status != static_cast<std::uint8_t>(protocol::Status::Ok)) {
+                ++result.errors;
+            }
+            ++received;
+        }
+        input.erase(0, offset);
+        fill_pipeline();
+    }
+    close(fd);
+}
+
+// Заполняет столбец A формулами, которые читают клиенты
+void Prepare(const Options& options) {
+    int fd = Connect(options.socket_path);
+    std::string output;
+    for (int row = 0; row < 1000; ++row) {
+        Position pos{ row, 0 };
+        protocol::AppendRequest(output, protocol::Opcode::Set, pos,
+            "=B"s + std::to_string(row + 1) + "*2+1"s);
+    }
+    SendAll(fd, output);
+    std::string input;
+    char buffer[64 << 10];
+    size_t offset = 0;
+    int received = 0;
+    while (received < 1000) {
+        ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+        if (count <= 0) {
+            throw std::runtime_error("connection closed by server"s);
+        }
+        input.append(buffer, count);
+        std::uint8_t status;
+        std::string_view data;
+        while (protocol::ReadFrame(input, offset, status, data) == protocol::FrameResult::Complete) {
+            ++received;
+        }
+    }
+    close(fd);
+}
+
+// Разбирает целое число из аргумента командной строки целиком
+int ParseNumber(const char* text) {
+    try {
+        size_t parsed = 0;
+        int number = std::stoi(text, &parsed);
+        if (text[parsed] == '\0') {
+            return number;
+        }
+    }
+    catch (const std::logic_error&) {
+    }
+    throw std::invalid_argument("invalid number: "s + text);
+}
+
+double Percentile(const std::vector<std::int64_t>& sorted, double percent) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t index = static_cast<size_t>(percent / 100.0 * (sorted.size() - 1));
+    return sorted[index] / 1000.0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const auto usage = "usage: loadgen socket [connections] [requests] [pipeline] [write%]\n"s;
+    if (argc < 2) {
+        std::cerr << usage;
+        return 1;
+    }
+    Options options;
+    options.socket_path = argv[1];
+    try {
+        int* numbers[] = { &options.connections, &options.requests, &options.pipeline,
+            &options.write_percent };
+        for (int i = 2; i < argc && i - 2 < 4; ++i) {
+            *numbers[i - 2] = std::max(ParseNumber(argv[i]), 1);
+        }
+        if (argc > 5) {
+            options.write_percent = std::clamp(ParseNumber(argv[5]), 0, 100);
+        }
+    }
+    catch (const std::invalid_argument& exc) {
+        std::cerr << "error: "s << exc.what() << '\n' << usage;
+        return 1;
+    }
+
+    try {
+        Prepare(options);
+        std::vector<ClientResult> results(options.connections);
+        std::vector<std::thread> clients;
+        auto start = Clock::now();
+        for (int i = 0; i < options.connections; ++i) {
+            clients.emplace_back([&options, &results, i] {
+                try {
+                    RunClient(options, i, results[i]);
+                }
+                catch (const std::exception& exc) {
+                    results[i].failure = exc.what();
+                }
+            });
+        }
+        for (auto& client : clients) {
+            client.join();
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::vector<std::int64_t> latencies;
+        int errors = 0;
+        for (const auto& result : results) {
+            if (!result.failure.empty()) {
+                throw std::runtime_error(result.failure);
+            }
+            latencies.insert(latencies.end(), result.latencies_ns.begin(), result.latencies_ns.end());
+            errors += result.errors;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << "requests:     "s << latencies.size() << '\n'
+            << "errors:       "s << errors << '\n'
+            << "requests/sec: "s << static_cast<std::int64_t>(latencies.size() / seconds) << '\n'
+            << "latency p50:  "s << Percentile(latencies, 50) << " us\n"s
+            << "latency p99:  "s << Percentile(latencies, 99) << " us\n"s
+            << "latency max:  "s << Percentile(latencies, 100) << " us\n"s;
+    }
+    catch (const std::exception& exc) {
+        std::cerr << "error: "s << exc.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "trace.h"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std::literals;
+
+namespace trace {
+
+namespace detail {
+std::atomic<bool> enabled{false};
+}
+
+namespace {
+
+struct Event {
+    const char* name;
+    Position pos;
+    std::int64_t start_ns;
+    std::int64_t duration_ns;
+};
+
+// Кольцевой буфер событий одного потока, при переполнении
+// перезаписываются самые старые события
+class ThreadBuffer {
+public:
+    static const size_t CAPACITY = 1 << 16;
+
+    explicit ThreadBuffer(int thread_id)
+        : thread_id_(thread_id) {
+        events_.reserve(CAPACITY);
+    }
+
+    void Push(const Event& event) {
+        std::lock_guard guard(mutex_);
+        if (events_.size() < CAPACITY) {
+            events_.push_back(event);
+        }
+        else {
+            events_[next_] = event;
+            next_ = (next_ + 1) % CAPACITY;
+        }
+    }
+
+    void Clear() {
+        std::lock_guard guard(mutex_);
+        events_.clear();
+        next_ = 0;
+    }
+
+    template <typename Func>
+    void ForEach(Func func) const {
+        std::lock_guard guard(mutex_);
+        for (size_t i = 0; i < events_.size(); ++i) {
+            func(events_[(next_ + i) % events_.size()]);
+        }
+    }
+
+    int GetThreadId() const {
+        return thread_id_;
+    }
+
+private:
+    int thread_id_;
+    // Мьютекс захватывается только владельцем буфера и при выгрузке,
+    // поэтому при записи он почти всегда свободен
+    mutable std::mutex mutex_;
+    std::vector<Event> events_;
+    size_t next_ = 0;
+};
+
+// Буферы всех потоков, переживают завершение потоков
+class Registry {
+public:
+    std::shared_ptr<ThreadBuffer> AddThread() {
+        std::lock_guard guard(mutex_);
+        buffers_.push_back(std::make_shared<ThreadBuffer>(static_cast<int>(buffers_.size()) + 1));
+        return buffers_.back();
+    }
+
+    std::vector<std::shared_ptr<ThreadBuffer>> GetBuffers() const {
+        std::lock_guard guard(mutex_);
+        return buffers_;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+};
+
+Registry& GetRegistry() {
+    static Registry registry;
+    return registry;
+}
+
+ThreadBuffer& GetThreadBuffer() {
+    thread_local std::shared_ptr<ThreadBuffer> buffer = GetRegistry().AddThread();
+    return *buffer;
+}
+
+const auto START_TIME = std::chrono::steady_clock::now();
+
+void WriteMicroseconds(std::ostream& output, std::int64_t ns) {
+    output << ns / 1000 << '.';
+    auto fraction = std::to_string(ns % 1000);
+    output << std::string(3 - fraction.size(), '0') << fraction;
+}
+
+}  // namespace
+
+void Enable(bool enabled) {
+    detail::enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void Clear() {
+    for (const auto& buffer : GetRegistry().GetBuffers()) {
+        buffer->Clear();
+    }
+}
+
+void WriteChromeTrace(std::ostream& output) {
+    output << "{\"traceEvents\":["s;
+    bool is_first = true;
+    for (const auto& buffer : GetRegistry().GetBuffers()) {
+        buffer->ForEach([&](const Event& event) {
+            output << (is_first ? "\n"s : ",\n"s);
+            is_first = false;
+            output << "{\"name\":\""s << event.name
+                   << "\",\"cat\":\"spreadsheet\",\"ph\":\"X\",\"ts\":"s;
+            WriteMicroseconds(output, event.start_ns);
+            output << ",\"dur\":"s;
+            WriteMicroseconds(output, event.duration_ns);
+            output << ",\"pid\":1,\"tid\":"s << buffer->GetThreadId();
+            if (event.pos.IsValid()) {
+                output << ",\"args\":{\"cell\":\""s << event.pos.ToString() << "\"}"s;
+            }
+            output << '}';
+        });
+    }
+    output << "\n],\"displayTimeUnit\":\"ns\"}\n"s;
+}
+
+std::int64_t Span::Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - START_TIME).count();
+}
+
+void Span::Record() const {
+    GetThreadBuffer().Push({name_, pos_, start_ns_, Now() - start_ns_});
+}
+
+}  // namespace trace
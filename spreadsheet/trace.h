@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+
+// Трассировка работы таблицы: разбор формул, изменение ячеек, поиск
+// циклических зависимостей, инвалидация кэша и вычисление значений.
+// События записываются в кольцевой буфер своего потока и выгружаются
+// в формате Chrome trace-event JSON (chrome://tracing, Perfetto).
+// Пока трассировка выключена, отрезок стоит одного relaxed-чтения флага.
+namespace trace {
+
+namespace detail {
+extern std::atomic<bool> enabled;
+}
+
+// Включает или выключает запись событий
+void Enable(bool enabled);
+
+inline bool IsEnabled() {
+    return detail::enabled.load(std::memory_order_relaxed);
+}
+
+// Удаляет записанные события
+void Clear();
+
+// Выводит записанные события всех потоков в формате Chrome trace-event JSON
+void WriteChromeTrace(std::ostream& output);
+
+// Отрезок времени от создания до разрушения объекта. Имя должно быть
+// строковым литералом, позиция ячейки выводится в аргументах события.
+class Span {
+public:
+    explicit Span(const char* name, Position pos = Position::NONE)
+        : name_(name)
+        , pos_(pos)
+        , start_ns_(IsEnabled() ? Now() : -1) {
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+    ~Span() {
+        if (start_ns_ >= 0) {
+            Record();
+        }
+    }
+
+private:
+    const char* name_;
+    Position pos_;
+    std::int64_t start_ns_;
+
+    static std::int64_t Now();
+    void Record() const;
+};
+
+}  // namespace trace
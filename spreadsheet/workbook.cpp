@@ -0,0 +1,79 @@
+#include "workbook.h"
+
+using namespace std::literals;
+
+Workbook::~Workbook() {
+    for (const auto& sheet : sheets_) {
+        sheet->SetRecalculationMode(RecalculationMode::Lazy);
+    }
+}
+
+SheetInterface* Workbook::CreateSheet(std::string name) {
+    if (name.empty() || name.find_first_of("!'\r\n"sv) != std::string::npos) {
+        throw InvalidSheetNameException("invalid sheet name"s);
+    }
+    if (sheets_by_name_.count(name) > 0) {
+        throw InvalidSheetNameException("sheet already exists"s);
+    }
+    // Поток пересчета ищет листы по имени при вычислении формул
+    auto lock = LockIfAsync(cells_);
+    sheets_.push_back(std::make_unique<Sheet>(*this, name));
+    Sheet* sheet = sheets_.back().get();
+    sheets_by_name_.emplace(std::move(name), sheet);
+    return sheet;
+}
+
+SheetInterface* Workbook::GetSheet(std::string_view name) {
+    return GetConcreteSheet(name);
+}
+
+const SheetInterface* Workbook::GetSheet(std::string_view name) const {
+    return GetConcreteSheet(name);
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> result;
+    result.reserve(sheets_.size());
+    for (const auto& sheet : sheets_) {
+        result.push_back(sheet->GetName());
+    }
+    return result;
+}
+
+Sheet* Workbook::GetConcreteSheet(std::string_view name) {
+    const auto ptr = sheets_by_name_.find(name);
+    return (ptr != sheets_by_name_.end()) ? ptr->second : nullptr;
+}
+
+const Sheet* Workbook::GetConcreteSheet(std::string_view name) const {
+    const auto ptr = sheets_by_name_.find(name);
+    return (ptr != sheets_by_name_.end()) ? ptr->second : nullptr;
+}
+
+void Workbook::CompactCellIds() {
+    for (const auto& sheet : sheets_) {
+        sheet->WaitForRecalculation();
+    }
+    auto lock = LockIfAsync(cells_);
+    std::vector<Cell*> order;
+    order.reserve(cells_.GetSize());
+    for (const auto& sheet : sheets_) {
+        sheet->AppendCellsInRowOrder(order);
+    }
+    auto new_ids = cells_.Compact(order);
+    for (const auto& sheet : sheets_) {
+        sheet->RemapCellIds(new_ids);
+    }
+}
+
+CellTable& Workbook::GetCellTable() {
+    return cells_;
+}
+
+FormulaCache& Workbook::GetFormulaCache() {
+    return formulas_;
+}
+
+std::unique_ptr<WorkbookInterface> CreateWorkbook() {
+    return std::make_unique<Workbook>();
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Workbook : public WorkbookInterface {
+public:
+    Workbook() = default;
+
+    // Останавливает потоки пересчета всех листов до разрушения ячеек,
+    // так как формулы одного листа ссылаются на ячейки других
+    ~Workbook();
+
+    // Создает новый лист книги,
+    // проверяет корректность и уникальность имени листа
+    SheetInterface* CreateSheet(std::string name) override;
+
+    SheetInterface* GetSheet(std::string_view name) override;
+    const SheetInterface* GetSheet(std::string_view name) const override;
+
+    // Возвращает имена листов в порядке их создания
+    std::vector<std::string> GetSheetNames() const override;
+
+    Sheet* GetConcreteSheet(std::string_view name);
+    const Sheet* GetConcreteSheet(std::string_view name) const;
+
+    void CompactCellIds() override;
+
+    // Возвращает таблицу слотов ячеек всех листов книги
+    CellTable& GetCellTable();
+
+    // Возвращает кэш разобранных формул всех листов книги
+    FormulaCache& GetFormulaCache();
+
+private:
+    // Формула, разобранная на одном листе, не разбирается заново на другом:
+    // дерево разбора не зависит от листа, а ссылки на другие листы хранят
+    // имя листа
+    FormulaCache formulas_;
+
+    // Объявлена раньше листов, ячейки которых освобождают слоты при разрушении
+    CellTable cells_;
+
+    // Листы в порядке создания, ячейки разных листов связаны между собой
+    // указателями, поэтому листы не перемещаются и не удаляются
+    std::vector<std::unique_ptr<Sheet>> sheets_;
+
+    // Индекс листов по имени
+    std::map<std::string, Sheet*, std::less<>> sheets_by_name_;
+};